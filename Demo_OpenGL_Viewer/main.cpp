@@ -6,220 +6,1148 @@
 #include "utils/utils.opencv.h"
 #include "utils/shaders.h"
 #include "utils/timer.h"
+#include "utils/mesh.h"
+#include "utils/projection.h"
+#include "utils/progressive.h"
+#include "utils/scene.h"
+#include "utils/arena.h"
+#include "utils/pyramid.h"
+#include "utils/raycast.h"
+#include "utils/program_cache.h"
+#include "utils/streaming.h"
+#include "utils/panofile.h"
+#include "utils/capture.h"
+#include "utils/resolution.h"
+#include "utils/input_session.h"
+#include "utils/jpeg_decode.h"
+#include "utils/render_server.h"
+#include "utils/depth_upsample.h"
+#include "utils/input_thread.h"
+#include "utils/ingest.h"
+#include "utils/cubemap.h"
+#include "utils/gallery.h"
+#include <csignal>
+#include <memory>
+#include <thread>
 
 using namespace std;
 using namespace cv;
 using namespace kandao;
 
-void buildVAO_Equirectangular(const cv::Mat &frame, const cv::Mat &depth,
-	unsigned int &VAO, unsigned int &n_indices, int n_cols = 200, int n_rows = 100);
-unsigned int makeTextureFromMat(const cv::Mat &src, GLint src_fmt, GLint src_type, GLint dst_fmt);
+struct ViewerOptions
+{
+	string in_fn = "../data/sampla_with_disp_tb.jpg";
+	vector<string> tour;		// more than one input: tour through them with LEFT/RIGHT
+	int gpu_budget_mb = 512;	// --gpu-budget MB: GPU cache size of the tour
+	bool progressive = false;	// --progressive: coarse preview first, refine in background
+	bool on_demand = false;		// --on-demand: redraw only when the view or content changes
+	bool persistent = true;		// --no-persistent: arena uploads through glBufferSubData only
+	bool raymarch = false;		// --raymarch: start with the mesh-free renderer (R toggles)
+	bool compare_render = false;	// --compare-render: alternate renderers every frame, log both GPU times
+	mesh::Tessellation tess = mesh::TESS_GRID;	// --adaptive-mesh: columns follow sin(latitude), no pole slivers
+	float cull_ratio = 0;		// --cull-edges RATIO: drop triangles whose corner depths differ by more than RATIO
+	bool bench_cull = false;	// --bench-cull: shaded fragments along an off-center camera path, culled or not, then exit
+	bool cubemap = false;		// --cubemap: color resampled into a cube map at load and sampled by direction
+	bool bench_cubemap = false;	// --bench-cubemap: GPU time of equirect and cube map color over the same views, then exit
+	mesh::Projection projection = mesh::PROJ_EQUIRECT;	// --projection NAME: layout of the input, meshed without resampling
+	bool bench_projections = false;	// --bench-projections: time the mesh builder of every projection and exit
+	bool bench_raycast = false;	// --bench-raycast: time pyramid ray queries against brute force triangle tests
+	bool shader_cache = true;	// --no-shader-cache: always compile shaders from source
+	int stream_rows = 0;		// --stream ROWS: decode, convert and mesh in strips of ROWS rows
+	string convert_fn;			// --convert OUT: write the input as a native .kpan file, time both loaders and exit
+	double dynamic_ms = 0;		// --dynamic-res MS: offscreen render scale and MSAA follow a GPU frame time target
+	string record_fn;			// --record OUT: capture every drawn frame, frames/%05d.jpg or session.raw
+	string input_fn;			// --record-input FILE: log keys, mouse and camera poses for a later --replay
+	string replay_fn;			// --replay FILE: play a recorded session at a fixed step, then report timings
+	double replay_step = 1. / 60;	// --replay-step S
+	bool headless = false;		// --headless: hidden window, e.g. for replays on a build machine
+	int decode_threads = 0;		// --decode-threads N: JPEG restart intervals decoded in parallel, 0: one per CPU
+	string restarts_fn;			// --add-restarts OUT: losslessly add a restart marker per MCU row, time decode scaling and exit
+	int reduce_depth = 0;		// --reduce-depth F OUT: write the input with 1/F disparity, compare full, 1/2, 1/4 and exit
+	string reduced_fn;
+	int serve_sessions = 0;		// --serve N: render N simulated users from the loaded scene, report throughput and exit
+	int serve_workers = 1;		// --serve-workers K: render threads, each with a context sharing the scene
+	bool input_thread = false;	// --input-thread: draw on a render thread, the main thread only handles input
+	string ingest_dir, ingest_out;	// --ingest DIR OUT: turn panoramas dropped into DIR into .kpan + .kmesh in OUT
+	IngestOptions ingest;		// --ingest-workers R,D,C,M,W and --ingest-queue N
+	bool gallery = false;		// --gallery: every input as a small sphere on a grid, all drawn in one instanced call
+	int bench_gallery = 0;		// --bench-gallery N: gallery frame time as the count doubles up to N, then exit
+};
 
-int main(int argc, char **argv)
+// the --record name reaches format(): only %% and a single %d with optional 0 flag and width are let through
+static bool isFramePattern(const std::string &fn)
 {
-	string in_fn = argc > 1 ? argv[1] : "../data/sampla_with_disp_tb.jpg";
-	Mat in_dat = imread(in_fn);
-	if (in_dat.empty()) {
-		printf("read input frame failed\n");
-		return -1;
+	int n_conversions = 0;
+	for (size_t i = 0; i < fn.size(); ++i) {
+		if (fn[i] != '%')
+			continue;
+		if (++i < fn.size() && fn[i] == '%')
+			continue;
+		while (i < fn.size() && isdigit((unsigned char)fn[i]))
+			++i;
+		if (i == fn.size() || fn[i] != 'd')
+			return false;
+		++n_conversions;
 	}
+	return n_conversions <= 1;
+}
 
-	Mat frame = in_dat.rowRange(0, in_dat.rows / 2);
-	Mat disp = in_dat.rowRange(in_dat.rows / 2, in_dat.rows);
-	Mat depth = opencv::viewableDisp2Original(disp, 0.01f);
+static ViewerOptions parseOptions(int argc, char **argv)
+{
+	ViewerOptions opts;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--progressive")
+			opts.progressive = true;
+		else if (arg == "--on-demand")
+			opts.on_demand = true;
+		else if (arg == "--raymarch")
+			opts.raymarch = true;
+		else if (arg == "--compare-render")
+			opts.compare_render = true;
+		else if (arg == "--stream" && i + 1 < argc)
+			opts.stream_rows = atoi(argv[++i]);
+		else if (arg == "--convert" && i + 1 < argc)
+			opts.convert_fn = argv[++i];
+		else if (arg == "--dynamic-res" && i + 1 < argc)
+			opts.dynamic_ms = atof(argv[++i]);
+		else if (arg == "--record-input" && i + 1 < argc)
+			opts.input_fn = argv[++i];
+		else if (arg == "--replay" && i + 1 < argc)
+			opts.replay_fn = argv[++i];
+		else if (arg == "--replay-step" && i + 1 < argc)
+			opts.replay_step = atof(argv[++i]);
+		else if (arg == "--headless")
+			opts.headless = true;
+		else if (arg == "--decode-threads" && i + 1 < argc)
+			opts.decode_threads = atoi(argv[++i]);
+		else if (arg == "--add-restarts" && i + 1 < argc)
+			opts.restarts_fn = argv[++i];
+		else if (arg == "--reduce-depth" && i + 2 < argc) {
+			opts.reduce_depth = atoi(argv[++i]);
+			opts.reduced_fn = argv[++i];
+		}
+		else if (arg == "--serve" && i + 1 < argc)
+			opts.serve_sessions = atoi(argv[++i]);
+		else if (arg == "--serve-workers" && i + 1 < argc)
+			opts.serve_workers = max(1, atoi(argv[++i]));
+		else if (arg == "--input-thread")
+			opts.input_thread = true;
+		else if (arg == "--ingest" && i + 2 < argc) {
+			opts.ingest_dir = argv[++i];
+			opts.ingest_out = argv[++i];
+		}
+		else if (arg == "--ingest-workers" && i + 1 < argc) {
+			int *w = opts.ingest.workers;
+			if (sscanf(argv[++i], "%d,%d,%d,%d,%d", &w[0], &w[1], &w[2], &w[3], &w[4]) != N_INGEST_STAGES)
+				printf("--ingest-workers wants one count per stage: read,decode,depth,mesh,write\n");
+		}
+		else if (arg == "--ingest-queue" && i + 1 < argc)
+			opts.ingest.queue_capacity = max(1, atoi(argv[++i]));
+		else if (arg == "--gallery")
+			opts.gallery = true;
+		else if (arg == "--bench-gallery" && i + 1 < argc) {
+			opts.gallery = true;
+			opts.bench_gallery = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--record" && i + 1 < argc) {
+			opts.record_fn = argv[++i];
+			if (!isFramePattern(opts.record_fn)) {
+				printf("--record %s: the frame number is a single %%d (e.g. %%05d), other conversions are not allowed\n",
+					opts.record_fn.c_str());
+				opts.record_fn.clear();
+			}
+		}
+		else if (arg == "--no-shader-cache")
+			opts.shader_cache = false;
+		else if (arg == "--bench-raycast")
+			opts.bench_raycast = true;
+		else if (arg == "--projection" && i + 1 < argc) {
+			if (!mesh::parseProjection(argv[++i], opts.projection))
+				printf("unknown projection %s, use equirect, cubemap, fisheye or cylindrical\n", argv[i]);
+		}
+		else if (arg == "--bench-projections")
+			opts.bench_projections = true;
+		else if (arg == "--adaptive-mesh")
+			opts.tess = mesh::TESS_LATITUDE;
+		else if (arg == "--cull-edges" && i + 1 < argc)
+			opts.cull_ratio = atof(argv[++i]);
+		else if (arg == "--bench-cull")
+			opts.bench_cull = true;
+		else if (arg == "--cubemap")
+			opts.cubemap = true;
+		else if (arg == "--bench-cubemap")
+			opts.bench_cubemap = true;
+		else if (arg == "--no-persistent")
+			opts.persistent = false;
+		else if (arg == "--gpu-budget" && i + 1 < argc)
+			opts.gpu_budget_mb = atoi(argv[++i]);
+		else if (arg.compare(0, 2, "--") == 0)
+			printf("unknown option %s\n", arg.c_str());
+		else
+			opts.tour.push_back(arg);
+	}
 
-	///////////////////////////////////// opengl /////////////////////////////////////
-	int SCR_WIDTH = 1000, SCR_HEIGHT = 1000;
-	GLFWwindow *window = OpenGL::initOpenGL(false, SCR_WIDTH, SCR_HEIGHT);
+	if (opts.tour.size() == 1)
+		opts.in_fn = opts.tour.front();
+	if (opts.tour.size() <= 1)
+		opts.tour.clear();
+	return opts;
+}
 
-	///////////////////////////////////// vertex /////////////////////////////////////
-	int n_cols = 1000, n_rows = 500;
-	unsigned int VAO = 0, n_indices = 0;
-	buildVAO_Equirectangular(frame, depth, VAO, n_indices, n_cols, n_rows);
+///////////////////////////////////// renderers /////////////////////////////////////
+enum RenderMode
+{
+	RENDER_MESH,
+	RENDER_RAYMARCH,
+	N_RENDER_MODES,
+};
+static const char *render_mode_names[N_RENDER_MODES] = { "mesh", "raymarch" };
 
-	///////////////////////////////////// texture /////////////////////////////////////
-	unsigned int tex_frame = makeTextureFromMat(frame, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB);
-	unsigned int tex_depth = makeTextureFromMat(depth, GL_RED, GL_FLOAT, GL_R32F);
+static void drawMesh(OpenGL::Shader &shader, Camera &camera, float aspect,
+	const OpenGL::MeshBuffers &mesh, GLuint tex_frame, GLenum tex_target = GL_TEXTURE_2D)
+{
+	glEnable(GL_DEPTH_TEST);
+	shader.use();
 
-	///////////////////////////////////// shader /////////////////////////////////////
-	OpenGL::Shader shader;
-	shader.loadShadersFromString(show_equi_vs, show_texture_fs);
+	// pass projection matrix to shader (note that in this case it could change every frame)
+	glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f);
+	shader.setMat4("projection", projection);
 
-	///////////////////////////////////// main loop /////////////////////////////////////
-	Camera& camera = OpenGL::getDefaultCamera();
-	camera.setPosition(0.f, 0.f, 0.f);
+	// camera/view transformation
+	glm::mat4 view = camera.GetViewMatrix();
+	shader.setMat4("view", view);
 
-	while (!glfwWindowShouldClose(window))
-	{
-		// input
-		OpenGL::processInput(window);
+	glm::mat4 model(1.f);
+	shader.setMat4("model", model);
 
-		// render shader
-		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glEnable(GL_DEPTH_TEST);
+	// draw
+	glBindTexture(tex_target, tex_frame);
+	glBindVertexArray(mesh.VAO);
+	glDrawElements(GL_TRIANGLES, mesh.n_indices, GL_UNSIGNED_INT, (void*)mesh.index_offset);
+	glBindVertexArray(0);
+}
 
-		// pass projection matrix to shader (note that in this case it could change every frame)
-		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-		shader.setMat4("projection", projection);
+// one full-screen triangle, cost scales with output pixels instead of mesh resolution
+static void drawRaymarch(OpenGL::Shader &shader, Camera &camera, float aspect, GLuint empty_vao,
+	GLuint tex_frame, GLuint tex_minmax, int n_levels)
+{
+	glDisable(GL_DEPTH_TEST);
+	shader.use();
 
-		// camera/view transformation
-		glm::mat4 view = camera.GetViewMatrix();
-		shader.setMat4("view", view);
+	glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f);
+	shader.setMat4("inv_view_proj", glm::inverse(projection * camera.GetViewMatrix()));
+	shader.setVec3("eye", camera.Position);
+	shader.setInt("n_levels", n_levels);
+	shader.setInt("max_steps", 128);
+	shader.setInt("texture0", 0);
+	shader.setInt("depth_minmax", 1);
 
-		glm::mat4 model(1.f);
-		shader.setMat4("model", model);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, tex_minmax);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tex_frame);
+	glBindVertexArray(empty_vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+}
 
-		// draw
-		shader.use();
-		glBindTexture(GL_TEXTURE_2D, tex_frame);
-		glBindVertexArray(VAO);
-		glDrawElements(GL_TRIANGLES, n_indices, GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
+// The same depth meshed whole and with its depth edges culled, drawn from views around the capture
+// point: samples rasterized (all of them shaded without early depth rejection), samples still
+// visible after the depth test, and GPU time per view.
+static void benchmarkEdgeCulling(OpenGL::Shader &shader, OpenGL::MeshArena &arena, const Mat &depth, int n_cols,
+	int n_rows, mesh::Tessellation tess, float cull_ratio, GLuint tex_frame, GLenum tex_target, float aspect)
+{
+	mesh::MeshData meshes[2];
+	OpenGL::ArenaMesh uploaded[2];
+	mesh::buildEquirectangular(depth, meshes[0], n_cols, n_rows, tess);
+	mesh::buildEquirectangular(depth, meshes[1], n_cols, n_rows, tess, cull_ratio);
+	if (!arena.upload(meshes[0], uploaded[0]) || !arena.upload(meshes[1], uploaded[1])) {
+		printf("[cull] mesh upload failed\n");
+		arena.release(uploaded[0]);
+		arena.release(uploaded[1]);
+		return;
+	}
+	size_t n_triangles = meshes[1].indices.size() / 3;
+	printf("[cull] ratio %.2f: %zu of %zu triangles culled (%.2f%%)\n", cull_ratio, meshes[1].n_culled, n_triangles,
+		100. * meshes[1].n_culled / max(n_triangles, (size_t)1));
 
-		// poll events
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+	// a quarter of the median depth within the far plane away from the capture point: far enough
+	// for the stretched triangles to stand out, near enough that little else is uncovered
+	vector<float> samples;
+	for (int y = 0; y < depth.rows; y += 8) {
+		const float *row = depth.ptr<float>(y);
+		for (int x = 0; x < depth.cols; x += 8) {
+			if (row[x] > 0 && row[x] < 100)
+				samples.push_back(row[x]);
+		}
+	}
+	float offset = 0.25f;
+	if (!samples.empty()) {
+		nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		offset *= samples[samples.size() / 2];
 	}
 
-	OpenGL::terminateOpenGL();
-	return 0;
-}
+	// circle around the capture point at three heights, each view turned a quarter further
+	const int n_views = 48;
+	GLuint query;
+	glGenQueries(1, &query);
+	OpenGL::GpuTimer timers[2];
+	double rasterized[2] = { 0, 0 }, visible[2] = { 0, 0 };
+	Camera camera;
+	for (int v = 0; v < n_views; ++v) {
+		float angle = 2 * CV_PI * v / n_views;
+		camera.setPosition(offset * cosf(angle), offset * 0.3f * (v % 3 - 1), offset * sinf(angle));
+		camera.setOrientation(glm::degrees(angle) + 90.f * (v % 4), 0.f);
+		for (int m = 0; m < 2; ++m) {
+			for (int pass = 0; pass < 2; ++pass) {
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				glDepthFunc(pass == 0 ? GL_ALWAYS : GL_LESS);
+				glBeginQuery(GL_SAMPLES_PASSED, query);
+				if (pass == 1)
+					timers[m].begin();
+				drawMesh(shader, camera, aspect, uploaded[m].buffers, tex_frame, tex_target);
+				if (pass == 1)
+					timers[m].end();
+				glEndQuery(GL_SAMPLES_PASSED);
 
-static void backward2Point_equi(float u, float v, float &X, float &Y, float &Z)
-{
-	float sinv = sinf(v);
-	X = sinv * sinf(u);
-	Y = -cosf(v);
-	Z = sinv * cosf(u);
+				GLuint n_samples = 0;
+				glGetQueryObjectuiv(query, GL_QUERY_RESULT, &n_samples);
+				(pass == 0 ? rasterized : visible)[m] += n_samples;
+				timers[m].poll();
+			}
+		}
+	}
+	glDepthFunc(GL_LESS);
+	glDeleteQueries(1, &query);
+	arena.release(uploaded[0]);
+	arena.release(uploaded[1]);
+
+	printf("[cull] %d views %.2f off center, samples per view whole -> culled:\n", n_views, offset);
+	printf("[cull]   rasterized %.0f -> %.0f (%.1f%% fewer), visible %.0f -> %.0f, gpu %.3f -> %.3f ms\n",
+		rasterized[0] / n_views, rasterized[1] / n_views, 100. * (1 - rasterized[1] / max(rasterized[0], 1.)),
+		visible[0] / n_views, visible[1] / n_views, timers[0].average(), timers[1].average());
 }
 
-static void makeQuadrangleEqui(const cv::Mat &depth, float x, float y, float w, float h, 
-	std::vector<cv::Vec3f> &quad_3d, std::vector<cv::Vec2f> &quad_2d)
+// Drawing cost of the equirect texture against its cube map over the same views, at the horizon,
+// halfway up and near the poles where equirect rows are oversampled most, with the default and a
+// wide field of view. Both textures are made here, the mesh is shared.
+static void benchmarkCubemap(const Mat &color, GLint src_fmt, const OpenGL::MeshBuffers &mesh, float aspect,
+	OpenGL::ProgramCache *cache)
 {
-	int width = depth.cols, height = depth.rows;
-	quad_3d.resize(4);
-	quad_2d.resize(4);
-
-	// 4 vertex points on source
-	vector<Vec2f> src_xy = {
-		Vec2f(x, y),
-		Vec2f(x + w, y),
-		Vec2f(x + w, y + h),
-		Vec2f(x, y + h),
-	};
+	double t = wallTimeMs();
+	vector<Mat> faces;
+	equirectToCubemap(color, faces);
+	double remap_ms = wallTimeMs() - t;
 
-	// 4 corresponding 3d points
-	for (int i = 0; i < 4; ++i) {
-		// vertex on texture
-		quad_2d[i][0] = src_xy[i][0] / width;
-		quad_2d[i][1] = src_xy[i][1] / height;
+	const char *names[2] = { "equirect", "cubemap" };
+	GLenum targets[2] = { GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP };
+	GLuint textures[2];
+	double upload_ms[2];
+	t = wallTimeMs();
+	textures[0] = OpenGL::makeTextureFromMat(color, src_fmt, GL_UNSIGNED_BYTE, GL_RGB, "bench equirect");
+	glFinish();
+	upload_ms[0] = wallTimeMs() - t;
+	t = wallTimeMs();
+	textures[1] = OpenGL::makeCubemapFromMats(faces, src_fmt, GL_UNSIGNED_BYTE, GL_RGB, "bench cubemap");
+	glFinish();
+	upload_ms[1] = wallTimeMs() - t;
 
-		// to discrete coordinates on frame
-		int xx = round(src_xy[i][0] - 0.5);
-		int yy = round(src_xy[i][1] - 0.5);
-		xx = (xx + width) % width;
-		yy = min(max(yy, 0), height - 1);
-		float d = depth.ptr<float>(yy)[xx];
+	OpenGL::Shader shaders[2];
+	shaders[0].loadShadersFromString(show_equi_vs, show_texture_fs, cache, "mesh");
+	shaders[1].loadShadersFromString(show_equi_dir_vs, show_cubemap_fs, cache, "mesh cubemap");
 
-		// to equirectangular coordinates
-		float u = src_xy[i][0] / width * CV_PI * 2.f - CV_PI;
-		float v = src_xy[i][1] / height * CV_PI;
+	size_t equi_texels = color.total(), cube_texels = N_CUBE_FACES * faces[0].total();
+	printf("[cubemap] %dx%d -> 6 faces of %dx%d, %.1f%% of the texels: remap %.2f ms on %d threads, "
+		"upload + mipmaps %.2f ms (equirect %.2f ms)\n", color.cols, color.rows, faces[0].cols, faces[0].rows,
+		100. * cube_texels / equi_texels, remap_ms, getNumThreads(), upload_ms[1], upload_ms[0]);
 
-		// to 3d points
-		float X, Y, Z;
-		backward2Point_equi(u, v, X, Y, Z);
+	// 8 headings per pitch, both textures drawn back to back from every view; the first round warms up.
+	// Timed on the CPU around glFinish, which is what a software rasterizer like llvmpipe spends
+	const float fovs[2] = { 45.f, 90.f }, pitches[3] = { 0.f, 45.f, 80.f };
+	const int n_rounds = 4, n_headings = 8;
+	double ms[2][2][3] = {};
+	Camera camera;
+	for (int round = 0; round < n_rounds; ++round) {
+		for (int f = 0; f < 2; ++f) {
+			camera.Zoom = fovs[f];
+			for (int p = 0; p < 3; ++p) {
+				for (int h = 0; h < n_headings; ++h) {
+					camera.setOrientation(45.f * h, pitches[p]);
+					for (int m = 0; m < 2; ++m) {
+						glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+						glFinish();
+						t = wallTimeMs();
+						drawMesh(shaders[m], camera, aspect, mesh, textures[m], targets[m]);
+						glFinish();
+						if (round > 0)
+							ms[m][f][p] += wallTimeMs() - t;
+					}
+				}
+			}
+		}
+	}
+	int n_views = (n_rounds - 1) * n_headings;
+	for (int f = 0; f < 2; ++f) {
+		for (int p = 0; p < 3; ++p) {
+			double equi = ms[0][f][p] / n_views, cube = ms[1][f][p] / n_views;
+			printf("[cubemap] fov %2.0f pitch %2.0f: %s %.3f ms, %s %.3f ms (%+.1f%%)\n", fovs[f], pitches[p],
+				names[0], equi, names[1], cube, equi > 0 ? 100. * (cube / equi - 1) : 0.);
+		}
+	}
 
-		// to opengl coordinates
-		quad_3d[i][0] = X  * d;
-		quad_3d[i][1] = -Y * d;
-		quad_3d[i][2] = -Z * d;
+	for (int m = 0; m < 2; ++m) {
+		OpenGL::deleteTexture(textures[m]);
+		glDeleteProgram(shaders[m].ID);
 	}
 }
 
-void buildVAO_Equirectangular(const cv::Mat &frame, const cv::Mat &depth,
-	unsigned int &VAO, unsigned int &n_indices, int n_cols, int n_rows)
+// Ctrl+C ends the ingest service after the files in flight
+static std::atomic<bool> ingest_stop(false);
+
+static void stopIngest(int)
+{
+	ingest_stop = true;
+}
+
+int main(int argc, char **argv)
 {
-	// build upon grids of HW * NH 
-	vector<float> vertices;
-	vertices.reserve(n_cols * n_rows * 5);
-	vector<unsigned int> indices;
-	indices.reserve(n_cols * n_rows * 1.5);
+	TimeLine startup;
+	ViewerOptions opts = parseOptions(argc, argv);
+	// every cv::Mat from here on is counted under its pipeline stage
+	trackMatAllocations();
+
+	int SCR_WIDTH = 1000, SCR_HEIGHT = 1000;
+	int n_cols = 1000, n_rows = 500;
+	const float disp_scale = 0.01f;
+
+	// offline conversion into the native container, no window needed
+	if (!opts.convert_fn.empty()) {
+		if (!convertTopBottom(opts.in_fn, opts.convert_fn, disp_scale))
+			return -1;
+		benchmarkPanoLoad(opts.in_fn, opts.convert_fn, disp_scale);
+		return 0;
+	}
+	if (!opts.restarts_fn.empty()) {
+		if (!addJpegRestarts(opts.in_fn, opts.restarts_fn))
+			return -1;
+		benchmarkJpegDecode(opts.in_fn, opts.decode_threads);
+		benchmarkJpegDecode(opts.restarts_fn, opts.decode_threads);
+		return 0;
+	}
+	if (opts.reduce_depth > 0) {
+		if (!convertReducedDepth(opts.in_fn, opts.reduced_fn, opts.reduce_depth))
+			return -1;
+		benchmarkReducedDepth(opts.in_fn, disp_scale);
+		return 0;
+	}
+	if (opts.bench_projections) {
+		mesh::benchmarkProjections(n_cols, n_rows);
+		return 0;
+	}
+	if (!opts.ingest_dir.empty()) {
+		opts.ingest.n_cols = n_cols;
+		opts.ingest.n_rows = n_rows;
+		opts.ingest.disp_scale = disp_scale;
+		opts.ingest.tess = opts.tess;
+		opts.ingest.cull_ratio = opts.cull_ratio;
+		signal(SIGINT, stopIngest);
+		IngestService service(opts.ingest_dir, opts.ingest_out, opts.ingest);
+		return service.run(ingest_stop) ? 0 : -1;
+	}
+
+	// gallery: thumbnails of all inputs in texture arrays, nothing of the single panorama viewer
+	if (opts.gallery) {
+		GLFWwindow *window = OpenGL::initOpenGL(opts.headless || opts.bench_gallery > 0, SCR_WIDTH, SCR_HEIGHT);
+		unique_ptr<OpenGL::ProgramCache> program_cache;
+		if (opts.shader_cache)
+			program_cache.reset(new OpenGL::ProgramCache("shader_cache.bin"));
+		OpenGL::GalleryOptions gallery_options;
+		gallery_options.disp_scale = disp_scale;
+		OpenGL::Gallery gallery;
+		bool ok = gallery.load(opts.tour.empty() ? vector<string>{ opts.in_fn } : opts.tour, gallery_options,
+			program_cache.get());
+		if (program_cache) {
+			program_cache->save();
+			program_cache->printStats();
+		}
+		if (ok && opts.bench_gallery > 0)
+			OpenGL::benchmarkGallery(gallery, opts.bench_gallery, (float)SCR_WIDTH / SCR_HEIGHT);
+		else if (ok)
+			OpenGL::runGallery(window, gallery, gallery.numLayers(), (float)SCR_WIDTH / SCR_HEIGHT);
+		gallery.release();
+		MemoryTracker::instance().printLeaks();
+		OpenGL::terminateOpenGL();
+		return ok ? 0 : -1;
+	}
+
+	GLFWwindow *window = NULL;
+	// offscreen rendering picks its own MSAA, blitting needs a single-sampled window
+	int window_samples = opts.dynamic_ms > 0 ? 0 : 4;
+	unique_ptr<OpenGL::MeshArena> arena;
+	OpenGL::ArenaMesh arena_mesh;	// owned mesh outside the tour
+	OpenGL::MeshBuffers mesh;		// mesh being drawn
+	unsigned int tex_frame = 0, tex_depth = 0;
+
+	// min/max pyramid for the ray-marched renderer, built when first needed
+	bool need_pyramid = opts.raymarch || opts.compare_render;
+	GLuint tex_minmax = 0;
+	int n_minmax_levels = 0;
+	auto setPyramid = [&](const Mat &depth) {
+		if (!need_pyramid)
+			return;
+		DepthPyramid pyramid;
+		pyramid.build(depth);
+		OpenGL::deleteTexture(tex_minmax);
+		tex_minmax = OpenGL::makeTextureFromMats(pyramid.levels, GL_RG, GL_FLOAT, GL_RG32F, GL_NEAREST_MIPMAP_NEAREST,
+			GL_NEAREST, "minmax pyramid");
+		n_minmax_levels = pyramid.numLevels();
+	};
+
+	Mat in_dat, frame, disp, depth;
+	DepthRaycaster picker;		// built on the first pick
+	RayHit last_pick;
+	ProgressiveLoader loader;
+	vector<OpenGL::ArenaMesh> level_meshes;
+	unique_ptr<SceneManager> scenes;
+	// native input carries finished color levels and depth, so it is never decoded progressively or in strips
+	PanoImage pano;
+	bool native = opts.tour.empty() && isPanoFile(opts.in_fn);
+	if (native && opts.stream_rows > 0) {
+		printf("[pano] %s is a native file, --stream ignored\n", opts.in_fn.c_str());
+		opts.stream_rows = 0;
+	}
+	// only the single-image path meshes other projections; ray-marching and picking assume equirect depth
+	bool equirect = opts.projection == mesh::PROJ_EQUIRECT;
+	if (!equirect && (!opts.tour.empty() || opts.stream_rows > 0)) {
+		printf("[mesh] --projection needs a single, unstreamed input, using equirect\n");
+		opts.projection = mesh::PROJ_EQUIRECT;
+		equirect = true;
+	}
+	if (!equirect)
+		need_pyramid = opts.raymarch = opts.compare_render = false;
+	if (!opts.tour.empty() || opts.stream_rows > 0 || native || !equirect || opts.serve_sessions > 0)
+		opts.progressive = false;
+	// the cube map is made from the whole color once, and only the mesh renderer samples it
+	bool whole_equirect = opts.tour.empty() && opts.stream_rows == 0 && !opts.progressive && equirect;
+	if ((opts.cubemap || opts.bench_cubemap) && (!whole_equirect || opts.serve_sessions > 0)) {
+		printf("[cubemap] needs a single equirect input loaded whole, not a tour, --stream, --progressive or --serve\n");
+		opts.cubemap = opts.bench_cubemap = false;
+	}
+	if (opts.cubemap)
+		need_pyramid = opts.raymarch = opts.compare_render = false;
+	GLenum frame_target = opts.cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	Mat bench_color;
+	bool full_texture = !opts.progressive, full_quality = !opts.progressive;
+
+	if (!opts.tour.empty()) {
+		window = OpenGL::initOpenGL(opts.headless, SCR_WIDTH, SCR_HEIGHT, window_samples);
+		arena.reset(new OpenGL::MeshArena(64 << 20, 32 << 20, opts.persistent));
+
+		// the tour owns every mesh and texture, the loop only borrows the current one
+		scenes.reset(new SceneManager(opts.tour, *arena, (size_t)opts.gpu_budget_mb << 20, n_cols, n_rows, disp_scale,
+			2, need_pyramid));
+		scenes->tess = opts.tess;
+		scenes->cull_ratio = opts.cull_ratio;
+		const SceneGPU *scene = scenes->select(0);
+		if (!scene) {
+			printf("read input frame failed\n");
+			return -1;
+		}
+		mesh = scene->mesh.buffers;
+		tex_frame = scene->tex_frame;
+		tex_depth = scene->tex_depth;
+		tex_minmax = scene->tex_minmax;
+		n_minmax_levels = scene->n_minmax_levels;
+	}
+	else if (opts.stream_rows > 0) {
+		// never holds the whole image, its depth or a CPU copy of the mesh; picking and
+		// ray-marching need the full depth and stay off
+		window = OpenGL::initOpenGL(opts.headless, SCR_WIDTH, SCR_HEIGHT, window_samples);
+		arena.reset(new OpenGL::MeshArena(64 << 20, 32 << 20, opts.persistent));
+		StreamStats stream;
+		if (!streamPanorama(opts.in_fn, disp_scale, n_cols, n_rows, opts.tess, opts.cull_ratio, opts.stream_rows, *arena,
+			arena_mesh, tex_frame, tex_depth, stream)) {
+			printf("read input frame failed\n");
+			return -1;
+		}
+		mesh = arena_mesh.buffers;
+		need_pyramid = false;
+		printf("[stream] %d strips of %d rows in %.2f ms, peak working set %.1f MB (%s), %.1f MB loading at once\n",
+			stream.n_strips, opts.stream_rows, stream.total_ms, stream.peak_bytes / 1048576.,
+			stream.bounded ? "scanline decode" : "whole image decoded", stream.whole_bytes / 1048576.);
+		if (opts.cull_ratio > 0)
+			printf("[stream] %zu triangles culled at depth edges\n", stream.n_culled);
+	}
+	else if (!opts.progressive) {
+		if (native) {
+			if (!loadPanoFile(opts.in_fn, pano)) {
+				printf("read input frame failed\n");
+				return -1;
+			}
+			depth = pano.depth;
+			startup.mark("native load");
+		}
+		else {
+			{
+				MemoryStage stage("decode");
+				JpegDecodeStats decode;
+				if (decodeJpeg(opts.in_fn, in_dat, opts.decode_threads, &decode))
+					printf("[jpeg] decoded in %.2f ms on %d threads, %d chunks\n", decode.decode_ms, decode.n_threads,
+						decode.n_chunks);
+			}
+			if (in_dat.empty()) {
+				printf("read input frame failed\n");
+				return -1;
+			}
+
+			// reduced disparity comes back upsampled to the color
+			splitTopBottom(in_dat, frame, disp);
+			depth = opencv::viewableDisp2Original(disp, disp_scale);
+			startup.mark("decode + depth");
+		}
 
-	float width = frame.cols, height = frame.rows;
-	float w = width / (n_cols - 1), h = height / (n_rows - 1);
+		///////////////////////////////////// opengl /////////////////////////////////////
+		window = OpenGL::initOpenGL(opts.headless, SCR_WIDTH, SCR_HEIGHT, window_samples);
+		arena.reset(new OpenGL::MeshArena(64 << 20, 32 << 20, opts.persistent));
 
-	startCpuTimer(gen_vertices);
-	for (int i = 0; i < n_rows - 1; ++i) {
-		for (int j = 0; j < n_cols - 1; ++j) {
-			vector<Vec3f> quad_3d;
-			vector<Vec2f> quad_2d;
+		///////////////////////////////////// vertex /////////////////////////////////////
+		// vertices go straight into the mapped arena range when persistent mapping is available
+		size_t n_vertices, n_indices;
+		if (equirect)
+			mesh::countEquirectangular(n_cols, n_rows, n_vertices, n_indices, opts.tess);
+		else
+			mesh::countProjected(opts.projection, n_cols, n_rows, n_vertices, n_indices);
+		if (!arena->allocate(n_vertices, n_indices, arena_mesh)) {
+			printf("read input frame failed\n");
+			return -1;
+		}
+		size_t n_culled = 0;
+		startCpuTimer(gen_vertices);
+		if (equirect)
+			n_culled = mesh::buildEquirectangular(depth, n_cols, n_rows, arena_mesh.vertices, arena_mesh.indices, opts.tess,
+				opts.cull_ratio);
+		else
+			mesh::buildProjected(opts.projection, depth, n_cols, n_rows, arena_mesh.vertices, arena_mesh.indices);
+		stopCpuTimer(gen_vertices);
+		if (equirect)
+			printf("[mesh] %dx%d %s: %zu vertices, %zu triangles (shared grid would need %d vertices)\n", n_cols, n_rows,
+				opts.tess == mesh::TESS_LATITUDE ? "latitude" : "grid", n_vertices, n_indices / 3, n_cols * n_rows);
+		else
+			printf("[mesh] %dx%d %s: %zu vertices, %zu triangles\n", n_cols, n_rows, mesh::projectionName(opts.projection),
+				n_vertices, n_indices / 3);
+		// only the equirect builders cull
+		if (equirect && opts.cull_ratio > 0)
+			printf("[mesh] %zu triangles culled at depth edges, corner depths more than %.2fx apart\n", n_culled,
+				opts.cull_ratio);
+		arena->commit(arena_mesh);
+		mesh = arena_mesh.buffers;
 
-			float y = i * h, x = j * w;
-			makeQuadrangleEqui(depth, x, y, w, h, quad_3d, quad_2d);
+		if (opts.bench_raycast && equirect) {
+			mesh::MeshData bench_mesh;
+			mesh::buildEquirectangular(depth, bench_mesh, n_cols, n_rows, opts.tess);
+			benchmarkRaycast(depth, bench_mesh, 1024);
+		}
 
-			int k = vertices.size() / 5;
+		///////////////////////////////////// texture /////////////////////////////////////
+		// native color comes with its mip chain, nothing is generated on the GPU
+		if (opts.bench_cubemap)
+			bench_color = native ? pano.color[0] : frame;
+		if (opts.cubemap) {
+			double t = wallTimeMs();
+			vector<Mat> faces;
+			equirectToCubemap(native ? pano.color[0] : frame, faces);
+			tex_frame = OpenGL::makeCubemapFromMats(faces, native ? GL_BGRA : GL_BGR, GL_UNSIGNED_BYTE, GL_RGB,
+				"frame cubemap");
+			printf("[cubemap] 6 faces of %dx%d in %.2f ms\n", faces[0].cols, faces[0].rows, wallTimeMs() - t);
+		}
+		else if (native)
+			tex_frame = OpenGL::makeTextureFromMats(pano.color, GL_BGRA, GL_UNSIGNED_BYTE, GL_RGB, GL_LINEAR, GL_LINEAR,
+				"frame color");
+		else
+			tex_frame = OpenGL::makeTextureFromMat(frame, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB, "frame color");
+		tex_depth = OpenGL::makeTextureFromMat(depth, GL_RED, GL_FLOAT, GL_R32F, "depth");
+		setPyramid(depth);
+		pano.color.clear();
+	}
+	else {
+		// context first so the preview can reach the screen as soon as pixels are decoded
+		window = OpenGL::initOpenGL(opts.headless, SCR_WIDTH, SCR_HEIGHT, window_samples);
+		arena.reset(new OpenGL::MeshArena(64 << 20, 32 << 20, opts.persistent));
+		startup.mark("context");
 
-			for (int i = 0; i < 4; ++i) {
-				vertices.push_back(quad_3d[i][0]);
-				vertices.push_back(quad_3d[i][1]);
-				vertices.push_back(quad_3d[i][2]);
-				vertices.push_back(quad_2d[i][0]);
-				vertices.push_back(quad_2d[i][1]);
+		// only a 1/8 scale decode stands between the context and the preview, the full decode
+		// runs on the loader thread
+		Mat small_frame, small_disp;
+		if (!ProgressiveLoader::decodePreview(opts.in_fn, small_frame, small_disp)) {
+			printf("read input frame failed\n");
+			return -1;
+		}
+		startup.mark("preview decode");
+
+		// the preview meshes reduced disparity as stored, the loader upsamples it in the background
+		Mat preview_frame, preview_depth;
+		mesh::MeshData preview_mesh;
+		ProgressiveLoader::buildPreview(small_frame, small_disp, disp_scale, Size(128, 64), preview_frame, preview_depth, preview_mesh,
+			opts.tess, opts.cull_ratio);
+		startup.mark("preview mesh 128x64");
+
+		// refine 256x128 -> 512x256 -> full grid in the background, each level written into its arena range
+		vector<Size> grids = { Size(256, 128), Size(512, 256), Size(n_cols, n_rows) };
+		vector<ProgressiveLoader::Target> targets(grids.size());
+		level_meshes.resize(grids.size());
+		for (size_t i = 0; i < grids.size(); ++i) {
+			size_t n_vertices, n_indices;
+			mesh::countEquirectangular(grids[i].width, grids[i].height, n_vertices, n_indices, opts.tess);
+			if (arena->allocate(n_vertices, n_indices, level_meshes[i])) {
+				targets[i].vertices = level_meshes[i].vertices;
+				targets[i].indices = level_meshes[i].indices;
 			}
+		}
+		loader.notify = glfwPostEmptyEvent;
+		loader.tess = opts.tess;
+		loader.cull_ratio = opts.cull_ratio;
+		// before the loader starts writing into the arena, so failing here leaves nothing running
+		if (!arena->upload(preview_mesh, arena_mesh)) {
+			printf("read input frame failed\n");
+			return -1;
+		}
+		loader.start(opts.in_fn, opts.decode_threads, disp_scale, grids, targets);
+
+		mesh = arena_mesh.buffers;
+		tex_frame = OpenGL::makeTextureFromMat(preview_frame, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB, "preview color");
+		tex_depth = OpenGL::makeTextureFromMat(preview_depth, GL_RED, GL_FLOAT, GL_R32F, "preview depth");
+		setPyramid(preview_depth);
+		depth = preview_depth;
+		startup.mark("preview upload");
+	}
+
+	///////////////////////////////////// shader /////////////////////////////////////
+	// linked binaries are kept in the working directory, keyed by source and driver
+	unique_ptr<OpenGL::ProgramCache> program_cache;
+	if (opts.shader_cache)
+		program_cache.reset(new OpenGL::ProgramCache("shader_cache.bin"));
+	OpenGL::Shader shader, raymarch_shader;
+	if (frame_target == GL_TEXTURE_CUBE_MAP)
+		shader.loadShadersFromString(show_equi_dir_vs, show_cubemap_fs, program_cache.get(), "mesh cubemap");
+	else
+		shader.loadShadersFromString(show_equi_vs, show_texture_fs, program_cache.get(), "mesh");
+	raymarch_shader.loadShadersFromString(fullscreen_vs, raymarch_equi_fs, program_cache.get(), "raymarch");
+	if (program_cache) {
+		program_cache->save();
+		program_cache->printStats();
+	}
+	startup.mark("shaders");
 
-			// index to draw triangles
-			indices.push_back(k + 0);
-			indices.push_back(k + 1);
-			indices.push_back(k + 3);
-			indices.push_back(k + 1);
-			indices.push_back(k + 2);
-			indices.push_back(k + 3);
+	// core profile needs some VAO bound even for attribute-less draws
+	GLuint empty_vao;
+	glGenVertexArrays(1, &empty_vao);
+
+	RenderMode render_mode = (opts.raymarch && tex_minmax) ? RENDER_RAYMARCH : RENDER_MESH;
+	OpenGL::GpuTimer gpu_timers[N_RENDER_MODES];
+
+	// screenshots (C) and recording read the back buffer asynchronously
+	OpenGL::FrameCapture capture;
+
+	// dynamic resolution: the scene goes into an offscreen target sized by the controller
+	unique_ptr<OpenGL::ResolutionController> dynres;
+	OpenGL::RenderTarget render_target;
+	if (opts.dynamic_ms > 0) {
+		GLint max_samples = 0;
+		glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+		dynres.reset(new OpenGL::ResolutionController(opts.dynamic_ms, 0.5f, min(4, (int)max_samples)));
+		dynres->printState("start");
+	}
+	bool recording = !opts.record_fn.empty(), want_screenshot = false;
+	int n_screenshots = 0;
+	MemoryTracker::instance().report(0);
+
+	///////////////////////////////////// edge culling /////////////////////////////////////
+	// 8-bit disparity steps alone exceed small ratios far away, 1.5 when no --cull-edges was given
+	if (opts.bench_cull) {
+		if (scenes || opts.progressive || depth.empty() || !equirect)
+			printf("[cull] --bench-cull needs a single equirect input, not a tour, --stream or --progressive\n");
+		else
+			benchmarkEdgeCulling(shader, *arena, depth, n_cols, n_rows, opts.tess,
+				opts.cull_ratio > 0 ? opts.cull_ratio : 1.5f, tex_frame, frame_target, (float)SCR_WIDTH / SCR_HEIGHT);
+		glfwSetWindowShouldClose(window, true);
+	}
+
+	///////////////////////////////////// cube map /////////////////////////////////////
+	if (opts.bench_cubemap) {
+		benchmarkCubemap(bench_color, native ? GL_BGRA : GL_BGR, mesh, (float)SCR_WIDTH / SCR_HEIGHT,
+			program_cache.get());
+		bench_color.release();
+		glfwSetWindowShouldClose(window, true);
+	}
+
+	///////////////////////////////////// server /////////////////////////////////////
+	// simulated users share the mesh and texture through contexts of their own, each worker links
+	// the program again; the window only holds the primary context
+	if (opts.serve_sessions > 0) {
+		if (scenes) {
+			printf("[server] needs a single input, not a tour\n");
 		}
+		else {
+			OpenGL::SharedScene shared;
+			shared.VBO = mesh.VBO;
+			shared.EBO = mesh.EBO;
+			shared.vertex_offset = arena_mesh.vertex_range.offset;
+			shared.index_offset = mesh.index_offset;
+			shared.n_indices = mesh.n_indices;
+			shared.tex_frame = tex_frame;
+			shared.vertex_shader = show_equi_vs;
+			shared.fragment_shader = show_texture_fs;
+			OpenGL::benchmarkSessions(window, shared, opts.serve_sessions, opts.serve_workers);
+		}
+		glfwSetWindowShouldClose(window, true);
 	}
-	stopCpuTimer(gen_vertices);
 
-	/////////////////////////////////////// VAO /////////////////////////////////////
-	//unsigned int VAO;
-	glGenVertexArrays(1, &VAO);
-	glBindVertexArray(VAO);
+	///////////////////////////////////// main loop /////////////////////////////////////
+	Camera& input_camera = OpenGL::getDefaultCamera();
+	input_camera.setPosition(0.f, 0.f, 0.f);
 
-	unsigned int VBO;
-	glGenBuffers(1, &VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+	// a replay draws every step so its timings compare across runs
+	OpenGL::InputSession session;
+	if (!opts.replay_fn.empty()) {
+		if (!session.load(opts.replay_fn, opts.replay_step))
+			return -1;
+		session.restoreCamera(input_camera);
+		opts.on_demand = false;
+		OpenGL::setInputSession(&session);
+	}
+	else if (!opts.input_fn.empty() && session.startRecording(opts.input_fn, glfwGetTime(), input_camera)) {
+		OpenGL::setInputSession(&session);
+	}
 
-	unsigned int EBO;
-	glGenBuffers(1, &EBO);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+	// --input-thread: this loop runs on a render thread and draws the newest pose the input loop
+	// published, keys reach it through the input loop as well; a replay has no live input
+	if (opts.input_thread && session.replaying()) {
+		printf("[input] --input-thread ignored while replaying\n");
+		opts.input_thread = false;
+	}
+	unique_ptr<OpenGL::InputLoop> input;
+	if (opts.input_thread)
+		input.reset(new OpenGL::InputLoop(window, { GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_R, GLFW_KEY_P, GLFW_KEY_C,
+			GLFW_KEY_M }));
+	auto keyPressed = [&](int key) { return input ? input->keyPressed(key) : OpenGL::keyPressedOnce(window, key); };
+	OpenGL::ViewPose pose;
+	pose.camera = input_camera;
+	Camera& camera = input ? pose.camera : input_camera;
+	int viewport_width = 0, viewport_height = 0;
 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	// input to present: from the first mouse or scroll event a frame shows to its swap
+	LatencyStats latency;
+	double input_ms = 0, frame_input_ms = 0, last_poll_ms = wallTimeMs();
+	double last_swap = wallTimeMs();
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	n_indices = indices.size();
-}
+	int n_frames = 0;
+	bool content_dirty = true;
+	DutyCycle duty;
+	auto render_loop = [&]() {
+		while (!glfwWindowShouldClose(window))
+		{
+			duty.beginBusy();
 
-unsigned int makeTextureFromMat(const cv::Mat &src, GLint src_fmt, GLint src_type, GLint dst_fmt)
-{
-	int width = src.cols, height = src.rows;
+			// swap in whatever the background workers finished since the last frame
+			if (!full_quality) {
+				ProgressiveLoader::Level level;
+				if (loader.takeLevel(level)) {
+					OpenGL::ArenaMesh &refined = level_meshes[level.index];
+					if (refined.buffers.VAO)
+						arena->commit(refined);
+					else if (!arena->upload(level.mesh, refined))
+						printf("[progressive] no arena space for mesh %dx%d, keeping the current one\n",
+							level.mesh.n_cols, level.mesh.n_rows);
+					if (refined.buffers.VAO) {
+						arena->release(arena_mesh);
+						arena_mesh = refined;
+						refined = OpenGL::ArenaMesh();
+						mesh = arena_mesh.buffers;
+						content_dirty = true;
+						startup.mark(format("mesh %dx%d", level.mesh.n_cols, level.mesh.n_rows));
+						printf("[progressive] mesh %dx%d built in %.2f ms, waited %.2f ms for upload\n",
+							level.mesh.n_cols, level.mesh.n_rows, level.build_ms, wallTimeMs() - level.ready_ms);
+					}
+				}
+
+				// full resolution color once the preview is on screen and the loader has decoded it
+				if (n_frames > 0 && loader.takeFrame(frame)) {
+					if (!frame.empty()) {
+						OpenGL::deleteTexture(tex_frame);
+						tex_frame = OpenGL::makeTextureFromMat(frame, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB, "frame color");
+						startup.mark("full color texture");
+						content_dirty = true;
+					}
+					full_texture = true;
+				}
 
-	unsigned int texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				if (loader.takeDepth(depth)) {
+					picker = DepthRaycaster();
+					OpenGL::deleteTexture(tex_depth);
+					tex_depth = OpenGL::makeTextureFromMat(depth, GL_RED, GL_FLOAT, GL_R32F, "depth");
+					setPyramid(depth);
+					content_dirty = true;
+					startup.mark("full depth texture");
+				}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, dst_fmt, width, height, 0, src_fmt, src_type, src.data);
-	glGenerateMipmap(GL_TEXTURE_2D);
+				if (full_texture && loader.done()) {
+					full_quality = true;
+					loader.join();
 
-	glBindTexture(GL_TEXTURE_2D, 0);
-	return texture;
+					// coarse levels overtaken by finer ones were never shown
+					for (auto &skipped : level_meshes)
+						arena->release(skipped);
+					arena->printStats();
+					double total = startup.mark("full quality");
+					startup.print("progressive startup");
+					printf("[progressive] time to full quality %.2f ms\n", total);
+				}
+			}
+
+			// tour: switch scenes on LEFT/RIGHT, otherwise upload one prefetched neighbor
+			if (scenes) {
+				int step = keyPressed(GLFW_KEY_RIGHT) ? 1 : 0;
+				step -= keyPressed(GLFW_KEY_LEFT) ? 1 : 0;
+				const SceneGPU *scene = step ? scenes->select(scenes->current() + step) : NULL;
+				if (scene) {
+					mesh = scene->mesh.buffers;
+					tex_frame = scene->tex_frame;
+					tex_depth = scene->tex_depth;
+					tex_minmax = scene->tex_minmax;
+					n_minmax_levels = scene->n_minmax_levels;
+					content_dirty = true;
+				}
+				else {
+					scenes->update();
+				}
+			}
+
+			// R switches between the mesh and the ray-marched renderer
+			if (keyPressed(GLFW_KEY_R)) {
+				if (!tex_minmax && !scenes && !depth.empty() && equirect && frame_target == GL_TEXTURE_2D) {
+					need_pyramid = true;
+					setPyramid(depth);
+				}
+				if (tex_minmax) {
+					render_mode = RenderMode((render_mode + 1) % N_RENDER_MODES);
+					printf("[render] %s\n", render_mode_names[render_mode]);
+					content_dirty = true;
+				}
+				else {
+					printf("[render] no depth pyramid: tour scenes need --raymarch, --stream keeps no depth, "
+						"other projections and --cubemap are mesh only\n");
+				}
+			}
+
+			// P picks the surface under the view center, consecutive picks measure their distance
+			if (keyPressed(GLFW_KEY_P)) {
+				if (scenes || depth.empty() || !equirect) {
+					printf("[pick] needs the full equirect depth, not available in the tour, with --stream or --projection\n");
+				}
+				else {
+					if (picker.empty())
+						picker.build(depth);
+					Vec3f eye(camera.Position.x, camera.Position.y, camera.Position.z);
+					Vec3f front(camera.Front.x, camera.Front.y, camera.Front.z);
+					RayHit pick;
+					if (picker.intersect(eye, front, pick)) {
+						printf("[pick] (%.3f, %.3f, %.3f) at %.3f from the camera, %d fetches\n",
+							pick.point[0], pick.point[1], pick.point[2], pick.t, pick.steps);
+						if (last_pick.hit)
+							printf("[pick] %.3f from the previous pick\n", norm(pick.point - last_pick.point));
+						last_pick = pick;
+					}
+					else {
+						printf("[pick] no surface along the view direction\n");
+					}
+				}
+			}
+
+			// C saves the next drawn frame
+			if (keyPressed(GLFW_KEY_C)) {
+				want_screenshot = true;
+				content_dirty = true;
+			}
+
+			// M lists every GL object and the CPU memory of each pipeline stage
+			if (keyPressed(GLFW_KEY_M))
+				MemoryTracker::instance().printResources();
+
+			// input; on its own thread the newest pose is taken here, as late as possible before drawing
+			bool redraw = OpenGL::consumeRedrawRequest() | content_dirty;
+			if (!input) {
+				OpenGL::processInput(window);
+				redraw |= camera.ConsumeDirty();
+			}
+			else if (input->takePose(pose)) {
+				redraw = true;
+				if (pose.input_ms > 0)
+					frame_input_ms = pose.input_ms;
+				if (pose.fb_width != viewport_width || pose.fb_height != viewport_height) {
+					viewport_width = pose.fb_width;
+					viewport_height = pose.fb_height;
+					glViewport(0, 0, viewport_width, viewport_height);
+				}
+			}
+
+			// on demand, skip the frame unless the view, the window or the content changed
+			if (redraw || !opts.on_demand) {
+				content_dirty = false;
+				if (!input && input_ms > 0) {
+					frame_input_ms = input_ms;
+					input_ms = 0;
+				}
+
+				int fb_width = pose.fb_width, fb_height = pose.fb_height;
+				if (!input)
+					glfwGetFramebufferSize(window, &fb_width, &fb_height);
+				if (dynres) {
+					const OpenGL::ResolutionController::Level &level = dynres->current();
+					render_target.resize((int)(fb_width * level.scale + 0.5f), (int)(fb_height * level.scale + 0.5f),
+						level.samples);
+					render_target.bind();
+				}
+
+				// render shader
+				glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+				// comparing: alternate renderers so both see the same views and load
+				RenderMode mode = render_mode;
+				if (opts.compare_render && tex_minmax)
+					mode = RenderMode(n_frames % N_RENDER_MODES);
+
+				float aspect = (float)SCR_WIDTH / (float)SCR_HEIGHT;
+				gpu_timers[mode].begin();
+				if (mode == RENDER_RAYMARCH)
+					drawRaymarch(raymarch_shader, camera, aspect, empty_vao, tex_frame, tex_minmax, n_minmax_levels);
+				else
+					drawMesh(shader, camera, aspect, mesh, tex_frame, frame_target);
+				if (dynres)
+					render_target.present(fb_width, fb_height);
+				gpu_timers[mode].end();
+
+				// the back buffer is only defined until the swap
+				if (want_screenshot) {
+					string fn = format("screenshot_%03d.png", n_screenshots++);
+					if (capture.capture(fn))
+						printf("[capture] %s\n", fn.c_str());
+					want_screenshot = false;
+				}
+				if (recording)
+					capture.capture(opts.record_fn.find('%') != string::npos ? format(opts.record_fn.c_str(), n_frames) :
+						opts.record_fn);
+
+				glfwSwapBuffers(window);
+				duty.frame();
+				if (frame_input_ms > 0) {
+					latency.add(wallTimeMs() - frame_input_ms);
+					frame_input_ms = 0;
+				}
+				if (session.replaying()) {
+					session.compareCamera(camera);
+					session.frameTiming(wallTimeMs() - last_swap);
+				}
+				last_swap = wallTimeMs();
+
+				if (++n_frames == 1 && opts.progressive) {
+					double total = startup.mark("first frame");
+					printf("[progressive] time to first frame %.2f ms\n", total);
+				}
+			}
+			duty.endBusy();
+
+			// poll events, or sleep until one arrives when there is nothing to draw
+			if (input) {
+				// events are the input loop's, the next pose or key press is at most a millisecond away
+				if (opts.on_demand && !redraw)
+					this_thread::sleep_for(chrono::milliseconds(1));
+			}
+			else {
+				double poll_ms = wallTimeMs();
+				if (opts.on_demand && !redraw) {
+					glfwWaitEventsTimeout(0.5);
+					OpenGL::resetFrameTime();
+				}
+				else {
+					glfwPollEvents();
+				}
+				// events queued during the frame arrived anywhere since the last poll, count them from
+				// the middle; an event that ended a wait arrived when it was handled
+				double event_ms = OpenGL::takeInputTime();
+				if (event_ms > 0 && input_ms == 0)
+					input_ms = event_ms - poll_ms > 1 ? event_ms : (last_poll_ms + poll_ms) / 2;
+				last_poll_ms = wallTimeMs();
+			}
+			for (auto &timer : gpu_timers) {
+				if (!timer.poll())
+					continue;
+				if (session.replaying())
+					session.gpuTiming(timer.last_ms);
+				if (dynres && dynres->update(timer.last_ms))
+					dynres->printState("changed");
+			}
+			capture.update();
+			if (duty.report(opts.on_demand ? "on-demand" : "frames", 5000)) {
+				for (int i = 0; i < N_RENDER_MODES; ++i) {
+					if (gpu_timers[i].n_samples)
+						printf("[render] %-8s gpu %.3f ms avg over %d frames\n", render_mode_names[i],
+							gpu_timers[i].average(), gpu_timers[i].n_samples);
+					gpu_timers[i].resetAverage();
+				}
+				if (recording)
+					capture.printStats();
+				if (dynres)
+					dynres->printState("state");
+				latency.report("latency");
+				MemoryTracker::instance().report(0);
+			}
+		}
+	};
+	if (input)
+		input->run(render_loop);
+	else
+		render_loop();
+	duty.summary(opts.on_demand ? "on-demand" : "frames");
+	latency.summary("latency");
+	OpenGL::setInputSession(NULL);
+	if (session.recording())
+		session.save();
+	if (session.replaying()) {
+		session.printSummary();
+		session.writeTiming(opts.replay_fn + ".timing.csv");
+	}
+	capture.finish();
+	capture.printStats();
+	render_target.release();
+
+	loader.join();
+	if (scenes) {
+		scenes->printStats();
+		scenes->clear();
+		// prefetch workers are joined here, while the context they were started under still exists
+		scenes.reset();
+	}
+	else {
+		for (auto &level_mesh : level_meshes)
+			arena->release(level_mesh);
+		arena->release(arena_mesh);
+		OpenGL::deleteTexture(tex_frame);
+		OpenGL::deleteTexture(tex_depth);
+		OpenGL::deleteTexture(tex_minmax);
+	}
+	glDeleteVertexArrays(1, &empty_vao);
+	glDeleteProgram(shader.ID);
+	glDeleteProgram(raymarch_shader.ID);
+	arena->printStats();
+	arena->clear();
+
+	// whatever is still registered was never deleted
+	MemoryTracker &memory = MemoryTracker::instance();
+	printf("[memory] peak gpu %.1f MB, peak cpu %.1f MB\n", memory.gpu().peak / 1048576., memory.cpu().peak / 1048576.);
+	if (int n_leaked = memory.printLeaks())
+		printf("[memory] %d GL objects leaked\n", n_leaked);
+	OpenGL::terminateOpenGL();
+	return 0;
 }
@@ -0,0 +1,317 @@
+/* GPU buffer arena: vertex and index ranges suballocated from a few large buffers.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cstring>
+#include "utils/arena.h"
+
+using namespace std;
+
+namespace kandao { namespace OpenGL
+{
+	///////////////////////////////////// BufferArena /////////////////////////////////////
+	// needs a current context, the extension check relies on glewInit
+	BufferArena::BufferArena(size_t block_size, bool try_persistent, const char *label)
+		: block_size(block_size), use_persistent(try_persistent && GLEW_ARB_buffer_storage), label(label)
+	{
+	}
+
+	bool BufferArena::createBlock(size_t size)
+	{
+		Block block;
+		block.size = size;
+		// errors left by earlier calls would otherwise be taken for this block's
+		while (glGetError() != GL_NO_ERROR)
+			;
+		glGenBuffers(1, &block.buffer);
+
+		// bound to the copy target so creating index blocks does not touch any VAO state
+		glBindBuffer(GL_COPY_WRITE_BUFFER, block.buffer);
+		if (use_persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+			block.ptr = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+		}
+		else {
+			glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		if (glGetError() != GL_NO_ERROR || (use_persistent && !block.ptr)) {
+			printf("[arena] failed to create %.1f MB block\n", size / 1048576.);
+			glDeleteBuffers(1, &block.buffer);
+			return false;
+		}
+		trackBuffer(block.buffer, label, size);
+
+		block.free_list[0] = size;
+		blocks.push_back(block);
+		return true;
+	}
+
+	void BufferArena::insertFree(Block &block, size_t offset, size_t size)
+	{
+		auto next = block.free_list.lower_bound(offset);
+
+		// merge with the previous free range
+		if (next != block.free_list.begin()) {
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == offset) {
+				offset = prev->first;
+				size += prev->second;
+				block.free_list.erase(prev);
+			}
+		}
+		// merge with the following free range
+		if (next != block.free_list.end() && offset + size == next->first) {
+			size += next->second;
+			block.free_list.erase(next);
+		}
+		block.free_list[offset] = size;
+	}
+
+	void BufferArena::reclaim()
+	{
+		for (size_t i = 0; i < retired.size();) {
+			GLenum state = glClientWaitSync(retired[i].fence, 0, 0);
+			if (state == GL_ALREADY_SIGNALED || state == GL_CONDITION_SATISFIED) {
+				Range &r = retired[i].range;
+				insertFree(blocks[r.block], r.offset, r.size);
+				glDeleteSync(retired[i].fence);
+				retired[i] = retired.back();
+				retired.pop_back();
+			}
+			else {
+				++i;
+			}
+		}
+	}
+
+	bool BufferArena::allocate(size_t size, Range &range, size_t align)
+	{
+		reclaim();
+		size = (size + align - 1) / align * align;
+
+		for (int pass = 0; pass < 2; ++pass) {
+			for (int b = 0; b < (int)blocks.size(); ++b) {
+				Block &block = blocks[b];
+				for (auto it = block.free_list.begin(); it != block.free_list.end(); ++it) {
+					size_t offset = (it->first + align - 1) / align * align;
+					size_t pad = offset - it->first;
+					if (it->second < pad + size)
+						continue;
+
+					size_t free_offset = it->first, free_size = it->second;
+					block.free_list.erase(it);
+					if (pad)
+						block.free_list[free_offset] = pad;
+					if (free_size > pad + size)
+						block.free_list[offset + size] = free_size - pad - size;
+
+					range.block = b;
+					range.offset = offset;
+					range.size = size;
+					used += size;
+					++n_allocs;
+					++n_live;
+					return true;
+				}
+			}
+
+			// nothing fits, grow by one block large enough for the request
+			if (pass == 0 && !createBlock(max(block_size, size)))
+				return false;
+		}
+		return false;
+	}
+
+	void BufferArena::free(Range &range)
+	{
+		if (!range.valid())
+			return;
+
+		used -= range.size;
+		++n_frees;
+		--n_live;
+
+		// a mapped range may still be read by queued draws, recycle it after they retire
+		if (use_persistent) {
+			Retired r;
+			r.range = range;
+			r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			retired.push_back(r);
+		}
+		else {
+			insertFree(blocks[range.block], range.offset, range.size);
+		}
+		range = Range();
+	}
+
+	void* BufferArena::mapped(const Range &range) const
+	{
+		const Block &block = blocks[range.block];
+		return block.ptr ? block.ptr + range.offset : NULL;
+	}
+
+	void BufferArena::write(const Range &range, const void *data, size_t size, size_t offset)
+	{
+		const Block &block = blocks[range.block];
+		if (block.ptr) {
+			memcpy(block.ptr + range.offset + offset, data, size);
+		}
+		else {
+			glBindBuffer(GL_COPY_WRITE_BUFFER, block.buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, range.offset + offset, size, data);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+	}
+
+	BufferArena::Stats BufferArena::stats() const
+	{
+		Stats s;
+		s.n_blocks = blocks.size();
+		s.n_allocs = n_allocs;
+		s.n_frees = n_frees;
+		s.n_live = n_live;
+		s.n_retired = retired.size();
+		s.used = used;
+
+		size_t total_free = 0;
+		for (const Block &block : blocks) {
+			s.capacity += block.size;
+			for (auto &kv : block.free_list) {
+				total_free += kv.second;
+				s.largest_free = max(s.largest_free, kv.second);
+			}
+		}
+		s.occupancy = s.capacity ? float(s.used) / s.capacity : 0.f;
+		s.fragmentation = total_free ? 1.f - float(s.largest_free) / total_free : 0.f;
+		return s;
+	}
+
+	void BufferArena::printStats(const char *name) const
+	{
+		Stats s = stats();
+		printf("[arena] %s: %d blocks %.1f MB, used %.1f MB (%.1f%%), largest free %.1f MB, fragmentation %.1f%%, "
+			"%d live / %d allocs / %d frees / %d retiring, %s\n", name, s.n_blocks, s.capacity / 1048576.,
+			s.used / 1048576., s.occupancy * 100, s.largest_free / 1048576., s.fragmentation * 100,
+			s.n_live, s.n_allocs, s.n_frees, s.n_retired, use_persistent ? "persistent" : "glBufferSubData");
+	}
+
+	void BufferArena::release()
+	{
+		for (Retired &r : retired)
+			glDeleteSync(r.fence);
+		retired.clear();
+
+		for (Block &block : blocks) {
+			if (block.ptr) {
+				glBindBuffer(GL_COPY_WRITE_BUFFER, block.buffer);
+				glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+			}
+			deleteBuffer(block.buffer);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		blocks.clear();
+		used = 0;
+		n_live = 0;
+	}
+
+	///////////////////////////////////// MeshArena /////////////////////////////////////
+	bool MeshArena::allocate(size_t n_vertices, size_t n_indices, ArenaMesh &mesh, bool staging)
+	{
+		size_t vertex_bytes = n_vertices * mesh::VERTEX_STRIDE * sizeof(float);
+		size_t index_bytes = n_indices * sizeof(unsigned int);
+		if (!vertex_arena.allocate(vertex_bytes, mesh.vertex_range))
+			return false;
+		if (!index_arena.allocate(index_bytes, mesh.index_range)) {
+			vertex_arena.free(mesh.vertex_range);
+			return false;
+		}
+
+		mesh.vertices = (float*)vertex_arena.mapped(mesh.vertex_range);
+		mesh.indices = (unsigned int*)index_arena.mapped(mesh.index_range);
+		if (!mesh.vertices && staging) {
+			mesh.staging.resize(vertex_bytes + index_bytes);
+			MemoryTracker::instance().addCpu("vertex staging", mesh.staging.size());
+			mesh.vertices = (float*)mesh.staging.data();
+			mesh.indices = (unsigned int*)(mesh.staging.data() + vertex_bytes);
+		}
+
+		// VAO reads straight from the shared blocks at the range offsets
+		MeshBuffers &buffers = mesh.buffers;
+		buffers.VBO = vertex_arena.buffer(mesh.vertex_range);
+		buffers.EBO = index_arena.buffer(mesh.index_range);
+		buffers.n_indices = n_indices;
+		buffers.index_offset = mesh.index_range.offset;
+
+		const size_t stride = mesh::VERTEX_STRIDE * sizeof(float);
+		glGenVertexArrays(1, &buffers.VAO);
+		glBindVertexArray(buffers.VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers.VBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.EBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)(mesh.vertex_range.offset));
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(mesh.vertex_range.offset + 3 * sizeof(float)));
+		glEnableVertexAttribArray(1);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return true;
+	}
+
+	void MeshArena::write(ArenaMesh &mesh, size_t first_vertex, const float *vertices, size_t n_vertices,
+		size_t first_index, const unsigned int *indices, size_t n_indices)
+	{
+		const size_t stride = mesh::VERTEX_STRIDE * sizeof(float);
+		vertex_arena.write(mesh.vertex_range, vertices, n_vertices * stride, first_vertex * stride);
+		index_arena.write(mesh.index_range, indices, n_indices * sizeof(unsigned int), first_index * sizeof(unsigned int));
+	}
+
+	void MeshArena::commit(ArenaMesh &mesh)
+	{
+		if (mesh.staging.empty())
+			return;
+
+		size_t vertex_bytes = (char*)mesh.indices - (char*)mesh.vertices;
+		vertex_arena.write(mesh.vertex_range, mesh.vertices, vertex_bytes);
+		index_arena.write(mesh.index_range, mesh.indices, mesh.staging.size() - vertex_bytes);
+		MemoryTracker::instance().addCpu("vertex staging", -(long long)mesh.staging.size());
+		vector<char>().swap(mesh.staging);
+		mesh.vertices = NULL;
+		mesh.indices = NULL;
+	}
+
+	bool MeshArena::upload(const mesh::MeshData &data, ArenaMesh &mesh)
+	{
+		if (!allocate(data.numVertices(), data.indices.size(), mesh))
+			return false;
+
+		memcpy(mesh.vertices, data.vertices.data(), data.vertices.size() * sizeof(float));
+		memcpy(mesh.indices, data.indices.data(), data.indices.size() * sizeof(unsigned int));
+		commit(mesh);
+		return true;
+	}
+
+	void MeshArena::release(ArenaMesh &mesh)
+	{
+		if (mesh.buffers.VAO)
+			glDeleteVertexArrays(1, &mesh.buffers.VAO);
+		if (!mesh.staging.empty())
+			MemoryTracker::instance().addCpu("vertex staging", -(long long)mesh.staging.size());
+		vertex_arena.free(mesh.vertex_range);
+		index_arena.free(mesh.index_range);
+		mesh = ArenaMesh();
+	}
+
+	void MeshArena::printStats() const
+	{
+		vertex_arena.printStats("vertex");
+		index_arena.printStats("index");
+	}
+
+	void MeshArena::clear()
+	{
+		vertex_arena.release();
+		index_arena.release();
+	}
+} }
@@ -0,0 +1,115 @@
+/* GPU buffer arena: vertex and index ranges suballocated from a few large buffers.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <map>
+#include <vector>
+#include "utils/utils.opengl.h"
+#include "utils/mesh.h"
+
+namespace kandao { namespace OpenGL
+{
+	// first-fit suballocator over large buffer blocks. With ARB_buffer_storage every block is
+	// persistently and coherently mapped and written with memcpy, otherwise via glBufferSubData.
+	class BufferArena
+	{
+	public:
+		struct Range
+		{
+			int block = -1;
+			size_t offset = 0, size = 0;
+			bool valid() const { return block >= 0; }
+		};
+
+		struct Stats
+		{
+			int n_blocks = 0, n_allocs = 0, n_frees = 0, n_live = 0, n_retired = 0;
+			size_t capacity = 0, used = 0, largest_free = 0;
+			float occupancy = 0;		// used / capacity
+			float fragmentation = 0;	// 1 - largest_free / total_free
+		};
+
+		// label: name of the blocks in memory reports and GL debuggers
+		BufferArena(size_t block_size, bool try_persistent = true, const char *label = "arena block");
+		~BufferArena() {}
+
+		bool allocate(size_t size, Range &range, size_t align = 256);
+		// the range becomes reusable once the GPU has passed every command issued so far
+		void free(Range &range);
+
+		GLuint buffer(const Range &range) const { return blocks[range.block].buffer; }
+		// CPU pointer into the persistent mapping, NULL on the glBufferSubData path
+		void* mapped(const Range &range) const;
+		void write(const Range &range, const void *data, size_t size, size_t offset = 0);
+
+		bool persistent() const { return use_persistent; }
+		Stats stats() const;
+		void printStats(const char *name) const;
+		// delete every block, must run while the context is alive
+		void release();
+
+	private:
+		struct Block
+		{
+			GLuint buffer = 0;
+			size_t size = 0;
+			char *ptr = NULL;
+			std::map<size_t, size_t> free_list;	// offset -> size, coalesced
+		};
+
+		struct Retired
+		{
+			Range range;
+			GLsync fence;
+		};
+
+		bool createBlock(size_t size);
+		void insertFree(Block &block, size_t offset, size_t size);
+		void reclaim();
+
+		size_t block_size;
+		bool use_persistent;
+		const char *label;
+		std::vector<Block> blocks;
+		std::vector<Retired> retired;
+		int n_allocs = 0, n_frees = 0, n_live = 0;
+		size_t used = 0;
+	};
+
+	// mesh whose VBO/EBO ranges live in a MeshArena; buffers.VBO/EBO are shared blocks
+	struct ArenaMesh
+	{
+		MeshBuffers buffers;
+		BufferArena::Range vertex_range, index_range;
+		std::vector<char> staging;	// only on the glBufferSubData path, counted as "vertex staging"
+		float *vertices = NULL;
+		unsigned int *indices = NULL;
+	};
+
+	class MeshArena
+	{
+	public:
+		MeshArena(size_t vertex_block = 64 << 20, size_t index_block = 32 << 20, bool try_persistent = true)
+			: vertex_arena(vertex_block, try_persistent, "vertex arena"), index_arena(index_block, try_persistent, "index arena") {}
+
+		// reserve ranges and a VAO; mesh.vertices / mesh.indices then point to GPU-visible memory,
+		// or to a staging copy, and may be filled from any thread before commit(). Without staging
+		// they stay NULL on the glBufferSubData path and the mesh is filled through write().
+		bool allocate(size_t n_vertices, size_t n_indices, ArenaMesh &mesh, bool staging = true);
+		// publish what was written through mesh.vertices / mesh.indices
+		void commit(ArenaMesh &mesh);
+		// copy a slice of the mesh, e.g. one strip of a streamed build, on the render thread
+		void write(ArenaMesh &mesh, size_t first_vertex, const float *vertices, size_t n_vertices,
+			size_t first_index, const unsigned int *indices, size_t n_indices);
+		// allocate + copy + commit in one go
+		bool upload(const mesh::MeshData &data, ArenaMesh &mesh);
+		void release(ArenaMesh &mesh);
+
+		bool persistent() const { return vertex_arena.persistent(); }
+		void printStats() const;
+		void clear();
+
+	private:
+		BufferArena vertex_arena, index_arena;
+	};
+} }
@@ -41,6 +41,8 @@ public:
     float MovementSpeed;
     float MouseSensitivity;
     float Zoom;
+    // Set whenever the view changes, cleared by whoever renders it
+    bool Dirty = true;
 
     // Constructor with vectors
     Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f), float yaw = YAW, float pitch = PITCH) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM)
@@ -73,6 +75,7 @@ public:
     void ProcessKeyboard(Camera_Movement direction, float deltaTime)
     {
         float velocity = MovementSpeed * deltaTime;
+        Dirty = true;
         if (direction == FORWARD)
             Position += Front * velocity;
         if (direction == BACKWARD)
@@ -87,6 +90,7 @@ public:
 	void ProcessKeyboard_GodView(Camera_Movement direction, float deltaTime)
 	{
 		float velocity = MovementSpeed * deltaTime;
+		Dirty = true;
 		if (direction == FORWARD) {
 			Center += Front * velocity;
 			Position += Front * velocity;
@@ -125,6 +129,7 @@ public:
 
         // Update Front, Right and Up Vectors using the updated Euler angles
         updateCameraVectors();
+        Dirty = true;
     }
 
     // Processes input received from a mouse scroll-wheel event. Only requires input on the vertical wheel-axis
@@ -136,6 +141,7 @@ public:
             Zoom = 1.0f;
         if (Zoom >= 45.0f)
             Zoom = 45.0f;
+        Dirty = true;
     }
 
 	void setPosition(float posX, float posY, float posZ)
@@ -143,15 +149,34 @@ public:
 		Position.x = posX;
 		Position.y = posY;
 		Position.z = posZ;
+		Dirty = true;
+	}
+
+	void setOrientation(float yaw, float pitch)
+	{
+		Yaw = yaw;
+		Pitch = pitch;
+		updateCameraVectors();
+		Dirty = true;
 	}
 
 	// god's view observe
 	void ObserveCenter() 
 	{
 		float cameraDistance = glm::distance(Position, Center);
-		Position.x = Center.x + -Front.x * cameraDistance;
-		Position.y = Center.y + -Front.y * cameraDistance;
-		Position.z = Center.z + -Front.z * cameraDistance;
+		glm::vec3 observe = Center - Front * cameraDistance;
+		if (glm::distance(observe, Position) > 1e-6f) {
+			Position = observe;
+			Dirty = true;
+		}
+	}
+
+	// returns whether the view changed since the last call
+	bool ConsumeDirty()
+	{
+		bool dirty = Dirty;
+		Dirty = false;
+		return dirty;
 	}
 
 private:
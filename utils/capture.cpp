@@ -0,0 +1,314 @@
+/* Frame capture without stalling the render loop: PBO readback ring plus encoder threads.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include <cctype>
+#include "utils/capture.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao { namespace OpenGL
+{
+	static string extensionOf(const std::string &fn)
+	{
+		size_t dot = fn.find_last_of('.');
+		string ext = dot == string::npos ? "" : fn.substr(dot);
+		transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		return ext;
+	}
+
+	FrameCapture::FrameCapture(int n_slots, int n_encoders, int max_queue)
+		: slots(n_slots), max_queue(max_queue), persistent(__GLEW_ARB_buffer_storage != 0)
+	{
+		for (int i = 0; i < n_encoders; ++i)
+			workers.push_back(thread(&FrameCapture::worker, this));
+	}
+
+	FrameCapture::~FrameCapture()
+	{
+		// workers drain what is queued before they leave
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_jobs.notify_all();
+		for (auto &w : workers)
+			w.join();
+		for (auto &raw : raw_streams)
+			if (raw.second.fp)
+				fclose(raw.second.fp);
+	}
+
+	bool FrameCapture::reserveSlot(Slot &slot, size_t size)
+	{
+		if (slot.pbo && slot.size >= size)
+			return true;
+
+		if (slot.pbo) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			if (slot.ptr)
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			deleteBuffer(slot.pbo);
+		}
+
+		glGenBuffers(1, &slot.pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		if (persistent) {
+			GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+			slot.ptr = (unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+		}
+		else {
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+			slot.ptr = NULL;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		trackBuffer(slot.pbo, "capture readback", size);
+		slot.size = size;
+		return !persistent || slot.ptr != NULL;
+	}
+
+	bool FrameCapture::capture(const std::string &fn, GLuint fbo)
+	{
+		double t = wallTimeMs();
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		int width = viewport[2], height = viewport[3];
+		bool raw = extensionOf(fn) == ".raw";
+
+		// a free slot and room in the queue, otherwise this frame is dropped
+		int s = -1;
+		{
+			lock_guard<mutex> lock(mtx);
+			++counters.n_requested;
+			if ((int)(jobs.size() + reading.size()) + n_busy < max_queue) {
+				for (int i = 0; i < (int)slots.size() && s < 0; ++i)
+					if (slots[i].state == SLOT_FREE)
+						s = i;
+			}
+			if (s < 0) {
+				++counters.n_dropped;
+				counters.render_ms += wallTimeMs() - t;
+				return false;
+			}
+			slots[s].state = SLOT_READING;
+		}
+
+		Slot &slot = slots[s];
+		bool ok = reserveSlot(slot, (size_t)width * height * 4);
+		slot.sequence = 0;
+		if (ok && raw) {
+			// a raw stream keeps the size of its first frame
+			lock_guard<mutex> lock(mtx);
+			RawStream &stream = raw_streams[fn];
+			if (!stream.fp && !stream.n_issued) {
+				stream.fp = fopen(fn.c_str(), "wb");
+				stream.width = width;
+				stream.height = height;
+				if (!stream.fp)
+					printf("[capture] cannot write %s\n", fn.c_str());
+			}
+			ok = stream.fp && stream.width == width && stream.height == height;
+			if (ok)
+				slot.sequence = stream.n_issued++;
+		}
+		if (!ok) {
+			lock_guard<mutex> lock(mtx);
+			slot.state = SLOT_FREE;
+			++counters.n_failed;
+			counters.render_ms += wallTimeMs() - t;
+			return false;
+		}
+
+		GLint read_fbo;
+		glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_fbo);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(viewport[0], viewport[1], width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.width = width;
+		slot.height = height;
+		slot.fn = fn;
+		slot.t_capture = t;
+		reading.push_back(s);
+
+		lock_guard<mutex> lock(mtx);
+		int depth = (int)(jobs.size() + reading.size()) + n_busy;
+		counters.max_queue_depth = max(counters.max_queue_depth, depth);
+		counters.render_ms += wallTimeMs() - t;
+		return true;
+	}
+
+	void FrameCapture::update()
+	{
+		if (reading.empty())
+			return;
+
+		double t = wallTimeMs();
+		// in capture order, so raw frames reach the encoders in sequence
+		while (!reading.empty()) {
+			int s = reading.front();
+			Slot &slot = slots[s];
+			GLenum state = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+				break;
+			glDeleteSync(slot.fence);
+			slot.fence = NULL;
+			reading.pop_front();
+
+			Job job;
+			job.fn = slot.fn;
+			job.sequence = slot.sequence;
+			job.t_capture = slot.t_capture;
+			SlotState next = SLOT_FREE;
+			if (slot.ptr) {
+				job.pixels = Mat(slot.height, slot.width, CV_8UC4, slot.ptr);
+				job.slot = s;
+				next = SLOT_ENCODING;
+			}
+			else {
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+				void *ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t)slot.width * slot.height * 4, GL_MAP_READ_BIT);
+				if (ptr)
+					job.pixels = Mat(slot.height, slot.width, CV_8UC4, ptr).clone();
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			}
+
+			{
+				lock_guard<mutex> lock(mtx);
+				slot.state = next;
+				jobs.push_back(job);
+			}
+			cv_jobs.notify_one();
+		}
+
+		lock_guard<mutex> lock(mtx);
+		counters.render_ms += wallTimeMs() - t;
+	}
+
+	void FrameCapture::worker()
+	{
+		for (;;) {
+			Job job;
+			{
+				unique_lock<mutex> lock(mtx);
+				cv_jobs.wait(lock, [&]() { return stopping || !jobs.empty(); });
+				if (jobs.empty())
+					return;
+				job = jobs.front();
+				jobs.pop_front();
+				++n_busy;
+			}
+
+			// GL rows start at the bottom; the slot is free again as soon as it is converted
+			Mat bgr;
+			if (!job.pixels.empty()) {
+				cvtColor(job.pixels, bgr, COLOR_BGRA2BGR);
+				flip(bgr, bgr, 0);
+			}
+			if (job.slot >= 0) {
+				lock_guard<mutex> lock(mtx);
+				slots[job.slot].state = SLOT_FREE;
+			}
+
+			bool ok = encode(job, bgr);
+			double t = wallTimeMs();
+			{
+				lock_guard<mutex> lock(mtx);
+				--n_busy;
+				if (ok) {
+					++counters.n_written;
+					counters.latency_ms += t - job.t_capture;
+					counters.max_latency_ms = max(counters.max_latency_ms, t - job.t_capture);
+				}
+				else {
+					++counters.n_failed;
+				}
+			}
+			cv_done.notify_all();
+		}
+	}
+
+	bool FrameCapture::encode(const Job &job, const cv::Mat &bgr)
+	{
+		if (extensionOf(job.fn) != ".raw")
+			return !bgr.empty() && imwrite(job.fn, bgr);
+
+		// encoders finish out of order, raw frames are appended strictly in sequence
+		FILE *fp = NULL;
+		{
+			unique_lock<mutex> lock(mtx);
+			RawStream &stream = raw_streams[job.fn];
+			cv_raw.wait(lock, [&]() { return stream.n_written == job.sequence; });
+			fp = stream.fp;
+		}
+
+		bool ok = !bgr.empty() && fp;
+		for (int i = 0; ok && i < bgr.rows; ++i)
+			ok = fwrite(bgr.ptr(i), bgr.cols * 3, 1, fp) == 1;
+
+		{
+			lock_guard<mutex> lock(mtx);
+			++raw_streams[job.fn].n_written;
+		}
+		cv_raw.notify_all();
+		return ok;
+	}
+
+	void FrameCapture::finish()
+	{
+		// everything still on the GPU, then everything still queued
+		glFinish();
+		update();
+		{
+			unique_lock<mutex> lock(mtx);
+			cv_done.wait(lock, [&]() { return jobs.empty() && n_busy == 0; });
+			for (auto &raw : raw_streams) {
+				RawStream &stream = raw.second;
+				if (!stream.fp)
+					continue;
+				fclose(stream.fp);
+				printf("[capture] %s: %d frames, play with ffmpeg -f rawvideo -pix_fmt bgr24 -s %dx%d -i %s\n",
+					raw.first.c_str(), stream.n_written, stream.width, stream.height, raw.first.c_str());
+			}
+			raw_streams.clear();
+		}
+
+		for (Slot &slot : slots) {
+			if (slot.ptr) {
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			}
+			deleteBuffer(slot.pbo);
+			slot = Slot();
+		}
+	}
+
+	FrameCapture::Stats FrameCapture::stats() const
+	{
+		lock_guard<mutex> lock(mtx);
+		Stats s = counters;
+		s.queue_depth = (int)(jobs.size() + reading.size()) + n_busy;
+		return s;
+	}
+
+	void FrameCapture::printStats() const
+	{
+		Stats s = stats();
+		if (!s.n_requested)
+			return;
+		printf("[capture] %d requested, %d written, %d dropped, %d failed; latency %.2f ms avg, %.2f ms max; "
+			"queue %d now, %d max; render thread %.3f ms per capture (%s)\n", s.n_requested, s.n_written, s.n_dropped,
+			s.n_failed, s.n_written ? s.latency_ms / s.n_written : 0., s.max_latency_ms, s.queue_depth,
+			s.max_queue_depth, s.render_ms / s.n_requested, persistent ? "persistent PBOs" : "mapped PBOs");
+	}
+} }
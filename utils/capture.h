@@ -0,0 +1,105 @@
+/* Frame capture without stalling the render loop: PBO readback ring plus encoder threads.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "utils/utils.opengl.h"
+
+namespace kandao { namespace OpenGL
+{
+	// capture() only queues glReadPixels into a pixel pack buffer and a fence; update() maps the
+	// slots whose fence has passed, usually two frames later, and hands them to the encoders.
+	// With ARB_buffer_storage the slots stay persistently mapped and the encoders read them in
+	// place, otherwise update() copies the pixels out and unmaps. When every slot or the encoder
+	// queue is busy the frame is dropped, the render thread never waits.
+	class FrameCapture
+	{
+	public:
+		struct Stats
+		{
+			int n_requested = 0, n_dropped = 0, n_written = 0, n_failed = 0;
+			int queue_depth = 0, max_queue_depth = 0;
+			double latency_ms = 0, max_latency_ms = 0;	// capture() to written, summed over n_written
+			double render_ms = 0;		// spent in capture() and update() on the render thread
+		};
+
+		FrameCapture(int n_slots = 4, int n_encoders = 2, int max_queue = 8);
+		~FrameCapture();
+
+		// read the current viewport of fbo, 0 being the back buffer before glfwSwapBuffers. The
+		// extension of fn picks the encoding: .png, .jpg, or .raw to append BGR24 frames to one
+		// stream. Returns false when the frame is dropped.
+		bool capture(const std::string &fn, GLuint fbo = 0);
+		// once per frame on the render thread
+		void update();
+		// wait for every queued frame to be written and close raw streams; releases the GL
+		// objects, must run while the context is alive
+		void finish();
+
+		Stats stats() const;
+		void printStats() const;
+
+	private:
+		enum SlotState
+		{
+			SLOT_FREE,
+			SLOT_READING,	// glReadPixels queued, fence pending
+			SLOT_ENCODING,	// an encoder reads the persistent mapping
+		};
+
+		struct Slot
+		{
+			GLuint pbo = 0;
+			size_t size = 0;
+			unsigned char *ptr = NULL;	// persistent mapping
+			GLsync fence = NULL;
+			SlotState state = SLOT_FREE;
+			int width = 0, height = 0;
+			std::string fn;
+			int sequence = 0;
+			double t_capture = 0;
+		};
+
+		struct Job
+		{
+			cv::Mat pixels;		// BGRA, bottom row first as read from GL
+			int slot = -1;		// persistent slot to give back, -1 if pixels are owned
+			std::string fn;
+			int sequence = 0;	// frame index within a raw stream
+			double t_capture = 0;
+		};
+
+		struct RawStream
+		{
+			FILE *fp = NULL;
+			int width = 0, height = 0;
+			int n_issued = 0, n_written = 0;
+		};
+
+		bool reserveSlot(Slot &slot, size_t size);
+		void worker();
+		bool encode(const Job &job, const cv::Mat &bgr);
+
+		std::vector<Slot> slots;
+		int max_queue;
+		bool persistent;
+		std::deque<int> reading;	// slot indices in capture order
+
+		std::vector<std::thread> workers;
+		mutable std::mutex mtx;
+		std::condition_variable cv_jobs, cv_done, cv_raw;
+		std::deque<Job> jobs;
+		int n_busy = 0;
+		std::map<std::string, RawStream> raw_streams;
+		bool stopping = false;
+
+		Stats counters;
+	};
+} }
@@ -0,0 +1,108 @@
+/* Equirectangular color resampled into cube map faces at load, for sampling by direction.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/cubemap.h"
+#include "utils/memory.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	///////////////////////////////////// faces /////////////////////////////////////
+	// direction of face texel (s, t) in [-1, 1]^2 is forward + s * s_axis + t * t_axis,
+	// the major axis table of the GL spec solved for the direction
+	struct CubeFace
+	{
+		float forward[3], s_axis[3], t_axis[3];
+	};
+
+	static const CubeFace cube_faces[N_CUBE_FACES] = {
+		{ { 1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },	// +X
+		{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, -1, 0 } },	// -X
+		{ { 0, 1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },		// +Y
+		{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, -1 } },	// -Y
+		{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, -1, 0 } },		// +Z
+		{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, -1, 0 } },	// -Z
+	};
+
+	int cubeFaceSize(int equirect_width)
+	{
+		return max(1, equirect_width / 4);
+	}
+
+	// atan2 without branches or library calls, so the loops around it vectorize; error below
+	// 1e-5 rad, a hundredth of a texel even 6000 texels around
+	static inline float atan2Poly(float y, float x)
+	{
+		float ax = fabsf(x), ay = fabsf(y);
+		float a = min(ax, ay) / (max(ax, ay) + 1e-30f);
+		float s = a * a;
+		float r = (((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s) * a + a;
+		r = ay > ax ? 1.57079637f - r : r;
+		r = x < 0 ? 3.14159274f - r : r;
+		return y < 0 ? -r : r;
+	}
+
+	///////////////////////////////////// remap /////////////////////////////////////
+	// rows of all faces stacked, face f row i is row f * size + i; every band computes the
+	// equirect position of its texels and lets cv::remap do the bilinear fetches
+	class CubemapBody : public ParallelLoopBody
+	{
+	public:
+		CubemapBody(const Mat &equi, vector<Mat> &faces, int size) : equi(equi), faces(faces), size(size) {}
+
+		void operator()(const Range &range) const
+		{
+			float width = equi.cols, height = equi.rows;
+			vector<float> x(size), y(size), z(size);
+			for (int row = range.start; row < range.end;) {
+				int f = row / size, i0 = row % size, i1 = min(size, i0 + range.end - row);
+				const CubeFace &face = cube_faces[f];
+				Mat map_x(i1 - i0, size, CV_32F), map_y(i1 - i0, size, CV_32F);
+
+				for (int i = i0; i < i1; ++i) {
+					float t = 2.f * (i + 0.5f) / size - 1.f;
+					for (int j = 0; j < size; ++j) {
+						float s = 2.f * (j + 0.5f) / size - 1.f;
+						x[j] = face.forward[0] + s * face.s_axis[0] + t * face.t_axis[0];
+						y[j] = face.forward[1] + s * face.s_axis[1] + t * face.t_axis[1];
+						z[j] = face.forward[2] + s * face.s_axis[2] + t * face.t_axis[2];
+					}
+
+					// inverse of EquirectProjection::direction, in texel centers of the source;
+					// columns wrap at the seam, rows stay inside for the bilinear fetch
+					float *mx = map_x.ptr<float>(i - i0), *my = map_y.ptr<float>(i - i0);
+					for (int j = 0; j < size; ++j) {
+						float u = atan2Poly(x[j], -z[j]);
+						float v = atan2Poly(sqrtf(x[j] * x[j] + z[j] * z[j]), y[j]);
+						mx[j] = (u * (float)(0.5 / CV_PI) + 0.5f) * width - 0.5f;
+						my[j] = min(max(v * (float)(1 / CV_PI) * height - 0.5f, 0.f), height - 1);
+					}
+				}
+
+				Mat dst = faces[f].rowRange(i0, i1);
+				remap(equi, dst, map_x, map_y, INTER_LINEAR, BORDER_WRAP);
+				row += i1 - i0;
+			}
+		}
+
+	private:
+		const Mat &equi;
+		vector<Mat> &faces;
+		int size;
+	};
+
+	void equirectToCubemap(const cv::Mat &equi, std::vector<cv::Mat> &faces, int face_size)
+	{
+		MemoryStage stage("cubemap");
+		int size = face_size > 0 ? face_size : cubeFaceSize(equi.cols);
+		faces.resize(N_CUBE_FACES);
+		for (auto &face : faces)
+			face.create(size, size, equi.type());
+
+		// bands of 32 rows keep each map small while leaving plenty of stripes to balance
+		int n_rows = N_CUBE_FACES * size;
+		parallel_for_(Range(0, n_rows), CubemapBody(equi, faces, size), max(1, n_rows / 32));
+	}
+}
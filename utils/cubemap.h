@@ -0,0 +1,22 @@
+/* Equirectangular color resampled into cube map faces at load, for sampling by direction.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+namespace kandao
+{
+	// faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order: +X, -X, +Y, -Y, +Z, -Z
+	const int N_CUBE_FACES = 6;
+
+	// A face spans a quarter turn, so W/4 texels give its center the density of the equator of a
+	// W wide equirect image; all six faces hold 3/8 W^2 texels against 1/2 W^2.
+	int cubeFaceSize(int equirect_width);
+
+	// Bilinear resampling of an equirectangular image of any type cv::remap takes into the six faces
+	// of a GL cube map: face i is laid out as GL samples GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, row 0 at
+	// t = 0, and every direction finds the color the equirect texture shows at the same u, v.
+	// Bands of face rows are mapped in parallel; face_size <= 0 picks cubeFaceSize.
+	void equirectToCubemap(const cv::Mat &equi, std::vector<cv::Mat> &faces, int face_size = 0);
+}
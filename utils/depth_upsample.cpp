@@ -0,0 +1,336 @@
+/* Top-bottom panoramas with reduced-resolution disparity, joint bilateral upsampling at load.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/depth_upsample.h"
+#include "utils/utils.opencv.h"
+#include "utils/memory.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	///////////////////////////////////// layout /////////////////////////////////////
+	int depthScaleOf(cv::Size size)
+	{
+		// color W x W/2 and a strip of W/(2f^2) rows; anything else is read as plain top-bottom
+		int width = size.width;
+		for (int f = 2; f <= 4; f *= 2) {
+			if (width % (2 * f * f) == 0 && size.height == width / 2 + width / (2 * f * f))
+				return f;
+		}
+		return 1;
+	}
+
+	int depthScaleOf(const cv::Mat &in)
+	{
+		return depthScaleOf(in.size());
+	}
+
+	bool splitDepthLayout(const cv::Mat &in, cv::Mat &frame, cv::Mat &disp, int &factor)
+	{
+		if (in.empty())
+			return false;
+		factor = depthScaleOf(in);
+		if (factor == 1) {
+			frame = in.rowRange(0, in.rows / 2);
+			disp = in.rowRange(in.rows / 2, in.rows);
+			return true;
+		}
+
+		int height = in.cols / 2, low_width = in.cols / factor, low_height = height / factor;
+		int band = low_height / factor;
+		frame = in.rowRange(0, height);
+		disp.create(low_height, low_width, in.type());
+		for (int b = 0; b < factor; ++b)
+			in(Rect(b * low_width, height, low_width, band)).copyTo(disp.rowRange(b * band, (b + 1) * band));
+		return true;
+	}
+
+	bool packDepthLayout(const cv::Mat &frame, const cv::Mat &disp, int factor, cv::Mat &out)
+	{
+		if (factor != 1 && factor != 2 && factor != 4) {
+			printf("[depth] disparity scale 1/%d, only 1, 2 and 4 are supported\n", factor);
+			return false;
+		}
+		if (factor > 1 && (frame.rows * 2 != frame.cols || frame.cols % (2 * factor * factor))) {
+			printf("[depth] %dx%d color cannot carry 1/%d disparity, it must be 2:1 and a multiple of %d wide\n",
+				frame.cols, frame.rows, factor, 2 * factor * factor);
+			return false;
+		}
+
+		// disparity as stored: 8-bit, as many channels as the color
+		Mat small;
+		resize(disp, small, Size(frame.cols / factor, frame.rows / factor), 0, 0, INTER_AREA);
+		if (small.depth() != CV_8U)
+			small.convertTo(small, CV_8U);
+		if (small.channels() == 1 && frame.channels() == 3)
+			cvtColor(small, small, COLOR_GRAY2BGR);
+
+		if (factor == 1) {
+			vconcat(frame, small, out);
+			return true;
+		}
+		int band = small.rows / factor;
+		out.create(frame.rows + band, frame.cols, frame.type());
+		frame.copyTo(out.rowRange(0, frame.rows));
+		for (int b = 0; b < factor; ++b)
+			small.rowRange(b * band, (b + 1) * band).copyTo(out(Rect(b * small.cols, frame.rows, small.cols, band)));
+		return true;
+	}
+
+	///////////////////////////////////// upsampling /////////////////////////////////////
+	// taps of one output coordinate along an axis: low resolution indices and spatial weights
+	struct UpsampleTaps
+	{
+		vector<int> index;
+		vector<float> weight;
+	};
+
+	static void axisTaps(int n_high, int n_low, int radius, float sigma, bool wrap, UpsampleTaps &taps)
+	{
+		int n_taps = 2 * radius;
+		taps.index.resize(n_high * n_taps);
+		taps.weight.resize(n_high * n_taps);
+		float ratio = (float)n_low / n_high;
+		for (int i = 0; i < n_high; ++i) {
+			// pixel centers line up, as with INTER_LINEAR
+			float p = (i + 0.5f) * ratio - 0.5f;
+			int p0 = (int)floor(p);
+			for (int k = 0; k < n_taps; ++k) {
+				int q = p0 - radius + 1 + k;
+				float d = q - p;
+				taps.weight[i * n_taps + k] = exp(-d * d / (2 * sigma * sigma));
+				taps.index[i * n_taps + k] = wrap ? (q % n_low + n_low) % n_low : min(max(q, 0), n_low - 1);
+			}
+		}
+	}
+
+	class JointBilateralBody : public ParallelLoopBody
+	{
+	public:
+		JointBilateralBody(const Mat &low, const Mat &guide_low, const Mat &guide, Mat &high, int radius,
+			const UpsampleTaps &rows, const UpsampleTaps &cols, const vector<float> &color_weight)
+			: low(low), guide_low(guide_low), guide(guide), high(high), n_taps(2 * radius), rows(rows), cols(cols),
+			color_weight(color_weight) {}
+
+		void operator()(const Range &range) const
+		{
+			for (int y = range.start; y < range.end; ++y) {
+				const int *ry = &rows.index[y * n_taps];
+				const float *wy = &rows.weight[y * n_taps];
+				const Vec3b *g = guide.ptr<Vec3b>(y);
+				float *out = high.ptr<float>(y);
+				for (int x = 0; x < high.cols; ++x) {
+					const int *cx = &cols.index[x * n_taps];
+					const float *wx = &cols.weight[x * n_taps];
+					const Vec3b &c = g[x];
+					float sum = 0, sum_w = 0;
+					for (int a = 0; a < n_taps; ++a) {
+						const float *l = low.ptr<float>(ry[a]);
+						const Vec3b *gl = guide_low.ptr<Vec3b>(ry[a]);
+						for (int b = 0; b < n_taps; ++b) {
+							const Vec3b &s = gl[cx[b]];
+							int diff = abs(c[0] - s[0]) + abs(c[1] - s[1]) + abs(c[2] - s[2]);
+							float w = wy[a] * wx[b] * color_weight[diff];
+							sum += w * l[cx[b]];
+							sum_w += w;
+						}
+					}
+					// no sample resembles this pixel at all, take the nearest one
+					out[x] = sum_w > 1e-12f ? sum / sum_w : low.at<float>(ry[n_taps / 2 - 1], cx[n_taps / 2 - 1]);
+				}
+			}
+		}
+
+	private:
+		const Mat &low, &guide_low, &guide;
+		Mat &high;
+		int n_taps;
+		const UpsampleTaps &rows, &cols;
+		const vector<float> &color_weight;
+	};
+
+	void jointBilateralUpsample(const cv::Mat &low, const cv::Mat &guide, cv::Mat &high, int radius,
+		float sigma_space, float sigma_color)
+	{
+		CV_Assert(guide.type() == CV_8UC3 && radius >= 1);
+		Mat low_f;
+		if (low.channels() > 1) {
+			vector<Mat> channels;
+			split(low, channels);
+			low_f = channels.front();
+		}
+		else {
+			low_f = low;
+		}
+		if (low_f.depth() != CV_32F)
+			low_f.convertTo(low_f, CV_32F);
+
+		// the guide color around each sample is its footprint averaged, not one full resolution pixel
+		Mat guide_low;
+		resize(guide, guide_low, low_f.size(), 0, 0, INTER_AREA);
+
+		UpsampleTaps rows, cols;
+		axisTaps(guide.rows, low_f.rows, radius, sigma_space, false, rows);
+		axisTaps(guide.cols, low_f.cols, radius, sigma_space, true, cols);
+		// L1 color distance over BGR, 0..765
+		vector<float> color_weight(766);
+		for (int d = 0; d < (int)color_weight.size(); ++d)
+			color_weight[d] = exp(-(float)d * d / (2 * sigma_color * sigma_color));
+
+		high.create(guide.size(), CV_32F);
+		parallel_for_(Range(0, high.rows), JointBilateralBody(low_f, guide_low, guide, high, radius, rows, cols,
+			color_weight));
+	}
+
+	bool splitTopBottom(const cv::Mat &in, cv::Mat &frame, cv::Mat &disp, int *factor)
+	{
+		int f;
+		if (!splitDepthLayout(in, frame, disp, f))
+			return false;
+		if (factor)
+			*factor = f;
+		if (f > 1) {
+			double t = wallTimeMs();
+			MemoryStage stage("depth upsample");
+			Mat low = disp;
+			jointBilateralUpsample(low, frame, disp);
+			printf("[depth] 1/%d resolution disparity %dx%d upsampled to %dx%d in %.2f ms\n", f, low.cols, low.rows,
+				disp.cols, disp.rows, wallTimeMs() - t);
+		}
+		return true;
+	}
+
+	///////////////////////////////////// converter /////////////////////////////////////
+	bool convertReducedDepth(const std::string &in_fn, const std::string &out_fn, int factor, int quality)
+	{
+		Mat in_dat = imread(in_fn), frame, disp, out;
+		int in_factor;
+		if (!splitDepthLayout(in_dat, frame, disp, in_factor)) {
+			printf("[depth] read %s failed\n", in_fn.c_str());
+			return false;
+		}
+		if (in_factor != 1)
+			printf("[depth] %s already holds 1/%d disparity, resampling it\n", in_fn.c_str(), in_factor);
+		if (!packDepthLayout(frame, disp, factor, out))
+			return false;
+		vector<int> params = { IMWRITE_JPEG_QUALITY, quality };
+		if (!imwrite(out_fn, out, params)) {
+			printf("[depth] writing %s failed\n", out_fn.c_str());
+			return false;
+		}
+		printf("[depth] %s: %dx%d with 1/%d disparity\n", out_fn.c_str(), out.cols, out.rows, factor);
+		return true;
+	}
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	struct DisparityError
+	{
+		double mean = 0, rms = 0;
+		double outliers = 0;		// fraction off by more than 4 levels
+		double edge_mean = 0;		// mean over pixels next to a disparity step in the original
+	};
+
+	static DisparityError disparityError(const Mat &disp, const Mat &ref, const Mat &edges)
+	{
+		DisparityError e;
+		double sum = 0, sum2 = 0, edge_sum = 0;
+		int n_outliers = 0, n_edges = 0;
+		for (int y = 0; y < ref.rows; ++y) {
+			const float *a = disp.ptr<float>(y), *b = ref.ptr<float>(y);
+			const uchar *m = edges.ptr<uchar>(y);
+			for (int x = 0; x < ref.cols; ++x) {
+				double d = fabs(a[x] - b[x]);
+				sum += d;
+				sum2 += d * d;
+				n_outliers += d > 4;
+				if (m[x]) {
+					edge_sum += d;
+					++n_edges;
+				}
+			}
+		}
+		double n = (double)ref.total();
+		e.mean = sum / n;
+		e.rms = sqrt(sum2 / n);
+		e.outliers = n_outliers / n;
+		e.edge_mean = n_edges ? edge_sum / n_edges : 0;
+		return e;
+	}
+
+	void benchmarkReducedDepth(const std::string &fn, float disp_scale, int n_runs)
+	{
+		Mat in_dat = imread(fn), frame, disp;
+		int in_factor;
+		if (!splitDepthLayout(in_dat, frame, disp, in_factor) || in_factor != 1) {
+			printf("[depth] %s must be a full resolution top-bottom panorama\n", fn.c_str());
+			return;
+		}
+
+		// reference: the stored disparity before any re-encoding; steps of more than 8 levels are edges
+		Mat ref;
+		extractChannel(disp, ref, 0);
+		ref.convertTo(ref, CV_32F);
+		Mat edges(ref.size(), CV_8U, Scalar(0));
+		for (int y = 0; y + 1 < ref.rows; ++y) {
+			const float *r0 = ref.ptr<float>(y), *r1 = ref.ptr<float>(y + 1);
+			uchar *m = edges.ptr<uchar>(y);
+			for (int x = 0; x + 1 < ref.cols; ++x)
+				m[x] = fabs(r0[x] - r0[x + 1]) > 8 || fabs(r0[x] - r1[x]) > 8;
+		}
+		dilate(edges, edges, Mat(), Point(-1, -1), 2);
+		printf("[depth] %s: %dx%d color, %.1f%% of the pixels near disparity edges\n", fn.c_str(), frame.cols,
+			frame.rows, countNonZero(edges) * 100. / edges.total());
+
+		for (int factor = 1; factor <= 4; factor *= 2) {
+			// every layout goes through one more JPEG generation, so they compare fairly
+			Mat packed;
+			vector<uchar> jpg;
+			if (!packDepthLayout(frame, disp, factor, packed) ||
+				!imencode(".jpg", packed, jpg, vector<int>{ IMWRITE_JPEG_QUALITY, 95 }))
+				return;
+
+			double decode_ms = 0, upsample_ms = 0, depth_ms = 0;
+			Mat decoded, frame_d, disp_d, full, depth;
+			for (int i = 0; i < n_runs; ++i) {
+				double t = wallTimeMs();
+				decoded = imdecode(jpg, IMREAD_COLOR);
+				decode_ms += wallTimeMs() - t;
+
+				int f;
+				splitDepthLayout(decoded, frame_d, disp_d, f);
+				t = wallTimeMs();
+				if (f > 1)
+					jointBilateralUpsample(disp_d, frame_d, full);
+				else
+					extractChannel(disp_d, full, 0);
+				upsample_ms += wallTimeMs() - t;
+
+				t = wallTimeMs();
+				depth = opencv::viewableDisp2Original(full, disp_scale);
+				depth_ms += wallTimeMs() - t;
+			}
+			if (full.depth() != CV_32F)
+				full.convertTo(full, CV_32F);
+			DisparityError jbu = disparityError(full, ref, edges);
+
+			printf("[depth] %s disparity: %.2f MB jpeg, %.1f MB decoded, decode %.2f ms, upsample %.2f ms, depth %.2f ms\n",
+				factor == 1 ? "full" : format("1/%d", factor).c_str(), jpg.size() / 1048576.,
+				decoded.total() * decoded.elemSize() / 1048576., decode_ms / n_runs, upsample_ms / n_runs,
+				depth_ms / n_runs);
+			printf("[depth]   %-14s error mean %.2f, rms %.2f, %.2f%% off by > 4, mean %.2f near edges\n",
+				factor == 1 ? "re-encoded" : "joint bilat.", jbu.mean, jbu.rms, jbu.outliers * 100, jbu.edge_mean);
+			if (factor > 1) {
+				Mat linear;
+				extractChannel(disp_d, linear, 0);
+				linear.convertTo(linear, CV_32F);
+				resize(linear, linear, frame.size(), 0, 0, INTER_LINEAR);
+				DisparityError e = disparityError(linear, ref, edges);
+				printf("[depth]   %-14s error mean %.2f, rms %.2f, %.2f%% off by > 4, mean %.2f near edges\n",
+					"bilinear", e.mean, e.rms, e.outliers * 100, e.edge_mean);
+			}
+		}
+	}
+}
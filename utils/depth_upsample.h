@@ -0,0 +1,41 @@
+/* Top-bottom panoramas with reduced-resolution disparity, joint bilateral upsampling at load.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <string>
+#include "opencv2/opencv.hpp"
+
+namespace kandao
+{
+	// The color half keeps its W x W/2 equirect size. A disparity of 1/f resolution, (W/f) x (W/2f),
+	// is cut into f bands of rows laid side by side, so it fills a W x W/(2f^2) strip under the color
+	// and the layout follows from the image height alone: W for full resolution disparity, 5W/8 for
+	// 1/2 and 17W/32 for 1/4.
+	// returns f = 1, 2 or 4, 0 for a size that is none of these layouts
+	int depthScaleOf(cv::Size size);
+	int depthScaleOf(const cv::Mat &in);
+
+	// frame is a view of the color rows; disp is a view for full resolution input, otherwise the
+	// reduced disparity unpacked into a (W/f) x (H/f) copy
+	bool splitDepthLayout(const cv::Mat &in, cv::Mat &frame, cv::Mat &disp, int &factor);
+	// the inverse: disp at any size is resized to 1/factor of frame and packed under it
+	bool packDepthLayout(const cv::Mat &frame, const cv::Mat &disp, int factor, cv::Mat &out);
+
+	// Joint bilateral upsampling (Kopf et al. 2007) of low to the size of guide. Every output pixel
+	// averages the (2 radius)^2 nearest low resolution samples, weighted by their distance and by how
+	// close the guide color around each sample is to its own, so depth edges follow color edges
+	// instead of the coarse grid. Columns wrap around like the equirect seam. low: any depth, first
+	// channel used; high: CV_32F.
+	void jointBilateralUpsample(const cv::Mat &low, const cv::Mat &guide, cv::Mat &high, int radius = 2,
+		float sigma_space = 0.8f, float sigma_color = 12.f);
+
+	// frame view plus full resolution disparity of either layout, upsampled when stored reduced
+	bool splitTopBottom(const cv::Mat &in, cv::Mat &frame, cv::Mat &disp, int *factor = NULL);
+
+	// rewrite a full resolution top-bottom JPEG with its disparity at 1/factor
+	bool convertReducedDepth(const std::string &in_fn, const std::string &out_fn, int factor, int quality = 95);
+
+	// for full, 1/2 and 1/4 disparity of a full resolution input: encoded size, decode time, upsampling
+	// time and the disparity error against the original, joint bilateral and plain bilinear
+	void benchmarkReducedDepth(const std::string &fn, float disp_scale, int n_runs = 3);
+}
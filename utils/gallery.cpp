@@ -0,0 +1,358 @@
+/* Gallery: many panoramas drawn at once from shared geometry and texture arrays.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include "utils/gallery.h"
+#include "utils/mesh.h"
+#include "utils/panofile.h"
+#include "utils/depth_upsample.h"
+#include "utils/utils.opencv.h"
+#include "utils/memory.h"
+#include "utils/timer.h"
+#include "utils/shaders.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao { namespace OpenGL
+{
+	///////////////////////////////////// thumbnails /////////////////////////////////////
+	// viewableDisp2Original's depth where there is no disparity
+	static const float invalid_depth = 10000.f;
+
+	// depth over the median of the valid pixels, so near and far scenes get spheres of one size;
+	// holes go to the far limit
+	static void normalizeDepth(Mat &depth, float max_depth)
+	{
+		vector<float> valid;
+		valid.reserve(depth.total());
+		for (int y = 0; y < depth.rows; ++y) {
+			const float *row = depth.ptr<float>(y);
+			for (int x = 0; x < depth.cols; ++x)
+				if (row[x] > 0 && row[x] < invalid_depth)
+					valid.push_back(row[x]);
+		}
+		float median = 1.f;
+		if (!valid.empty()) {
+			nth_element(valid.begin(), valid.begin() + valid.size() / 2, valid.end());
+			median = valid[valid.size() / 2];
+		}
+
+		for (int y = 0; y < depth.rows; ++y) {
+			float *row = depth.ptr<float>(y);
+			for (int x = 0; x < depth.cols; ++x)
+				row[x] = (row[x] > 0 && row[x] < invalid_depth) ? min(row[x] / median, max_depth) : max_depth;
+		}
+	}
+
+	// color and normalized depth of one panorama at thumbnail size; color and depth are its
+	// layers in the stacks and are written in place
+	static bool loadThumbnail(const string &fn, const GalleryOptions &options, Mat color, Mat depth)
+	{
+		Size size(options.thumb_width, options.thumb_height);
+		if (isPanoFile(fn)) {
+			PanoImage pano;
+			if (!loadPanoFile(fn, pano) || pano.color.empty())
+				return false;
+			// the smallest stored mip level still as wide as the thumbnail
+			size_t level = 0;
+			while (level + 1 < pano.color.size() && pano.color[level + 1].cols >= size.width)
+				++level;
+			Mat bgra;
+			resize(pano.color[level], bgra, size, 0, 0, INTER_AREA);
+			cvtColor(bgra, color, COLOR_BGRA2BGR);
+			resize(pano.depth, depth, size, 0, 0, INTER_NEAREST);
+		}
+		else {
+			Mat image = imread(fn, IMREAD_COLOR), frame, disp;
+			if (image.empty() || !splitTopBottom(image, frame, disp))
+				return false;
+			resize(frame, color, size, 0, 0, INTER_AREA);
+			// shrink the disparity first, only the thumbnail is converted
+			Mat small_disp;
+			resize(disp, small_disp, size, 0, 0, INTER_NEAREST);
+			opencv::viewableDisp2Original(small_disp, options.disp_scale).copyTo(depth);
+		}
+		normalizeDepth(depth, options.max_depth);
+		return true;
+	}
+
+	// one file per index, each writing its own layer of the stacks
+	class ThumbnailBody : public ParallelLoopBody
+	{
+	public:
+		ThumbnailBody(const vector<string> &files, const GalleryOptions &options, Mat &colors, Mat &depths,
+			vector<uchar> &loaded) : files(files), options(options), colors(colors), depths(depths), loaded(loaded) {}
+
+		void operator()(const Range &range) const
+		{
+			MemoryStage stage("gallery thumbnails");
+			int h = options.thumb_height;
+			for (int i = range.start; i < range.end; ++i) {
+				loaded[i] = loadThumbnail(files[i], options, colors.rowRange(i * h, (i + 1) * h),
+					depths.rowRange(i * h, (i + 1) * h));
+				if (!loaded[i])
+					printf("[gallery] cannot load %s\n", files[i].c_str());
+			}
+		}
+
+	private:
+		const vector<string> &files;
+		const GalleryOptions &options;
+		Mat &colors, &depths;
+		vector<uchar> &loaded;
+	};
+
+	///////////////////////////////////// gallery /////////////////////////////////////
+	// per instance: center X, Y, Z, scale, layer
+	static const int INSTANCE_STRIDE = 5;
+
+	bool Gallery::load(const vector<string> &files, const GalleryOptions &options, ProgramCache *cache)
+	{
+		release();
+		this->options = options;
+		double t = wallTimeMs();
+
+		GLint max_layers = 256;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+		int n_files = min((int)files.size(), (int)max_layers);
+		if (n_files < (int)files.size())
+			printf("[gallery] %d panoramas, texture arrays hold %d layers, the rest are left out\n",
+				(int)files.size(), (int)max_layers);
+
+		Mat colors, depths;
+		vector<uchar> loaded(n_files, 0);
+		{
+			MemoryStage stage("gallery thumbnails");
+			int h = options.thumb_height, w = options.thumb_width;
+			colors.create(n_files * h, w, CV_8UC3);
+			depths.create(n_files * h, w, CV_32F);
+			parallel_for_(Range(0, n_files), ThumbnailBody(files, options, colors, depths, loaded), n_files);
+
+			// close the gaps of files that failed
+			for (int i = 0; i < n_files; ++i) {
+				if (!loaded[i])
+					continue;
+				if (i != n_layers) {
+					Mat color_layer = colors.rowRange(n_layers * h, (n_layers + 1) * h);
+					Mat depth_layer = depths.rowRange(n_layers * h, (n_layers + 1) * h);
+					colors.rowRange(i * h, (i + 1) * h).copyTo(color_layer);
+					depths.rowRange(i * h, (i + 1) * h).copyTo(depth_layer);
+				}
+				++n_layers;
+			}
+			colors = colors.rowRange(0, n_layers * h);
+			depths = depths.rowRange(0, n_layers * h);
+		}
+		double thumbs_ms = wallTimeMs() - t;
+		if (n_layers == 0) {
+			printf("[gallery] no panorama loaded\n");
+			return false;
+		}
+
+		t = wallTimeMs();
+		tex_color = makeTextureArrayFromMat(colors, n_layers, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB, true, "gallery color");
+		tex_depth = makeTextureArrayFromMat(depths, n_layers, GL_RED, GL_FLOAT, GL_R32F, false, "gallery depth");
+		colors.release();
+		depths.release();
+
+		// unit sphere: the grid mesh over a depth of 1 everywhere
+		mesh::MeshData unit;
+		mesh::buildEquirectangular(Mat(options.grid_rows, options.grid_cols, CV_32F, Scalar(1)), unit,
+			options.grid_cols, options.grid_rows, mesh::TESS_GRID);
+		uploadMesh(unit.vertices, unit.indices, sphere, "gallery sphere");
+
+		// instance attributes next to the sphere's in its VAO, advancing once per instance
+		glBindVertexArray(sphere.VAO);
+		glGenBuffers(1, &instance_vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(2);
+		glVertexAttribDivisor(2, 1);
+		glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)(4 * sizeof(float)));
+		glEnableVertexAttribArray(3);
+		glVertexAttribDivisor(3, 1);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glFinish();
+
+		if (!shader.loadShadersFromString(gallery_vs, gallery_fs, cache, "gallery")) {
+			release();
+			return false;
+		}
+		shader.use();
+		shader.setInt("color_layers", 0);
+		shader.setInt("depth_layers", 1);
+
+		printf("[gallery] %d panoramas as %dx%d layers: thumbnails %.2f ms on %d threads, upload %.2f ms; "
+			"sphere %dx%d, %d vertices\n", n_layers, options.thumb_width, options.thumb_height, thumbs_ms,
+			getNumThreads(), wallTimeMs() - t, options.grid_cols, options.grid_rows, (int)unit.numVertices());
+		layout(n_layers);
+		return true;
+	}
+
+	void Gallery::layout(int n_instances)
+	{
+		if (!sphere.VAO)
+			return;
+		this->n_instances = max(n_instances, 0);
+		grid_side = max(1, (int)ceil(sqrt((double)this->n_instances)));
+
+		// the farthest point of a sphere stays 0.45 from its center, a gap between neighbours
+		float scale = 0.45f / options.max_depth, half = 0.5f * (grid_side - 1);
+		vector<float> instances(this->n_instances * INSTANCE_STRIDE);
+		for (int i = 0; i < this->n_instances; ++i) {
+			float *instance = &instances[i * INSTANCE_STRIDE];
+			instance[0] = i % grid_side - half;
+			instance[1] = half - i / grid_side;
+			instance[2] = 0;
+			instance[3] = scale;
+			instance[4] = (float)(i % n_layers);
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(float), instances.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		trackBuffer(instance_vbo, "gallery instances", instances.size() * sizeof(float));
+	}
+
+	glm::vec3 Gallery::overview(float fov) const
+	{
+		float half = 0.5f * grid_side;
+		return glm::vec3(0.f, 0.f, half / tan(glm::radians(0.5f * fov)) + 1.f);
+	}
+
+	void Gallery::bind(Camera &camera, float aspect)
+	{
+		glEnable(GL_DEPTH_TEST);
+		shader.use();
+		shader.setMat4("projection", glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f));
+		shader.setMat4("view", camera.GetViewMatrix());
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tex_color);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tex_depth);
+		glActiveTexture(GL_TEXTURE0);
+		glBindVertexArray(sphere.VAO);
+	}
+
+	void Gallery::draw(Camera &camera, float aspect)
+	{
+		if (n_instances == 0)
+			return;
+		bind(camera, aspect);
+		glDrawElementsInstanced(GL_TRIANGLES, sphere.n_indices, GL_UNSIGNED_INT, (void*)sphere.index_offset,
+			n_instances);
+		glBindVertexArray(0);
+	}
+
+	void Gallery::drawEach(Camera &camera, float aspect)
+	{
+		if (n_instances == 0)
+			return;
+		bind(camera, aspect);
+		// point the instance attributes at one instance at a time; the buffer and shader stay the same
+		glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+		for (int i = 0; i < n_instances; ++i) {
+			size_t offset = i * INSTANCE_STRIDE * sizeof(float);
+			glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)offset);
+			glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float),
+				(void*)(offset + 4 * sizeof(float)));
+			glDrawElementsInstanced(GL_TRIANGLES, sphere.n_indices, GL_UNSIGNED_INT, (void*)sphere.index_offset, 1);
+		}
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)0);
+		glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)(4 * sizeof(float)));
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+	void Gallery::release()
+	{
+		releaseMesh(sphere);
+		deleteBuffer(instance_vbo);
+		deleteTexture(tex_color);
+		deleteTexture(tex_depth);
+		if (shader.ID)
+			glDeleteProgram(shader.ID);
+		shader.ID = 0;
+		n_layers = n_instances = grid_side = 0;
+	}
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	void benchmarkGallery(Gallery &gallery, int max_instances, float aspect, int n_frames)
+	{
+		vector<int> counts;
+		for (int n = 1; n < max_instances; n *= 2)
+			counts.push_back(n);
+		counts.push_back(max_instances);
+
+		// the camera frames the largest grid throughout, so every count covers the same screen area
+		// per sphere and the frame time grows with the count alone
+		Camera camera;
+		gallery.layout(max_instances);
+		glm::vec3 eye = gallery.overview(camera.Zoom);
+		camera.setPosition(eye.x, eye.y, eye.z);
+
+		printf("[gallery] %d layers, %d frames per count, timed around glFinish:\n", gallery.numLayers(), n_frames);
+		for (int n : counts) {
+			gallery.layout(n);
+			double ms[2] = {};
+			for (int m = 0; m < 2; ++m) {
+				// one frame to warm up
+				for (int f = 0; f <= n_frames; ++f) {
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+					glFinish();
+					double t = wallTimeMs();
+					if (m == 0)
+						gallery.draw(camera, aspect);
+					else
+						gallery.drawEach(camera, aspect);
+					glFinish();
+					if (f > 0)
+						ms[m] += wallTimeMs() - t;
+				}
+			}
+			printf("[gallery] %4d panoramas: instanced %7.3f ms/frame, one draw each %7.3f ms/frame (%.2fx)\n", n,
+				ms[0] / n_frames, ms[1] / n_frames, ms[0] > 0 ? ms[1] / ms[0] : 0.);
+		}
+		gallery.layout(gallery.numLayers());
+	}
+
+	///////////////////////////////////// interactive /////////////////////////////////////
+	void runGallery(GLFWwindow *window, Gallery &gallery, int n_instances, float aspect)
+	{
+		gallery.layout(n_instances);
+		Camera &camera = getDefaultCamera();
+		glm::vec3 eye = gallery.overview(camera.Zoom);
+		camera.setPosition(eye.x, eye.y, eye.z);
+
+		// CPU time of a frame up to glFinish, what the draw costs without waiting for the swap
+		LatencyStats frame_ms;
+		double last_report = wallTimeMs();
+		while (!glfwWindowShouldClose(window)) {
+			bool more = keyPressedOnce(window, GLFW_KEY_UP), fewer = keyPressedOnce(window, GLFW_KEY_DOWN);
+			if (more || fewer) {
+				n_instances = more ? n_instances * 2 : max(1, n_instances / 2);
+				gallery.layout(n_instances);
+				printf("[gallery] %d panoramas\n", n_instances);
+			}
+			processInput(window);
+
+			double t = wallTimeMs();
+			glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			gallery.draw(camera, aspect);
+			glFinish();
+			frame_ms.add(wallTimeMs() - t);
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+
+			if (wallTimeMs() - last_report > 3000) {
+				frame_ms.report("gallery", format("%d panoramas, frame time over", gallery.numInstances()));
+				last_report = wallTimeMs();
+			}
+		}
+		frame_ms.summary("gallery", "frame time over");
+	}
+} }
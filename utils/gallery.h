@@ -0,0 +1,65 @@
+/* Gallery: many panoramas drawn at once from shared geometry and texture arrays.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "utils/utils.opengl.h"
+
+namespace kandao { namespace OpenGL
+{
+	struct GalleryOptions
+	{
+		int thumb_width = 256, thumb_height = 128;	// every layer of both texture arrays
+		int grid_cols = 64, grid_rows = 32;			// the sphere all panoramas share
+		float disp_scale = 0.01f;					// as for viewableDisp2Original
+		float max_depth = 2.f;		// depth is relative to the median of each panorama, clamped here
+	};
+
+	// Every panorama is a thumbnail layer in two GL_TEXTURE_2D_ARRAYs, color and depth, and one
+	// instance of a single low resolution unit sphere; its vertex shader pushes the sphere out to
+	// the depth of the instance's layer. Centers, sizes and layers sit in an instance buffer, so
+	// the whole gallery is one instanced draw whatever the number of panoramas.
+	class Gallery
+	{
+	public:
+		~Gallery() { release(); }
+
+		// thumbnails of top-bottom images or .kpan files, decoded and resized in parallel; files that
+		// fail to load are left out. False when none loaded or the program does not build.
+		bool load(const std::vector<std::string> &files, const GalleryOptions &options = GalleryOptions(),
+			ProgramCache *cache = NULL);
+		// n_instances spheres on a square grid facing +Z, one unit apart; panoramas repeat when
+		// there are more instances than layers
+		void layout(int n_instances);
+		// camera position on +Z that sees the whole grid at fov degrees
+		glm::vec3 overview(float fov = 45.f) const;
+
+		void draw(Camera &camera, float aspect);
+		// the same picture with one draw call per instance, for comparison
+		void drawEach(Camera &camera, float aspect);
+		void release();
+
+		int numLayers() const { return n_layers; }
+		int numInstances() const { return n_instances; }
+
+	private:
+		void bind(Camera &camera, float aspect);
+
+		GalleryOptions options;
+		Shader shader;
+		MeshBuffers sphere;
+		GLuint instance_vbo = 0;
+		GLuint tex_color = 0, tex_depth = 0;
+		int n_layers = 0, n_instances = 0, grid_side = 0;
+	};
+
+	// frame time of the instanced draw against one draw per instance, the instance count doubling
+	// from 1 up to max_instances; timed around glFinish
+	void benchmarkGallery(Gallery &gallery, int max_instances, float aspect, int n_frames = 20);
+
+	// interactive: WASD and mouse as in the viewer, UP / DOWN double or halve the instances;
+	// the frame time is logged every few seconds
+	void runGallery(GLFWwindow *window, Gallery &gallery, int n_instances, float aspect);
+} }
@@ -0,0 +1,471 @@
+/* Watch-folder ingest: new top-bottom panoramas through a staged pipeline into review-ready files.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cstdio>
+#include <cstring>
+#include <map>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include "utils/ingest.h"
+#include "utils/depth_upsample.h"
+#include "utils/panofile.h"
+#include "utils/utils.opencv.h"
+#include "utils/memory.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	static const char *stage_names[N_INGEST_STAGES] = { "read", "decode", "depth", "mesh", "write" };
+	// MemoryStage names must outlive the Mats counted under them
+	static const char *memory_stages[N_INGEST_STAGES] = {
+		"ingest read", "ingest decode", "ingest depth", "ingest mesh", "ingest write" };
+
+	///////////////////////////////////// helpers /////////////////////////////////////
+	static bool isPanoramaName(const string &name)
+	{
+		size_t dot = name.rfind('.');
+		if (dot == string::npos)
+			return false;
+		string ext = name.substr(dot + 1);
+		for (char &c : ext)
+			c = (char)tolower(c);
+		return ext == "jpg" || ext == "jpeg" || ext == "png";
+	}
+
+	static string stemOf(const string &name)
+	{
+		size_t slash = name.find_last_of("/\\");
+		string base = slash == string::npos ? name : name.substr(slash + 1);
+		return base.substr(0, base.rfind('.'));
+	}
+
+	static bool fileExists(const string &fn)
+	{
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (fp)
+			fclose(fp);
+		return fp != NULL;
+	}
+
+	static bool readFile(const string &fn, vector<unsigned char> &data)
+	{
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (!fp)
+			return false;
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		data.resize(max(size, 0L));
+		bool ok = size > 0 && fread(data.data(), 1, data.size(), fp) == data.size();
+		fclose(fp);
+		return ok;
+	}
+
+	// replaces dst in one step, readers see the old file or the new one
+	static bool renameOver(const string &src, const string &dst)
+	{
+#ifdef _WIN32
+		return MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(src.c_str(), dst.c_str()) == 0;
+#endif
+	}
+
+	bool writeMeshFile(const std::string &fn, const mesh::MeshData &mesh)
+	{
+		FILE *fp = fopen(fn.c_str(), "wb");
+		if (!fp) {
+			printf("[ingest] cannot write %s\n", fn.c_str());
+			return false;
+		}
+		unsigned int header[5] = { 1, (unsigned int)mesh.n_cols, (unsigned int)mesh.n_rows,
+			(unsigned int)mesh.numVertices(), (unsigned int)mesh.indices.size() };
+		bool ok = fwrite("KMSH", 4, 1, fp) == 1 && fwrite(header, sizeof(header), 1, fp) == 1 &&
+			fwrite(mesh.vertices.data(), sizeof(float), mesh.vertices.size(), fp) == mesh.vertices.size() &&
+			fwrite(mesh.indices.data(), sizeof(unsigned int), mesh.indices.size(), fp) == mesh.indices.size();
+		fclose(fp);
+		return ok;
+	}
+
+	///////////////////////////////////// watcher /////////////////////////////////////
+	// Names of files that appeared in one directory, complete: inotify IN_CLOSE_WRITE and
+	// IN_MOVED_TO on Linux. ReadDirectoryChangesW only tells that a file changed, so on Windows
+	// a name is reported once it stayed quiet for settle_ms.
+	class DirectoryWatcher
+	{
+	public:
+		~DirectoryWatcher() { close(); }
+
+		bool open(const string &dir, double settle_ms = 500)
+		{
+			close();
+#ifdef _WIN32
+			this->settle_ms = settle_ms;
+			dir_handle = CreateFileA(dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE |
+				FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+			if (dir_handle == INVALID_HANDLE_VALUE) {
+				printf("[ingest] cannot watch %s, error %lu\n", dir.c_str(), GetLastError());
+				return false;
+			}
+			event = CreateEventA(NULL, TRUE, FALSE, NULL);
+			buffer.resize(16384);
+			return startRead();
+#else
+			fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			wd = fd < 0 ? -1 : inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd < 0) {
+				printf("[ingest] cannot watch %s\n", dir.c_str());
+				close();
+				return false;
+			}
+			return true;
+#endif
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (dir_handle != INVALID_HANDLE_VALUE) {
+				DWORD n;
+				if (reading) {
+					CancelIo(dir_handle);
+					GetOverlappedResult(dir_handle, &overlapped, &n, TRUE);
+				}
+				CloseHandle(dir_handle);
+			}
+			reading = false;
+			if (event)
+				CloseHandle(event);
+			dir_handle = INVALID_HANDLE_VALUE;
+			event = NULL;
+			changed.clear();
+#else
+			if (fd >= 0)
+				::close(fd);
+			fd = wd = -1;
+#endif
+		}
+
+		// waits up to timeout_ms and appends file names, without the directory; returns false when
+		// events were lost and the directory has to be listed again
+		bool wait(vector<string> &names, int timeout_ms)
+		{
+			bool complete = true;
+#ifdef _WIN32
+			// changed files are looked at again before they settle
+			if (!changed.empty())
+				timeout_ms = min(timeout_ms, 100);
+			if (reading && WaitForSingleObject(event, timeout_ms) == WAIT_OBJECT_0) {
+				DWORD n = 0;
+				GetOverlappedResult(dir_handle, &overlapped, &n, FALSE);
+				// nothing returned means the buffer overflowed
+				complete = n > 0;
+				for (size_t offset = 0; n > 0;) {
+					const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION*)((const char*)buffer.data() + offset);
+					char name[MAX_PATH * 4];
+					int len = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(WCHAR), name,
+						sizeof(name) - 1, NULL, NULL);
+					name[max(len, 0)] = 0;
+					if (info->Action == FILE_ACTION_REMOVED || info->Action == FILE_ACTION_RENAMED_OLD_NAME)
+						changed.erase(name);
+					else
+						changed[name] = wallTimeMs();
+					if (!info->NextEntryOffset)
+						break;
+					offset += info->NextEntryOffset;
+				}
+				startRead();
+			}
+			double now = wallTimeMs();
+			for (auto it = changed.begin(); it != changed.end();) {
+				if (now - it->second < settle_ms) {
+					++it;
+					continue;
+				}
+				names.push_back(it->first);
+				it = changed.erase(it);
+			}
+#else
+			pollfd p = { fd, POLLIN, 0 };
+			if (poll(&p, 1, timeout_ms) <= 0)
+				return true;
+			alignas(inotify_event) char buf[16384];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0) {
+				for (char *e = buf; e < buf + n;) {
+					const inotify_event *event = (const inotify_event*)e;
+					if (event->mask & IN_Q_OVERFLOW)
+						complete = false;
+					else if (event->len && !(event->mask & IN_ISDIR))
+						names.push_back(event->name);
+					e += sizeof(inotify_event) + event->len;
+				}
+			}
+#endif
+			return complete;
+		}
+
+	private:
+#ifdef _WIN32
+		bool startRead()
+		{
+			ResetEvent(event);
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.hEvent = event;
+			reading = ReadDirectoryChangesW(dir_handle, buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)), FALSE,
+				FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE, NULL,
+				&overlapped, NULL) != 0;
+			return reading;
+		}
+
+		HANDLE dir_handle = INVALID_HANDLE_VALUE, event = NULL;
+		OVERLAPPED overlapped;
+		bool reading = false;
+		vector<DWORD> buffer;			// DWORD aligned, as ReadDirectoryChangesW wants
+		map<string, double> changed;	// name and time of its last change
+		double settle_ms = 500;
+#else
+		int fd = -1, wd = -1;
+#endif
+	};
+
+	///////////////////////////////////// IngestService /////////////////////////////////////
+	IngestService::IngestService(const std::string &in_dir, const std::string &out_dir, const IngestOptions &options)
+		: in_dir(in_dir), out_dir(out_dir), options(options)
+	{
+		for (int s = 0; s < N_INGEST_STAGES; ++s) {
+			queues.push_back(unique_ptr<BoundedQueue<JobPtr> >(new BoundedQueue<JobPtr>(max(options.queue_capacity, 1))));
+			running[s] = max(options.workers[s], 1);
+		}
+		for (int s = 0; s < N_INGEST_STAGES; ++s) {
+			for (int i = 0; i < running[s]; ++i)
+				workers.push_back(thread(&IngestService::work, this, s));
+		}
+	}
+
+	IngestService::~IngestService()
+	{
+		for (auto &queue : queues)
+			queue->close();
+		for (auto &worker : workers) {
+			if (worker.joinable())
+				worker.join();
+		}
+	}
+
+	bool IngestService::run(const std::atomic<bool> &stop)
+	{
+		DirectoryWatcher watcher;
+		if (!watcher.open(in_dir))
+			return false;
+		printf("[ingest] watching %s, writing to %s; workers", in_dir.c_str(), out_dir.c_str());
+		for (int s = 0; s < N_INGEST_STAGES; ++s)
+			printf(" %s %d", stage_names[s], max(options.workers[s], 1));
+		printf(", %d jobs queued per stage at most\n", max(options.queue_capacity, 1));
+
+		last_report = wallTimeMs();
+		// watching starts first so nothing written while listing is missed
+		if (options.existing)
+			listExisting();
+		vector<string> names;
+		while (!stop) {
+			names.clear();
+			if (!watcher.wait(names, 100)) {
+				printf("[ingest] watch events were lost, listing %s again\n", in_dir.c_str());
+				listExisting();
+			}
+			// names of a burst wait for the read queue here, their latency counts from now
+			double found_ms = wallTimeMs();
+			for (const string &name : names) {
+				if (!stop && isPanoramaName(name))
+					submit(name, found_ms);
+			}
+			if (wallTimeMs() - last_report >= options.report_ms)
+				report(false);
+		}
+
+		// every stage finishes what it holds, then closes the queue behind it
+		printf("[ingest] stopping, finishing the files in flight\n");
+		queues.front()->close();
+		for (auto &worker : workers)
+			worker.join();
+		summary();
+		return true;
+	}
+
+	void IngestService::listExisting()
+	{
+		vector<String> files;
+		glob(in_dir + "/*", files, false);
+		int n = 0;
+		for (const String &fn : files) {
+			string name = fn.substr(fn.find_last_of("/\\") + 1);
+			if (isPanoramaName(name) && !fileExists(out_dir + "/" + stemOf(name) + ".kpan")) {
+				submit(name, wallTimeMs());
+				++n;
+			}
+		}
+		if (n)
+			printf("[ingest] %d files in %s without output\n", n, in_dir.c_str());
+	}
+
+	void IngestService::submit(const std::string &name, double found_ms)
+	{
+		JobPtr job(new Job());
+		job->name = name;
+		job->found_ms = job->queued_ms = found_ms;
+		{
+			lock_guard<mutex> lock(mtx);
+			if (!in_flight.insert(name).second)
+				return;
+			++n_found;
+		}
+		// a full read queue is the backpressure: the names wait in the kernel, reports go on
+		while (!queues.front()->push(job, 200)) {
+			if (wallTimeMs() - last_report >= options.report_ms)
+				report(false);
+		}
+	}
+
+	void IngestService::work(int stage)
+	{
+		JobPtr job;
+		while (queues[stage]->pop(job)) {
+			double t = wallTimeMs();
+			bool ok;
+			{
+				MemoryStage memory(memory_stages[stage]);
+				ok = process(stage, *job);
+			}
+			double done = wallTimeMs();
+			bool last = stage + 1 == N_INGEST_STAGES;
+			{
+				lock_guard<mutex> lock(mtx);
+				stage_ms[stage].add(done - t);
+				if (!ok || last)
+					in_flight.erase(job->name);
+				if (!ok) {
+					++n_failed;
+				}
+				else if (last) {
+					++n_done;
+					file_ms.add(done - job->found_ms);
+				}
+			}
+			if (ok && last) {
+				printf("[ingest] %s ready, %.0f ms after it was found\n", job->name.c_str(), done - job->found_ms);
+			}
+			else if (ok) {
+				job->queued_ms = done;
+				queues[stage + 1]->push(job);
+			}
+			job.reset();
+		}
+		// the last worker of a stage closes the queue of the next one
+		if (--running[stage] == 0 && stage + 1 < N_INGEST_STAGES)
+			queues[stage + 1]->close();
+	}
+
+	bool IngestService::process(int stage, Job &job)
+	{
+		MemoryTracker &memory = MemoryTracker::instance();
+		switch (stage) {
+		case INGEST_READ:
+			if (!readFile(in_dir + "/" + job.name, job.bytes)) {
+				printf("[ingest] cannot read %s\n", job.name.c_str());
+				return false;
+			}
+			memory.addCpu(memory_stages[INGEST_READ], job.bytes.size());
+			return true;
+
+		case INGEST_DECODE:
+			job.image = imdecode(job.bytes, IMREAD_COLOR);
+			memory.addCpu(memory_stages[INGEST_READ], -(long long)job.bytes.size());
+			vector<unsigned char>().swap(job.bytes);
+			if (job.image.empty()) {
+				printf("[ingest] cannot decode %s\n", job.name.c_str());
+				return false;
+			}
+			return true;
+
+		case INGEST_DEPTH:
+			// frame and disp are views into the image, or the upsampled disparity of a reduced layout
+			if (!splitTopBottom(job.image, job.frame, job.disp)) {
+				printf("[ingest] %s is not a top-bottom panorama\n", job.name.c_str());
+				return false;
+			}
+			job.image.release();
+			job.depth = opencv::viewableDisp2Original(job.disp, options.disp_scale);
+			return true;
+
+		case INGEST_MESH:
+			mesh::buildEquirectangular(job.depth, job.mesh, options.n_cols, options.n_rows, options.tess,
+				options.cull_ratio);
+			job.depth.release();
+			return true;
+
+		case INGEST_WRITE: {
+			string base = out_dir + "/" + stemOf(job.name);
+			bool ok = writePanoFile(base + ".kpan.part", job.frame, job.disp, options.disp_scale) &&
+				writeMeshFile(base + ".kmesh.part", job.mesh) &&
+				renameOver(base + ".kmesh.part", base + ".kmesh") && renameOver(base + ".kpan.part", base + ".kpan");
+			if (!ok) {
+				printf("[ingest] cannot write %s.kpan / .kmesh\n", base.c_str());
+				remove((base + ".kpan.part").c_str());
+				remove((base + ".kmesh.part").c_str());
+			}
+			return ok;
+		}
+		}
+		return false;
+	}
+
+	void IngestService::report(bool always)
+	{
+		last_report = wallTimeMs();
+		{
+			// nothing to say while idle
+			lock_guard<mutex> lock(mtx);
+			int n_seen = n_found + n_done + n_failed;
+			if (!always && n_seen == n_reported)
+				return;
+			n_reported = n_seen;
+		}
+		string depths;
+		for (int s = 0; s < N_INGEST_STAGES; ++s)
+			depths += format(" %s %d/%d (max %d)", stage_names[s], queues[s]->size(), queues[s]->capacity,
+				queues[s]->takeMaxDepth());
+
+		lock_guard<mutex> lock(mtx);
+		printf("[ingest] %d found, %d done, %d failed; queued%s\n", n_found, n_done, n_failed, depths.c_str());
+		for (int s = 0; s < N_INGEST_STAGES; ++s)
+			stage_ms[s].report("ingest", stage_names[s]);
+		file_ms.report("ingest", "file");
+
+		string stages;
+		map<string, MemoryTracker::Totals> cpu = MemoryTracker::instance().cpuStages();
+		for (int s = 0; s < N_INGEST_STAGES; ++s) {
+			const MemoryTracker::Totals &totals = cpu[memory_stages[s]];
+			stages += format(" %s %.1f MB (peak %.1f)", stage_names[s], totals.current / 1048576., totals.peak / 1048576.);
+		}
+		printf("[ingest] cpu memory%s\n", stages.c_str());
+	}
+
+	void IngestService::summary()
+	{
+		report(false);
+		lock_guard<mutex> lock(mtx);
+		for (int s = 0; s < N_INGEST_STAGES; ++s)
+			stage_ms[s].summary("ingest", stage_names[s]);
+		file_ms.summary("ingest", "file");
+		printf("[ingest] total %d found, %d done, %d failed\n", n_found, n_done, n_failed);
+	}
+}
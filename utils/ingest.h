@@ -0,0 +1,172 @@
+/* Watch-folder ingest: new top-bottom panoramas through a staged pipeline into review-ready files.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "utils/mesh.h"
+#include "utils/timer.h"
+
+namespace kandao
+{
+	///////////////////////////////////// queue /////////////////////////////////////
+	// FIFO of at most capacity items. push blocks while full, which is what holds a fast stage
+	// back behind a slow one; pop blocks while empty. After close, push fails and pop drains.
+	template<typename T>
+	class BoundedQueue
+	{
+	public:
+		explicit BoundedQueue(int capacity = 2) : capacity(capacity) {}
+
+		// false when closed, or still full after timeout_ms (< 0 waits for good); item is only moved
+		// from when it went in
+		bool push(T &item, int timeout_ms = -1)
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			auto space = [&]() { return closed || (int)items.size() < capacity; };
+			if (timeout_ms < 0)
+				cv_space.wait(lock, space);
+			else if (!cv_space.wait_for(lock, std::chrono::milliseconds(timeout_ms), space))
+				return false;
+			if (closed)
+				return false;
+			items.push_back(std::move(item));
+			max_depth = std::max(max_depth, (int)items.size());
+			cv_items.notify_one();
+			return true;
+		}
+
+		bool pop(T &item)
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_items.wait(lock, [&]() { return closed || !items.empty(); });
+			if (items.empty())
+				return false;
+			item = std::move(items.front());
+			items.pop_front();
+			cv_space.notify_one();
+			return true;
+		}
+
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			closed = true;
+			cv_items.notify_all();
+			cv_space.notify_all();
+		}
+
+		int size() const
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			return (int)items.size();
+		}
+
+		// deepest since the last call
+		int takeMaxDepth()
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			int depth = max_depth;
+			max_depth = (int)items.size();
+			return depth;
+		}
+
+		const int capacity;
+
+	private:
+		mutable std::mutex mtx;
+		std::condition_variable cv_items, cv_space;
+		std::deque<T> items;
+		bool closed = false;
+		int max_depth = 0;
+	};
+
+	///////////////////////////////////// pipeline /////////////////////////////////////
+	enum IngestStage
+	{
+		INGEST_READ,		// file bytes
+		INGEST_DECODE,		// image
+		INGEST_DEPTH,		// color and disparity views, depth
+		INGEST_MESH,		// mesh::buildEquirectangular
+		INGEST_WRITE,		// <name>.kpan and <name>.kmesh in the output directory
+		N_INGEST_STAGES,
+	};
+
+	struct IngestOptions
+	{
+		int workers[N_INGEST_STAGES] = { 1, 2, 1, 2, 1 };
+		int queue_capacity = 2;		// jobs waiting in front of each stage
+		int n_cols = 1000, n_rows = 500;
+		float disp_scale = 0.01f;
+		mesh::Tessellation tess = mesh::TESS_GRID;
+		float cull_ratio = 0;		// depth edge culling, see mesh::buildEquirectangular
+		bool existing = true;		// also take files already there whose output is missing
+		double report_ms = 5000;
+	};
+
+	// A .kmesh file is the mesh as built for the viewer, little endian:
+	//   char magic[4] = "KMSH", uint32 version = 1, n_cols, n_rows, n_vertices, n_indices
+	//   float vertices[n_vertices * 5]		X, Y, Z, u, v
+	//   uint32 indices[n_indices]
+	bool writeMeshFile(const std::string &fn, const mesh::MeshData &mesh);
+
+	// Every stage has its own workers and takes jobs from a bounded queue in front of it, so at
+	// most capacity + workers jobs are held per stage: in a burst the watcher blocks on a full
+	// read queue and the names wait in the kernel instead of as decoded images in memory.
+	// Outputs are written under a temporary name and renamed, so whatever picks them up next
+	// never sees half a file.
+	class IngestService
+	{
+	public:
+		IngestService(const std::string &in_dir, const std::string &out_dir,
+			const IngestOptions &options = IngestOptions());
+		~IngestService();
+
+		// watch until stop turns true, reporting every report_ms; then drain every queue
+		bool run(const std::atomic<bool> &stop);
+
+		// queue depths, per-stage latency and file latency since the last report; unless always,
+		// only when files were found or finished since
+		void report(bool always = true);
+		void summary();
+
+	private:
+		struct Job
+		{
+			std::string name;
+			double found_ms = 0, queued_ms = 0;
+			std::vector<unsigned char> bytes;
+			cv::Mat image, frame, disp, depth;
+			mesh::MeshData mesh;
+		};
+		typedef std::unique_ptr<Job> JobPtr;
+
+		void work(int stage);
+		bool process(int stage, Job &job);
+		void submit(const std::string &name, double found_ms);
+		void listExisting();
+
+		std::string in_dir, out_dir;
+		IngestOptions options;
+		std::vector<std::unique_ptr<BoundedQueue<JobPtr> > > queues;
+		std::vector<std::thread> workers;
+		std::atomic<int> running[N_INGEST_STAGES];
+
+		std::mutex mtx;
+		LatencyStats stage_ms[N_INGEST_STAGES], file_ms;
+		int n_found = 0, n_done = 0, n_failed = 0, n_reported = 0;
+		double last_report = 0;
+		// queued or in progress; a name seen again meanwhile is dropped, two writers would share its .part file
+		std::set<std::string> in_flight;
+	};
+}
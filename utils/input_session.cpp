@@ -0,0 +1,267 @@
+/* Input recording and fixed-step replay for reproducible performance runs.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "utils/input_session.h"
+
+using namespace std;
+
+namespace kandao { namespace OpenGL
+{
+	static double percentile(vector<double> values, double p)
+	{
+		if (values.empty())
+			return 0;
+		size_t k = min(values.size() - 1, (size_t)(p * values.size()));
+		nth_element(values.begin(), values.begin() + k, values.end());
+		return values[k];
+	}
+
+	///////////////////////////////////// recording /////////////////////////////////////
+	bool InputSession::startRecording(const std::string &out_fn, double t_start, const Camera &camera)
+	{
+		// fail now rather than after a long session
+		FILE *fp = fopen(out_fn.c_str(), "w");
+		if (!fp) {
+			printf("[input] cannot write %s\n", out_fn.c_str());
+			return false;
+		}
+		fclose(fp);
+
+		fn = out_fn;
+		replay_mode = false;
+		events.clear();
+		keys.clear();
+		t0 = t_start;
+		logCamera(t_start, camera);
+		return true;
+	}
+
+	void InputSession::logKey(double t, int key, bool down)
+	{
+		// keys are polled every frame, only changes are worth a line
+		auto it = keys.find(key);
+		if (it != keys.end() ? it->second == down : !down)
+			return;
+		keys[key] = down;
+
+		Event e;
+		e.type = 'k';
+		e.t = t - t0;
+		e.key = key;
+		e.v[0] = down;
+		events.push_back(e);
+	}
+
+	void InputSession::logMouse(double t, float dx, float dy)
+	{
+		Event e;
+		e.type = 'm';
+		e.t = t - t0;
+		e.v[0] = dx;
+		e.v[1] = dy;
+		events.push_back(e);
+	}
+
+	void InputSession::logScroll(double t, float dy)
+	{
+		Event e;
+		e.type = 's';
+		e.t = t - t0;
+		e.v[0] = dy;
+		events.push_back(e);
+	}
+
+	void InputSession::logCamera(double t, const Camera &camera)
+	{
+		Event e;
+		e.type = 'c';
+		e.t = t - t0;
+		e.v[0] = camera.Position.x;
+		e.v[1] = camera.Position.y;
+		e.v[2] = camera.Position.z;
+		e.v[3] = camera.Yaw;
+		e.v[4] = camera.Pitch;
+		e.v[5] = camera.Zoom;
+		events.push_back(e);
+	}
+
+	bool InputSession::save() const
+	{
+		FILE *fp = fopen(fn.c_str(), "w");
+		if (!fp) {
+			printf("[input] cannot write %s\n", fn.c_str());
+			return false;
+		}
+
+		int n_input = 0;
+		for (const Event &e : events) {
+			switch (e.type) {
+			case 'k': fprintf(fp, "k %.6f %d %d\n", e.t, e.key, (int)e.v[0]); break;
+			case 'm': fprintf(fp, "m %.6f %.9g %.9g\n", e.t, e.v[0], e.v[1]); break;
+			case 's': fprintf(fp, "s %.6f %.9g\n", e.t, e.v[0]); break;
+			case 'c': fprintf(fp, "c %.6f %.9g %.9g %.9g %.9g %.9g %.9g\n", e.t, e.v[0], e.v[1], e.v[2], e.v[3], e.v[4],
+				e.v[5]); break;
+			}
+			n_input += e.type != 'c';
+		}
+		fclose(fp);
+		printf("[input] %s: %d input events, %d camera poses over %.1f s\n", fn.c_str(), n_input,
+			(int)events.size() - n_input, events.empty() ? 0. : events.back().t);
+		return true;
+	}
+
+	///////////////////////////////////// replay /////////////////////////////////////
+	bool InputSession::load(const std::string &in_fn, double step)
+	{
+		FILE *fp = fopen(in_fn.c_str(), "r");
+		if (!fp) {
+			printf("[input] cannot read %s\n", in_fn.c_str());
+			return false;
+		}
+
+		events.clear();
+		char line[256];
+		int n_bad = 0;
+		while (fgets(line, sizeof(line), fp)) {
+			Event e;
+			e.type = line[0];
+			int n = 0, down = 0;
+			switch (e.type) {
+			case 'k': n = sscanf(line + 1, "%lf %d %d", &e.t, &e.key, &down) == 3; e.v[0] = (float)down; break;
+			case 'm': n = sscanf(line + 1, "%lf %f %f", &e.t, &e.v[0], &e.v[1]) == 3; break;
+			case 's': n = sscanf(line + 1, "%lf %f", &e.t, &e.v[0]) == 2; break;
+			case 'c': n = sscanf(line + 1, "%lf %f %f %f %f %f %f", &e.t, &e.v[0], &e.v[1], &e.v[2], &e.v[3], &e.v[4],
+				&e.v[5]) == 7; break;
+			}
+			if (n)
+				events.push_back(e);
+			else if (line[0] != '\n' && line[0] != '#')
+				++n_bad;
+		}
+		fclose(fp);
+		if (n_bad)
+			printf("[input] %s: skipped %d malformed lines\n", in_fn.c_str(), n_bad);
+
+		// the file is written in order, but keep replay correct for hand-edited ones
+		stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.t < b.t; });
+
+		fn = in_fn;
+		replay_mode = true;
+		step_s = step;
+		clock = 0;
+		next = last_pose = 0;
+		have_pose = false;
+		keys.clear();
+		frames.clear();
+		gpu_ms.clear();
+		max_drift = max_angle = last_drift = last_angle = 0;
+		printf("[input] replaying %s: %d events over %.1f s at %.2f ms steps\n", fn.c_str(), (int)events.size(),
+			events.empty() ? 0. : events.back().t, step_s * 1000);
+		return true;
+	}
+
+	void InputSession::restoreCamera(Camera &camera) const
+	{
+		for (const Event &e : events) {
+			if (e.type != 'c')
+				continue;
+			camera.setPosition(e.v[0], e.v[1], e.v[2]);
+			camera.setOrientation(e.v[3], e.v[4]);
+			camera.Zoom = e.v[5];
+			return;
+		}
+	}
+
+	const std::vector<InputSession::Event>& InputSession::advance()
+	{
+		due.clear();
+		clock += step_s;
+		for (; next < events.size() && events[next].t <= clock; ++next) {
+			const Event &e = events[next];
+			if (e.type == 'k')
+				keys[e.key] = e.v[0] != 0;
+			else if (e.type == 'm' || e.type == 's')
+				due.push_back(e);
+		}
+		return due;
+	}
+
+	bool InputSession::keyDown(int key) const
+	{
+		auto it = keys.find(key);
+		return it != keys.end() && it->second;
+	}
+
+	void InputSession::compareCamera(const Camera &camera)
+	{
+		// latest recorded pose not after the replay clock
+		for (size_t i = last_pose; i < events.size() && events[i].t <= clock; ++i) {
+			if (events[i].type == 'c') {
+				last_pose = i;
+				have_pose = true;
+			}
+		}
+		if (!have_pose)
+			return;
+
+		const Event &e = events[last_pose];
+		float dx = camera.Position.x - e.v[0], dy = camera.Position.y - e.v[1], dz = camera.Position.z - e.v[2];
+		last_drift = sqrt(dx * dx + dy * dy + dz * dz);
+		last_angle = max(fabs(camera.Yaw - e.v[3]), fabs(camera.Pitch - e.v[4]));
+		max_drift = max(max_drift, last_drift);
+		max_angle = max(max_angle, last_angle);
+	}
+
+	void InputSession::frameTiming(double frame_ms)
+	{
+		Frame f = { clock, frame_ms, last_drift };
+		frames.push_back(f);
+	}
+
+	void InputSession::gpuTiming(double ms)
+	{
+		gpu_ms.push_back(ms);
+	}
+
+	void InputSession::printSummary() const
+	{
+		if (frames.empty())
+			return;
+
+		vector<double> ms(frames.size());
+		double sum = 0;
+		for (size_t i = 0; i < frames.size(); ++i) {
+			ms[i] = frames[i].frame_ms;
+			sum += ms[i];
+		}
+		double gpu_sum = 0;
+		for (double g : gpu_ms)
+			gpu_sum += g;
+
+		printf("[replay] %s: %d frames, %.1f s simulated in %.1f s wall\n", fn.c_str(), (int)frames.size(),
+			frames.back().t, sum / 1000);
+		printf("[replay] frame ms avg %.2f, p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n", sum / frames.size(),
+			percentile(ms, 0.5), percentile(ms, 0.95), percentile(ms, 0.99), percentile(ms, 1.));
+		if (!gpu_ms.empty())
+			printf("[replay] gpu ms avg %.3f, p95 %.3f, max %.3f over %d samples\n", gpu_sum / gpu_ms.size(),
+				percentile(gpu_ms, 0.95), percentile(gpu_ms, 1.), (int)gpu_ms.size());
+		printf("[replay] camera drift from the recording: %.4f max, %.4f final, orientation %.3f deg max\n",
+			max_drift, last_drift, max_angle);
+	}
+
+	bool InputSession::writeTiming(const std::string &out_fn) const
+	{
+		FILE *fp = fopen(out_fn.c_str(), "w");
+		if (!fp)
+			return false;
+		fprintf(fp, "frame,t,frame_ms,drift\n");
+		for (size_t i = 0; i < frames.size(); ++i)
+			fprintf(fp, "%d,%.4f,%.3f,%.5f\n", (int)i, frames[i].t, frames[i].frame_ms, frames[i].drift);
+		fclose(fp);
+		return true;
+	}
+} }
@@ -0,0 +1,84 @@
+/* Input recording and fixed-step replay for reproducible performance runs.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "utils/utils.opengl.h"
+
+namespace kandao { namespace OpenGL
+{
+	// A session is a text file of timestamped input events plus the camera pose after every
+	// recorded frame, one per line, times in seconds from the start:
+	//   k <t> <key> <0|1>                          key released / pressed
+	//   m <t> <dx> <dy>                            mouse movement, already relative
+	//   s <t> <dy>                                 scroll
+	//   c <t> <x> <y> <z> <yaw> <pitch> <zoom>     camera pose
+	// Replay advances a simulated clock by a fixed step per frame and feeds every event that
+	// fell due, so a run does not depend on the frame rate of the machine it plays on. The
+	// recorded poses measure how far the replayed camera drifts from the original.
+	class InputSession
+	{
+	public:
+		struct Event
+		{
+			char type = 0;
+			double t = 0;
+			int key = 0;
+			float v[6] = { 0 };
+		};
+
+		///// recording /////
+		// t_start: glfwGetTime() at the start, all later times are absolute as well
+		bool startRecording(const std::string &fn, double t_start, const Camera &camera);
+		void logKey(double t, int key, bool down);
+		void logMouse(double t, float dx, float dy);
+		void logScroll(double t, float dy);
+		void logCamera(double t, const Camera &camera);
+		bool save() const;
+
+		///// replay /////
+		bool load(const std::string &fn, double step);
+		// pose at the start of the recording
+		void restoreCamera(Camera &camera) const;
+		// move the clock one step, returns the mouse and scroll events now due; keys are tracked here
+		const std::vector<Event>& advance();
+		bool keyDown(int key) const;
+		// replayed past the last event
+		bool finished() const { return replay_mode && next >= events.size(); }
+		double step() const { return step_s; }
+
+		// after each replayed frame
+		void compareCamera(const Camera &camera);
+		void frameTiming(double frame_ms);
+		void gpuTiming(double gpu_ms);
+		void printSummary() const;
+		// one line per replayed frame: index, simulated time, frame time, camera drift
+		bool writeTiming(const std::string &fn) const;
+
+		bool recording() const { return !replay_mode && !fn.empty(); }
+		bool replaying() const { return replay_mode; }
+
+	private:
+		std::string fn;
+		bool replay_mode = false;
+		std::vector<Event> events;
+		double t0 = 0;
+		std::map<int, bool> keys;	// last logged or replayed state
+
+		// replay
+		double step_s = 1. / 60, clock = 0;
+		size_t next = 0, last_pose = 0;
+		std::vector<Event> due;
+		bool have_pose = false;
+
+		struct Frame
+		{
+			double t, frame_ms, drift;
+		};
+		std::vector<Frame> frames;
+		std::vector<double> gpu_ms;
+		double max_drift = 0, max_angle = 0, last_drift = 0, last_angle = 0;
+	};
+} }
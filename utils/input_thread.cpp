@@ -0,0 +1,106 @@
+/* Window input on the main thread, rendering on its own, camera handed over without locks.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <thread>
+#include "utils/input_thread.h"
+
+using namespace std;
+
+namespace kandao { namespace OpenGL
+{
+	InputLoop::InputLoop(GLFWwindow *window, const vector<int> &watched_keys, double max_wait_s)
+		: window(window), keys(watched_keys), max_wait_s(max_wait_s), pressed(0), taken(0)
+	{
+		CV_Assert(keys.size() <= 32);
+	}
+
+	void InputLoop::run(const function<void()> &render)
+	{
+		glfwGetFramebufferSize(window, &fb_width, &fb_height);
+		publish(true);
+
+		glfwMakeContextCurrent(NULL);
+		thread renderer([&]() {
+			glfwMakeContextCurrent(window);
+			render();
+			glfwMakeContextCurrent(NULL);
+			// the main thread may be blocked in glfwWaitEvents
+			glfwPostEmptyEvent();
+		});
+
+		while (!glfwWindowShouldClose(window)) {
+			// wakes up for every event; held keys move the camera at least every max_wait_s,
+			// otherwise it sleeps until the next event
+			if (inputAnimating(window)) {
+				glfwWaitEventsTimeout(max_wait_s);
+			}
+			else {
+				glfwWaitEvents();
+				resetFrameTime();
+			}
+			processInput(window);
+
+			unsigned bits = 0;
+			for (size_t i = 0; i < keys.size(); ++i) {
+				if (keyPressedOnce(window, keys[i]))
+					bits |= 1u << i;
+			}
+			if (bits)
+				pressed.fetch_or(bits);
+
+			int width, height;
+			glfwGetFramebufferSize(window, &width, &height);
+			bool resized = width != fb_width || height != fb_height;
+			fb_width = width;
+			fb_height = height;
+			publish(resized);
+		}
+
+		renderer.join();
+		glfwMakeContextCurrent(window);
+	}
+
+	void InputLoop::publish(bool force)
+	{
+		Camera &camera = getDefaultCamera();
+		double input_ms = takeInputTime();
+		if (!camera.ConsumeDirty() && !force)
+			return;
+
+		// input stays pending until a pose carrying it was taken, poses skipped in between do not lose it
+		unsigned done = taken.load();
+		while (!pending.empty() && (int)(pending.front().first - done) <= 0)
+			pending.pop_front();
+		++seq;
+		if (input_ms > 0)
+			pending.push_back(make_pair(seq, input_ms));
+
+		ViewPose &pose = poses.back();
+		pose.camera = camera;
+		pose.fb_width = fb_width;
+		pose.fb_height = fb_height;
+		pose.seq = seq;
+		pose.input_ms = pending.empty() ? 0 : pending.front().second;
+		poses.publish();
+	}
+
+	bool InputLoop::takePose(ViewPose &pose)
+	{
+		if (!poses.take())
+			return false;
+		pose = poses.front();
+		taken.store(pose.seq);
+		return true;
+	}
+
+	bool InputLoop::keyPressed(int key)
+	{
+		for (size_t i = 0; i < keys.size(); ++i) {
+			if (keys[i] == key) {
+				unsigned bit = 1u << i;
+				return (pressed.fetch_and(~bit) & bit) != 0;
+			}
+		}
+		return false;
+	}
+} }
@@ -0,0 +1,86 @@
+/* Window input on the main thread, rendering on its own, camera handed over without locks.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+#include "utils/utils.opengl.h"
+
+namespace kandao { namespace OpenGL
+{
+	// Single producer, single consumer handoff of the newest value. The writer fills back() and
+	// publishes it, the reader takes the newest published one into front(); neither ever waits
+	// and values published in between are skipped, not queued.
+	template<typename T>
+	class TripleBuffer
+	{
+	public:
+		T& back() { return slots[back_i]; }
+		void publish()
+		{
+			back_i = state.exchange(back_i | FRESH) & INDEX;
+		}
+
+		// true when something was published since the last take
+		bool take()
+		{
+			if (!(state.load() & FRESH))
+				return false;
+			front_i = state.exchange(front_i) & INDEX;
+			return true;
+		}
+		const T& front() const { return slots[front_i]; }
+
+	private:
+		static const int INDEX = 3, FRESH = 4;
+		T slots[3];
+		std::atomic<int> state{ 1 };	// index of the middle slot, FRESH once published
+		int back_i = 0, front_i = 2;
+	};
+
+	// Everything the renderer needs from the window for one frame.
+	struct ViewPose
+	{
+		Camera camera;
+		int fb_width = 0, fb_height = 0;
+		unsigned seq = 0;
+		double input_ms = 0;	// wall time of the oldest mouse or scroll event not in a taken pose, 0 none
+	};
+
+	// GLFW handles events on the main thread only, so that one keeps the window and input while
+	// the frames are drawn on a render thread holding the window's context. Input is handled as
+	// events arrive, not once per frame, and a new pose is published whenever the camera, the
+	// framebuffer or a watched key changed; a long frame no longer delays mouse look, and the
+	// renderer takes the newest pose just before drawing instead of the one from before the frame.
+	class InputLoop
+	{
+	public:
+		// keys the render loop asks with keyPressed
+		InputLoop(GLFWwindow *window, const std::vector<int> &watched_keys, double max_wait_s = 0.002);
+
+		// main thread, with the window's context current: starts render on a thread with the context,
+		// handles input until the window should close, then joins it and takes the context back
+		void run(const std::function<void()> &render);
+
+		///// render thread /////
+		// newest pose, false when nothing changed since the last take
+		bool takePose(ViewPose &pose);
+		// true once per press of a watched key
+		bool keyPressed(int key);
+
+	private:
+		void publish(bool force);
+
+		GLFWwindow *window;
+		std::vector<int> keys;
+		double max_wait_s;
+		TripleBuffer<ViewPose> poses;
+		std::atomic<unsigned> pressed;	// one bit per watched key
+		std::atomic<unsigned> taken;	// seq of the last pose the renderer took
+		std::deque<std::pair<unsigned, double> > pending;	// seq and time of input not taken yet
+		unsigned seq = 0;
+		int fb_width = 0, fb_height = 0;
+	};
+} }
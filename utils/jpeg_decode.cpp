@@ -0,0 +1,458 @@
+/* Multi-threaded JPEG decode over restart intervals, and lossless restart marker insertion.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifdef KANDAO_WITH_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+#include "utils/jpeg_decode.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	///////////////////////////////////// layout /////////////////////////////////////
+	static int readU16(const unsigned char *p)
+	{
+		return (p[0] << 8) | p[1];
+	}
+
+	// orientation tag of an APP1 Exif segment, 1 when there is none
+	static int readExifOrientation(const unsigned char *seg, size_t length)
+	{
+		if (length < 6 + 8 || memcmp(seg, "Exif\0\0", 6))
+			return 1;
+		const unsigned char *tiff = seg + 6;
+		size_t size = length - 6;
+		bool little = tiff[0] == 'I';
+		auto u16 = [&](size_t at) { return little ? tiff[at] | (tiff[at + 1] << 8) : (tiff[at] << 8) | tiff[at + 1]; };
+		auto u32 = [&](size_t at) { return little ? u16(at) | ((size_t)u16(at + 2) << 16) : ((size_t)u16(at) << 16) | u16(at + 2); };
+
+		size_t ifd = u32(4);
+		if (ifd > size - 2)
+			return 1;
+		int n_entries = u16(ifd);
+		for (int i = 0; i < n_entries && ifd + 2 + 12 * (i + 1) <= size; ++i) {
+			size_t entry = ifd + 2 + 12 * i;
+			if (u16(entry) == 0x0112)
+				return u16(entry + 8);
+		}
+		return 1;
+	}
+
+	bool parseJpegLayout(const unsigned char *data, size_t size, JpegLayout &layout)
+	{
+		layout = JpegLayout();
+		if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+			return false;
+
+		int n_components = 0, max_h = 1, max_v = 1;
+		bool supported = false;
+		size_t pos = 2;
+		while (true) {
+			// markers may be preceded by any number of fill bytes
+			while (pos < size && data[pos] == 0xFF && pos + 1 < size && data[pos + 1] == 0xFF)
+				++pos;
+			if (pos + 4 > size || data[pos] != 0xFF)
+				return false;
+			int marker = data[pos + 1];
+			if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+				pos += 2;
+				continue;
+			}
+			size_t length = readU16(data + pos + 2);
+			if (pos + 2 + length > size)
+				return false;
+			const unsigned char *seg = data + pos + 4;
+
+			if (marker == 0xC0 || marker == 0xC1) {
+				supported = true;
+				layout.sof_height = pos + 5;
+				layout.height = readU16(seg + 1);
+				layout.width = readU16(seg + 3);
+				n_components = seg[5];
+				for (int i = 0; i < n_components && 6 + 3 * i + 1 < (int)length; ++i) {
+					max_h = max(max_h, seg[6 + 3 * i + 1] >> 4);
+					max_v = max(max_v, seg[6 + 3 * i + 1] & 15);
+				}
+			}
+			else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+				// progressive, lossless or arithmetic coded: one decoder for the whole image
+				supported = false;
+			}
+			else if (marker == 0xE1) {
+				layout.orientation = readExifOrientation(seg, length - 2);
+			}
+			else if (marker == 0xDD) {
+				layout.restart_interval = readU16(seg);
+			}
+			else if (marker == 0xDA) {
+				// a scan over fewer components than the frame means more scans follow
+				if (seg[0] != n_components)
+					supported = false;
+				layout.header_end = pos + 2 + length;
+				break;
+			}
+			pos += 2 + length;
+		}
+		if (!layout.width || !layout.height)
+			return false;
+
+		// one component is never interleaved, its MCU is a single block
+		if (n_components > 1) {
+			layout.mcu_width = 8 * max_h;
+			layout.mcu_height = 8 * max_v;
+		}
+		layout.mcus_per_row = (layout.width + layout.mcu_width - 1) / layout.mcu_width;
+
+		// entropy-coded data: 0xFF00 is a stuffed byte, RSTn ends an interval, anything else ends the scan
+		layout.starts.push_back(layout.header_end);
+		pos = layout.header_end;
+		while (true) {
+			const unsigned char *p = (const unsigned char*)memchr(data + pos, 0xFF, size - pos);
+			if (!p || p + 1 >= data + size)
+				return false;
+			pos = p - data;
+			int next = p[1];
+			if (next == 0x00 || next == 0xFF) {
+				pos += next == 0x00 ? 2 : 1;
+				continue;
+			}
+			layout.ends.push_back(pos);
+			if (next >= 0xD0 && next <= 0xD7) {
+				pos += 2;
+				layout.starts.push_back(pos);
+				continue;
+			}
+			// EOI; another marker would start a second scan
+			if (next != 0xD9)
+				supported = false;
+			break;
+		}
+
+		layout.sequential = supported && layout.restart_interval > 0;
+		if (layout.sequential) {
+			for (int i = 0; i < (int)layout.starts.size(); ++i) {
+				if ((long long)i * layout.restart_interval % layout.mcus_per_row == 0)
+					layout.row_starts.push_back(i);
+			}
+		}
+		return true;
+	}
+
+	static bool readFile(const std::string &fn, std::vector<unsigned char> &data)
+	{
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (!fp)
+			return false;
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		data.resize(max(size, 0L));
+		bool ok = size > 0 && fread(data.data(), 1, data.size(), fp) == data.size();
+		fclose(fp);
+		return ok;
+	}
+
+#ifdef KANDAO_WITH_LIBJPEG
+	///////////////////////////////////// decode /////////////////////////////////////
+	struct JpegDecodeError
+	{
+		jpeg_error_mgr mgr;
+		jmp_buf jump;
+	};
+
+	static void decodeErrorExit(j_common_ptr cinfo)
+	{
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, message);
+		printf("[jpeg] libjpeg: %s\n", message);
+		longjmp(((JpegDecodeError*)cinfo->err)->jump, 1);
+	}
+
+	// a complete JPEG stream whose row y0 - skip lands on image row y0; only rows [y0, y1) are
+	// written, the others are decoded as context for the neighbours and dropped
+	static bool decodeStream(const unsigned char *data, size_t size, cv::Mat &image, int y0, int y1, int skip)
+	{
+		// longjmp must not skip a destructor, so nothing non-trivial is created after setjmp
+		vector<unsigned char> scratch(image.cols * 3);
+		jpeg_decompress_struct cinfo;
+		JpegDecodeError err;
+		cinfo.err = jpeg_std_error(&err.mgr);
+		err.mgr.error_exit = decodeErrorExit;
+		jpeg_create_decompress(&cinfo);
+		if (setjmp(err.jump)) {
+			jpeg_destroy_decompress(&cinfo);
+			return false;
+		}
+
+		jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+		jpeg_read_header(&cinfo, TRUE);
+#ifdef JCS_EXTENSIONS
+		cinfo.out_color_space = JCS_EXT_BGR;
+#else
+		cinfo.out_color_space = JCS_RGB;
+#endif
+		jpeg_start_decompress(&cinfo);
+		bool fits = (int)cinfo.output_width == image.cols && y1 <= image.rows && cinfo.output_components == 3 &&
+			skip + y1 - y0 <= (int)cinfo.output_height;
+		if (fits) {
+			int last = skip + y1 - y0;
+			while ((int)cinfo.output_scanline < last) {
+				int y = cinfo.output_scanline;
+				JSAMPROW row = y < skip ? scratch.data() : image.ptr(y0 + y - skip);
+				jpeg_read_scanlines(&cinfo, &row, 1);
+			}
+			// trailing context rows are never read
+			jpeg_abort_decompress(&cinfo);
+		}
+		jpeg_destroy_decompress(&cinfo);
+#ifndef JCS_EXTENSIONS
+		if (fits) {
+			Mat rows = image.rowRange(y0, y1);
+			cvtColor(rows, rows, COLOR_RGB2BGR);
+		}
+#endif
+		return fits;
+	}
+
+	// headers with the frame height of the chunk, its intervals with the restart markers
+	// renumbered from RST0 as a decoder expects after SOS, then EOI
+	static void buildChunk(const unsigned char *data, const JpegLayout &layout, int first, int last, int rows,
+		std::vector<unsigned char> &chunk)
+	{
+		size_t bytes = layout.header_end + 2;
+		for (int i = first; i < last; ++i)
+			bytes += layout.ends[i] - layout.starts[i] + 2;
+		chunk.resize(bytes);
+
+		unsigned char *out = chunk.data();
+		memcpy(out, data, layout.header_end);
+		out[layout.sof_height] = (unsigned char)(rows >> 8);
+		out[layout.sof_height + 1] = (unsigned char)rows;
+		out += layout.header_end;
+		for (int i = first; i < last; ++i) {
+			size_t n = layout.ends[i] - layout.starts[i];
+			memcpy(out, data + layout.starts[i], n);
+			out += n;
+			if (i + 1 < last) {
+				*out++ = 0xFF;
+				*out++ = (unsigned char)(0xD0 + (i - first) % 8);
+			}
+		}
+		*out++ = 0xFF;
+		*out++ = 0xD9;
+		chunk.resize(out - chunk.data());
+	}
+
+	static bool decodeParallel(const std::vector<unsigned char> &data, const JpegLayout &layout, cv::Mat &image,
+		int n_threads, JpegDecodeStats &stats)
+	{
+		// two chunks per thread even out segments that compress differently,
+		// cut at evenly spaced row starts
+		const vector<int> &cuts = layout.row_starts;
+		int n_cuts = (int)cuts.size(), n_intervals = (int)layout.starts.size();
+		int n_chunks = min(n_cuts, n_threads * 2);
+		vector<int> first(n_chunks + 1);
+		for (int c = 0; c <= n_chunks; ++c)
+			first[c] = c * n_cuts / n_chunks;
+		auto cut = [&](int k) { return k < n_cuts ? cuts[max(k, 0)] : n_intervals; };
+
+		auto rowOf = [&](int interval) {
+			if (interval >= n_intervals)
+				return layout.height;
+			long long mcu_row = (long long)interval * layout.restart_interval / layout.mcus_per_row;
+			return (int)min<long long>(mcu_row * layout.mcu_height, layout.height);
+		};
+
+		atomic<int> next(0);
+		atomic<bool> ok(true);
+		auto work = [&]() {
+			vector<unsigned char> chunk;
+			for (int c = next++; c < n_chunks && ok; c = next++) {
+				// fancy chroma upsampling reads a chroma row across the cut, so one interval
+				// run above and below is decoded along and dropped; the seams are then exact
+				int begin = cut(first[c] - 1), end = cut(first[c + 1] + 1);
+				int y0 = rowOf(cut(first[c])), y1 = rowOf(cut(first[c + 1]));
+				int top = rowOf(begin), rows = rowOf(end) - top;
+				buildChunk(data.data(), layout, begin, end, rows, chunk);
+				if (!decodeStream(chunk.data(), chunk.size(), image, y0, y1, y0 - top))
+					ok = false;
+			}
+		};
+
+		vector<thread> threads;
+		for (int i = 1; i < min(n_threads, n_chunks); ++i)
+			threads.push_back(thread(work));
+		work();
+		for (auto &t : threads)
+			t.join();
+
+		stats.n_threads = min(n_threads, n_chunks);
+		stats.n_chunks = n_chunks;
+		return ok;
+	}
+
+	bool decodeJpeg(const std::string &fn, cv::Mat &image, int n_threads, JpegDecodeStats *out_stats)
+	{
+		JpegDecodeStats stats;
+		double t = wallTimeMs();
+		vector<unsigned char> data;
+		JpegLayout layout;
+		if (!readFile(fn, data) || !parseJpegLayout(data.data(), data.size(), layout) || layout.orientation != 1) {
+			// not a JPEG we can parse, OpenCV knows more formats; it also applies the EXIF rotation
+			image = imread(fn);
+			return !image.empty();
+		}
+		stats.read_ms = wallTimeMs() - t;
+
+		t = wallTimeMs();
+		image.create(layout.height, layout.width, CV_8UC3);
+		if (n_threads <= 0)
+			n_threads = max(1, (int)thread::hardware_concurrency());
+		bool ok;
+		stats.parallel = layout.splittable() && n_threads > 1;
+		if (stats.parallel) {
+			ok = decodeParallel(data, layout, image, n_threads, stats);
+		}
+		else {
+			stats.n_threads = stats.n_chunks = 1;
+			ok = decodeStream(data.data(), data.size(), image, 0, image.rows, 0);
+		}
+		if (!ok) {
+			// color spaces the BGR output cannot take, e.g. CMYK or YCCK
+			printf("[jpeg] %s did not decode, falling back to imread\n", fn.c_str());
+			image = imread(fn);
+			ok = !image.empty();
+		}
+		stats.decode_ms = wallTimeMs() - t;
+		if (out_stats)
+			*out_stats = stats;
+		return ok;
+	}
+
+	///////////////////////////////////// restarts /////////////////////////////////////
+	bool addJpegRestarts(const std::string &in_fn, const std::string &out_fn, int restart_rows)
+	{
+		FILE *in = fopen(in_fn.c_str(), "rb");
+		if (!in) {
+			printf("[jpeg] cannot read %s\n", in_fn.c_str());
+			return false;
+		}
+		FILE *out = fopen(out_fn.c_str(), "wb");
+		if (!out) {
+			printf("[jpeg] cannot write %s\n", out_fn.c_str());
+			fclose(in);
+			return false;
+		}
+
+		jpeg_decompress_struct src;
+		jpeg_compress_struct dst;
+		JpegDecodeError err;
+		// one error manager for both, either side failing lands here
+		src.err = dst.err = jpeg_std_error(&err.mgr);
+		err.mgr.error_exit = decodeErrorExit;
+		jpeg_create_decompress(&src);
+		jpeg_create_compress(&dst);
+		bool ok = false;
+		if (!setjmp(err.jump)) {
+			jpeg_stdio_src(&src, in);
+			// markers such as EXIF travel along
+			jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+			for (int m = 0; m < 16; ++m)
+				jpeg_save_markers(&src, JPEG_APP0 + m, 0xFFFF);
+			jpeg_read_header(&src, TRUE);
+			jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&src);
+
+			jpeg_copy_critical_parameters(&src, &dst);
+			dst.restart_in_rows = restart_rows;
+			dst.optimize_coding = TRUE;
+			jpeg_stdio_dest(&dst, out);
+			jpeg_write_coefficients(&dst, coefficients);
+			for (jpeg_saved_marker_ptr m = src.marker_list; m; m = m->next) {
+				// JFIF is written by the library already
+				if (m->marker == JPEG_APP0 && dst.write_JFIF_header)
+					continue;
+				jpeg_write_marker(&dst, m->marker, m->data, m->data_length);
+			}
+			jpeg_finish_compress(&dst);
+			jpeg_finish_decompress(&src);
+			ok = true;
+		}
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		fclose(in);
+		fclose(out);
+		if (!ok)
+			remove(out_fn.c_str());
+		return ok;
+	}
+#else
+	bool decodeJpeg(const std::string &fn, cv::Mat &image, int, JpegDecodeStats *stats)
+	{
+		if (stats)
+			*stats = JpegDecodeStats();
+		image = imread(fn);
+		return !image.empty();
+	}
+
+	bool addJpegRestarts(const std::string &, const std::string &, int)
+	{
+		printf("[jpeg] adding restart markers needs a build with KANDAO_WITH_LIBJPEG\n");
+		return false;
+	}
+#endif
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	void benchmarkJpegDecode(const std::string &fn, int max_threads, int n_runs)
+	{
+		vector<unsigned char> data;
+		JpegLayout layout;
+		if (!readFile(fn, data) || !parseJpegLayout(data.data(), data.size(), layout)) {
+			printf("[jpeg] %s is not a JPEG\n", fn.c_str());
+			return;
+		}
+		printf("[jpeg] %s: %dx%d, %dx%d MCUs, restart interval %d MCUs, %d intervals, %d start an MCU row\n",
+			fn.c_str(), layout.width, layout.height, layout.mcu_width, layout.mcu_height, layout.restart_interval,
+			(int)layout.starts.size(), (int)layout.row_starts.size());
+		if (!layout.splittable())
+			printf("[jpeg] no restart intervals on MCU rows, every run decodes on one thread\n");
+
+		if (max_threads <= 0)
+			max_threads = max(1, (int)thread::hardware_concurrency());
+		Mat reference;
+		double base_ms = 0;
+		for (int n = 1; ; n = min(n * 2, max_threads)) {
+			double ms = 0;
+			bool same = true;
+			Mat image;
+			JpegDecodeStats stats;
+			for (int i = 0; i < n_runs; ++i) {
+				image.release();
+				double t = wallTimeMs();
+				if (!decodeJpeg(fn, image, n, &stats))
+					return;
+				ms += wallTimeMs() - t;
+			}
+			ms /= n_runs;
+			if (reference.empty()) {
+				reference = image;
+				base_ms = ms;
+			}
+			else {
+				same = norm(image, reference, NORM_INF) == 0;
+			}
+			printf("[jpeg] %2d threads: %8.2f ms (decode %.2f), %.2fx, %d chunks%s\n", stats.n_threads, ms,
+				stats.decode_ms, base_ms / ms, stats.n_chunks, same ? "" : ", DIFFERS from one thread");
+			if (n >= max_threads)
+				break;
+		}
+	}
+}
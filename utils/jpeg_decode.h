@@ -0,0 +1,53 @@
+/* Multi-threaded JPEG decode over restart intervals, and lossless restart marker insertion.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+namespace kandao
+{
+	// Where a baseline JPEG can be cut. A restart marker resets the entropy decoder and the DC
+	// predictors, so a run of restart intervals that begins at the start of an MCU row decodes on
+	// its own once it is given the original headers with the frame height patched to its rows.
+	struct JpegLayout
+	{
+		int width = 0, height = 0;
+		int mcu_width = 8, mcu_height = 8, mcus_per_row = 0;
+		int restart_interval = 0;			// MCUs per interval, 0 without DRI
+		size_t header_end = 0;				// first entropy-coded byte after SOS
+		size_t sof_height = 0;				// offset of the 16-bit frame height
+		std::vector<size_t> starts, ends;	// entropy bytes of every interval, markers excluded
+		std::vector<int> row_starts;		// interval indices that begin an MCU row
+		bool sequential = false;			// baseline or extended Huffman, one interleaved scan
+		int orientation = 1;				// EXIF orientation, 1 when absent
+
+		// enough independent pieces for more than one thread
+		bool splittable() const { return sequential && row_starts.size() > 1; }
+	};
+
+	bool parseJpegLayout(const unsigned char *data, size_t size, JpegLayout &layout);
+
+	struct JpegDecodeStats
+	{
+		int n_threads = 0, n_chunks = 0;
+		bool parallel = false;
+		double read_ms = 0, decode_ms = 0;
+	};
+
+	// Decode into image as CV_8UC3 BGR, the rows of a top-bottom input are then ready for their
+	// rowRange views. Restart intervals aligned to MCU rows are decoded on n_threads threads
+	// (0: one per CPU) straight into their rows; anything else is decoded on one thread. Needs
+	// KANDAO_WITH_LIBJPEG, otherwise this is imread; so is any file with an EXIF rotation or a color
+	// space that does not decode to BGR (CMYK, YCCK).
+	bool decodeJpeg(const std::string &fn, cv::Mat &image, int n_threads = 0, JpegDecodeStats *stats = NULL);
+
+	// Lossless: the DCT coefficients are copied, only restart markers every restart_rows MCU rows
+	// are added, e.g. with jpegtran -restart. Returns false without libjpeg.
+	bool addJpegRestarts(const std::string &in_fn, const std::string &out_fn, int restart_rows = 1);
+
+	// decode time of fn on 1, 2, 4, ... up to max_threads threads against one decode, and whether
+	// every run matches the single-threaded pixels
+	void benchmarkJpegDecode(const std::string &fn, int max_threads = 0, int n_runs = 3);
+}
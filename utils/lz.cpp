@@ -0,0 +1,174 @@
+/* Byte-oriented LZ compression in the LZ4 block format, no external dependency.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cstring>
+#include <vector>
+#include "utils/lz.h"
+
+using namespace std;
+
+namespace kandao { namespace lz
+{
+	// block format limits: a match needs 4 bytes, the last 5 bytes are always literals and
+	// no match may start within the last 12 bytes
+	static const size_t MIN_MATCH = 4;
+	static const size_t LAST_LITERALS = 5;
+	static const size_t MF_LIMIT = 12;
+	static const size_t MAX_OFFSET = 65535;
+	static const int HASH_BITS = 16;
+
+	static inline unsigned int read32(const unsigned char *p)
+	{
+		unsigned int v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	static inline unsigned int hash4(unsigned int v)
+	{
+		return (v * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	// lengths of 15 and more continue in 255-valued bytes
+	static inline unsigned char* writeLength(unsigned char *op, size_t len)
+	{
+		for (; len >= 255; len -= 255)
+			*op++ = 255;
+		*op++ = (unsigned char)len;
+		return op;
+	}
+
+	size_t compressBound(size_t n)
+	{
+		return n + n / 255 + 16;
+	}
+
+	size_t compress(const unsigned char *src, size_t n, unsigned char *dst, size_t capacity)
+	{
+		if (capacity < compressBound(n))
+			return 0;
+
+		vector<unsigned int> table(1 << HASH_BITS, 0);
+		const unsigned char *ip = src, *anchor = src, *end = src + n;
+		const unsigned char *match_limit = n > MF_LIMIT ? end - MF_LIMIT : src;
+		unsigned char *op = dst;
+
+		while (ip < match_limit) {
+			unsigned int h = hash4(read32(ip));
+			const unsigned char *ref = src + table[h];
+			table[h] = (unsigned int)(ip - src);
+			if (ref >= ip || ip - ref > (ptrdiff_t)MAX_OFFSET || read32(ref) != read32(ip)) {
+				++ip;
+				continue;
+			}
+
+			// extend backwards over pending literals, then forwards up to the literal tail
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			const unsigned char *mp = ip + MIN_MATCH, *mr = ref + MIN_MATCH;
+			const unsigned char *match_end = end - LAST_LITERALS;
+			while (mp < match_end && *mp == *mr) {
+				++mp;
+				++mr;
+			}
+
+			size_t literals = ip - anchor, match = (mp - ip) - MIN_MATCH;
+			unsigned char *token = op++;
+			*token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+			if (literals >= 15)
+				op = writeLength(op, literals - 15);
+			memcpy(op, anchor, literals);
+			op += literals;
+
+			size_t offset = ip - ref;
+			*op++ = (unsigned char)(offset & 0xFF);
+			*op++ = (unsigned char)(offset >> 8);
+			*token |= (unsigned char)(match >= 15 ? 15 : match);
+			if (match >= 15)
+				op = writeLength(op, match - 15);
+
+			ip = anchor = mp;
+		}
+
+		// trailing literals
+		size_t literals = end - anchor;
+		*op++ = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+		if (literals >= 15)
+			op = writeLength(op, literals - 15);
+		memcpy(op, anchor, literals);
+		op += literals;
+		return op - dst;
+	}
+
+	bool decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t raw_size)
+	{
+		const unsigned char *ip = src, *ip_end = src + n;
+		unsigned char *op = dst, *op_end = dst + raw_size;
+
+		while (ip < ip_end) {
+			unsigned int token = *ip++;
+
+			size_t literals = token >> 4;
+			if (literals == 15) {
+				unsigned char b;
+				do {
+					if (ip >= ip_end)
+						return false;
+					b = *ip++;
+					literals += b;
+				} while (b == 255);
+			}
+			if ((size_t)(ip_end - ip) < literals || (size_t)(op_end - op) < literals)
+				return false;
+			// short runs copy a fixed 16 bytes when both buffers have the slack, it is what most tokens carry
+			if (literals <= 16 && ip_end - ip >= 16 && op_end - op >= 16)
+				memcpy(op, ip, 16);
+			else
+				memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+
+			// the last sequence has no match
+			if (ip == ip_end)
+				break;
+
+			if (ip_end - ip < 2)
+				return false;
+			size_t offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			if (offset == 0 || offset > (size_t)(op - dst))
+				return false;
+
+			size_t match = token & 15;
+			if (match == 15) {
+				unsigned char b;
+				do {
+					if (ip >= ip_end)
+						return false;
+					b = *ip++;
+					match += b;
+				} while (b == 255);
+			}
+			match += MIN_MATCH;
+			if ((size_t)(op_end - op) < match)
+				return false;
+
+			// byte by byte only when source and destination overlap, i.e. repeating patterns
+			const unsigned char *ref = op - offset;
+			if (offset >= 16 && match <= 16 && op_end - op >= 16) {
+				memcpy(op, ref, 16);
+			}
+			else if (offset >= match) {
+				memcpy(op, ref, match);
+			}
+			else {
+				for (size_t i = 0; i < match; ++i)
+					op[i] = ref[i];
+			}
+			op += match;
+		}
+		return op == op_end;
+	}
+} }
@@ -0,0 +1,15 @@
+/* Byte-oriented LZ compression in the LZ4 block format, no external dependency.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <cstddef>
+
+namespace kandao { namespace lz
+{
+	// worst case compressed size of n bytes
+	size_t compressBound(size_t n);
+	// greedy single pass with a 4-byte hash table, returns the compressed size or 0 if dst is too small
+	size_t compress(const unsigned char *src, size_t n, unsigned char *dst, size_t capacity);
+	// false on malformed input or when the output is not exactly raw_size bytes
+	bool decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t raw_size);
+} }
@@ -0,0 +1,250 @@
+/* Memory accounting: GL objects by label and CPU allocations by pipeline stage.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include <cstdio>
+#include <unordered_map>
+#include "opencv2/opencv.hpp"
+#include "utils/memory.h"
+#include "utils/timer.h"
+
+using namespace std;
+
+namespace kandao
+{
+	static const char *kind_names[N_GPU_RESOURCE_KINDS] = { "texture", "buffer", "renderbuffer" };
+
+	static double toMB(size_t bytes)
+	{
+		return bytes / 1048576.;
+	}
+
+	///////////////////////////////////// MemoryTracker /////////////////////////////////////
+	MemoryTracker& MemoryTracker::instance()
+	{
+		// never destroyed, Mats may still be released during static destruction
+		static MemoryTracker *tracker = new MemoryTracker();
+		return *tracker;
+	}
+
+	void MemoryTracker::add(Totals &totals, long long bytes, int n)
+	{
+		// a release of something counted before tracking started must not wrap around
+		totals.current = bytes < 0 && (size_t)-bytes > totals.current ? 0 : totals.current + bytes;
+		totals.peak = max(totals.peak, totals.current);
+		totals.n_live += n;
+	}
+
+	void MemoryTracker::addGpu(GpuResourceKind kind, unsigned int name, const std::string &label,
+		const std::string &format, size_t bytes)
+	{
+		if (!name)
+			return;
+		lock_guard<mutex> lock(mtx);
+		auto key = make_pair((int)kind, name);
+		auto it = resources.find(key);
+		if (it != resources.end()) {
+			add(gpu_totals, -(long long)it->second.bytes, -1);
+			add(kind_totals[kind], -(long long)it->second.bytes, -1);
+		}
+		Resource &r = resources[key];
+		r.kind = kind;
+		r.name = name;
+		r.label = label;
+		r.format = format;
+		r.bytes = bytes;
+		add(gpu_totals, bytes, 1);
+		add(kind_totals[kind], bytes, 1);
+	}
+
+	void MemoryTracker::relabelGpu(GpuResourceKind kind, unsigned int name, const std::string &label)
+	{
+		lock_guard<mutex> lock(mtx);
+		auto it = resources.find(make_pair((int)kind, name));
+		if (it != resources.end())
+			it->second.label = label;
+	}
+
+	void MemoryTracker::removeGpu(GpuResourceKind kind, unsigned int name)
+	{
+		lock_guard<mutex> lock(mtx);
+		auto it = resources.find(make_pair((int)kind, name));
+		if (it == resources.end())
+			return;
+		add(gpu_totals, -(long long)it->second.bytes, -1);
+		add(kind_totals[kind], -(long long)it->second.bytes, -1);
+		resources.erase(it);
+	}
+
+	void MemoryTracker::addCpu(const char *stage, long long bytes)
+	{
+		lock_guard<mutex> lock(mtx);
+		int n = bytes > 0 ? 1 : bytes < 0 ? -1 : 0;
+		add(stages[stage ? stage : "other"], bytes, n);
+		add(cpu_totals, bytes, n);
+	}
+
+	MemoryTracker::Totals MemoryTracker::gpu() const
+	{
+		lock_guard<mutex> lock(mtx);
+		return gpu_totals;
+	}
+
+	MemoryTracker::Totals MemoryTracker::gpu(GpuResourceKind kind) const
+	{
+		lock_guard<mutex> lock(mtx);
+		return kind_totals[kind];
+	}
+
+	MemoryTracker::Totals MemoryTracker::cpu() const
+	{
+		lock_guard<mutex> lock(mtx);
+		return cpu_totals;
+	}
+
+	std::map<std::string, MemoryTracker::Totals> MemoryTracker::cpuStages() const
+	{
+		lock_guard<mutex> lock(mtx);
+		return stages;
+	}
+
+	std::vector<MemoryTracker::Resource> MemoryTracker::gpuResources() const
+	{
+		vector<Resource> list;
+		{
+			lock_guard<mutex> lock(mtx);
+			for (auto &kv : resources)
+				list.push_back(kv.second);
+		}
+		stable_sort(list.begin(), list.end(), [](const Resource &a, const Resource &b) { return a.bytes > b.bytes; });
+		return list;
+	}
+
+	bool MemoryTracker::report(double interval_ms)
+	{
+		double now = wallTimeMs();
+		Totals g, c, k[N_GPU_RESOURCE_KINDS];
+		{
+			lock_guard<mutex> lock(mtx);
+			if (last_report >= 0 && now - last_report < interval_ms)
+				return false;
+			if (gpu_totals.current == reported_gpu && cpu_totals.current == reported_cpu)
+				return false;
+			last_report = now;
+			reported_gpu = gpu_totals.current;
+			reported_cpu = cpu_totals.current;
+			g = gpu_totals;
+			c = cpu_totals;
+			copy(kind_totals, kind_totals + N_GPU_RESOURCE_KINDS, k);
+		}
+		printf("[memory] gpu %.1f MB (peak %.1f) in %d objects: textures %.1f, buffers %.1f, renderbuffers %.1f; "
+			"cpu %.1f MB (peak %.1f)\n", toMB(g.current), toMB(g.peak), g.n_live, toMB(k[GPU_TEXTURE].current),
+			toMB(k[GPU_BUFFER].current), toMB(k[GPU_RENDERBUFFER].current), toMB(c.current), toMB(c.peak));
+		return true;
+	}
+
+	void MemoryTracker::printResources() const
+	{
+		vector<Resource> list = gpuResources();
+		Totals g = gpu(), c = cpu();
+		printf("[memory] %d GL objects, %.1f MB (peak %.1f):\n", (int)list.size(), toMB(g.current), toMB(g.peak));
+		for (const Resource &r : list)
+			printf("[memory]   %-12s %5u %-24s %-20s %8.2f MB\n", kind_names[r.kind], r.name, r.label.c_str(),
+				r.format.c_str(), toMB(r.bytes));
+
+		printf("[memory] cpu %.1f MB (peak %.1f) by stage:\n", toMB(c.current), toMB(c.peak));
+		for (auto &kv : cpuStages())
+			printf("[memory]   %-24s %8.2f MB in %3d allocations, peak %8.2f MB\n", kv.first.c_str(),
+				toMB(kv.second.current), kv.second.n_live, toMB(kv.second.peak));
+	}
+
+	int MemoryTracker::printLeaks() const
+	{
+		vector<Resource> list = gpuResources();
+		for (const Resource &r : list)
+			printf("[memory] leaked %s %u \"%s\", %.2f MB\n", kind_names[r.kind], r.name, r.label.c_str(), toMB(r.bytes));
+		return (int)list.size();
+	}
+
+	///////////////////////////////////// CPU stages /////////////////////////////////////
+	static thread_local const char *current_stage = NULL;
+
+	MemoryStage::MemoryStage(const char *name)
+		: prev(current_stage)
+	{
+		current_stage = name;
+	}
+
+	MemoryStage::~MemoryStage()
+	{
+		current_stage = prev;
+	}
+
+	const char* MemoryStage::current()
+	{
+		return current_stage;
+	}
+
+	// forwards to the standard allocator; buffers it hands out are re-owned so that their release
+	// comes back here, and remember the stage they were counted under
+	class TrackingMatAllocator : public cv::MatAllocator
+	{
+	public:
+		TrackingMatAllocator() : std_allocator(cv::Mat::getStdAllocator()) {}
+
+		cv::UMatData* allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags,
+			cv::UMatUsageFlags usage) const
+		{
+			cv::UMatData *u = std_allocator->allocate(dims, sizes, type, data, step, flags, usage);
+			// user data is owned elsewhere
+			if (!u || data)
+				return u;
+			u->currAllocator = this;
+
+			const char *stage = MemoryStage::current();
+			{
+				lock_guard<mutex> lock(mtx);
+				live[u] = stage;
+			}
+			MemoryTracker::instance().addCpu(stage, (long long)u->size);
+			return u;
+		}
+
+		bool allocate(cv::UMatData *u, int access, cv::UMatUsageFlags usage) const
+		{
+			return std_allocator->allocate(u, access, usage);
+		}
+
+		void deallocate(cv::UMatData *u) const
+		{
+			if (!u)
+				return;
+			const char *stage = NULL;
+			bool counted = false;
+			{
+				lock_guard<mutex> lock(mtx);
+				auto it = live.find(u);
+				if (it != live.end()) {
+					stage = it->second;
+					counted = true;
+					live.erase(it);
+				}
+			}
+			if (counted)
+				MemoryTracker::instance().addCpu(stage, -(long long)u->size);
+			u->currAllocator = std_allocator;
+			std_allocator->deallocate(u);
+		}
+
+	private:
+		cv::MatAllocator *std_allocator;
+		mutable std::mutex mtx;
+		mutable std::unordered_map<const cv::UMatData*, const char*> live;
+	};
+
+	void trackMatAllocations()
+	{
+		static TrackingMatAllocator *allocator = new TrackingMatAllocator();
+		cv::Mat::setDefaultAllocator(allocator);
+	}
+}
@@ -0,0 +1,97 @@
+/* Memory accounting: GL objects by label and CPU allocations by pipeline stage.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kandao
+{
+	enum GpuResourceKind
+	{
+		GPU_TEXTURE,
+		GPU_BUFFER,
+		GPU_RENDERBUFFER,
+		N_GPU_RESOURCE_KINDS,
+	};
+
+	// Process-wide and thread-safe. GL objects are registered by kind and name with a label,
+	// format and the size of their storage as requested (drivers may pad); CPU bytes are summed
+	// per pipeline stage. The GL side is registered through OpenGL::track*, the CPU side
+	// through MemoryStage scopes and addCpu.
+	class MemoryTracker
+	{
+	public:
+		struct Resource
+		{
+			GpuResourceKind kind;
+			unsigned int name;
+			std::string label, format;
+			size_t bytes;
+		};
+
+		struct Totals
+		{
+			size_t current = 0, peak = 0;
+			int n_live = 0;
+		};
+
+		static MemoryTracker& instance();
+
+		///// GPU /////
+		// registering a name again replaces the old entry, e.g. after reallocating its storage
+		void addGpu(GpuResourceKind kind, unsigned int name, const std::string &label, const std::string &format,
+			size_t bytes);
+		void relabelGpu(GpuResourceKind kind, unsigned int name, const std::string &label);
+		void removeGpu(GpuResourceKind kind, unsigned int name);
+
+		///// CPU /////
+		// bytes < 0 when released
+		void addCpu(const char *stage, long long bytes);
+
+		///// queries /////
+		Totals gpu() const;
+		Totals gpu(GpuResourceKind kind) const;
+		Totals cpu() const;
+		std::map<std::string, Totals> cpuStages() const;
+		// live GL objects, largest first
+		std::vector<Resource> gpuResources() const;
+
+		// one line of current / peak totals, at most every interval_ms and only after a change
+		bool report(double interval_ms);
+		// every live GL object and every CPU stage
+		void printResources() const;
+		// GL objects still registered, e.g. after teardown; returns their count
+		int printLeaks() const;
+
+	private:
+		MemoryTracker() {}
+		void add(Totals &totals, long long bytes, int n);
+
+		mutable std::mutex mtx;
+		std::map<std::pair<int, unsigned int>, Resource> resources;
+		Totals gpu_totals, kind_totals[N_GPU_RESOURCE_KINDS], cpu_totals;
+		std::map<std::string, Totals> stages;
+		double last_report = -1;
+		size_t reported_gpu = 0, reported_cpu = 0;
+	};
+
+	// cv::Mat buffers allocated by the calling thread inside the scope count towards this stage;
+	// scopes nest, the name must outlive every Mat allocated under it (use literals)
+	class MemoryStage
+	{
+	public:
+		explicit MemoryStage(const char *name);
+		~MemoryStage();
+		static const char* current();
+
+	private:
+		const char *prev;
+	};
+
+	// wrap OpenCV's default allocator so every cv::Mat buffer is counted under its MemoryStage,
+	// "other" outside of any; call once at startup, Mats allocated before are not counted
+	void trackMatAllocations();
+}
@@ -0,0 +1,338 @@
+/* Mesh generation for panorama with depth, CPU side only.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/mesh.h"
+#include "utils/projection.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao { namespace mesh
+{
+	///////////////////////////////////// equirectangular /////////////////////////////////////
+	// nearest depth row of source y, in full panorama coordinates
+	static int sampleRow(float y, int full_rows)
+	{
+		int yy = round(y - 0.5);
+		return min(max(yy, 0), full_rows - 1);
+	}
+
+	static float sampleDepth(const DepthStrip &strip, float x, float y)
+	{
+		int width = strip.depth.cols;
+		int xx = round(x - 0.5);
+		xx = (xx + width) % width;
+		int yy = sampleRow(y, strip.full_rows) - strip.y0;
+		CV_Assert(yy >= 0 && yy < strip.depth.rows);
+		return strip.depth.ptr<float>(yy)[xx];
+	}
+
+	static void makeQuadrangleEqui(const DepthStrip &strip, float x, float y, float w, float h,
+		std::vector<cv::Vec3f> &quad_3d, std::vector<cv::Vec2f> &quad_2d)
+	{
+		int width = strip.depth.cols, height = strip.full_rows;
+		quad_3d.resize(4);
+		quad_2d.resize(4);
+
+		// 4 vertex points on source
+		vector<Vec2f> src_xy = {
+			Vec2f(x, y),
+			Vec2f(x + w, y),
+			Vec2f(x + w, y + h),
+			Vec2f(x, y + h),
+		};
+
+		// 4 corresponding 3d points
+		for (int i = 0; i < 4; ++i) {
+			// vertex on texture
+			quad_2d[i][0] = src_xy[i][0] / width;
+			quad_2d[i][1] = src_xy[i][1] / height;
+
+			// to discrete coordinates on frame
+			float d = sampleDepth(strip, src_xy[i][0], src_xy[i][1]);
+
+			// to opengl coordinates
+			float dir[3];
+			EquirectProjection::direction(ProjectionFace(), quad_2d[i][0], src_xy[i][1] / height, dir);
+			quad_3d[i][0] = dir[0] * d;
+			quad_3d[i][1] = dir[1] * d;
+			quad_3d[i][2] = dir[2] * d;
+		}
+	}
+
+	// single vertex at source pixel (x, y): nearest depth along the equirectangular ray
+	static void unprojectEqui(const DepthStrip &strip, float x, float y, float d, float *vertex)
+	{
+		vertex[3] = x / strip.depth.cols;
+		vertex[4] = y / strip.full_rows;
+		float dir[3];
+		EquirectProjection::direction(ProjectionFace(), vertex[3], vertex[4], dir);
+		vertex[0] = dir[0] * d;
+		vertex[1] = dir[1] * d;
+		vertex[2] = dir[2] * d;
+	}
+
+	///////////////////////////////////// discontinuities /////////////////////////////////////
+	// corner depths further apart than a factor of cull_ratio, also for zero or negative depth
+	static bool stretched(float d0, float d1, float d2, float cull_ratio)
+	{
+		if (cull_ratio <= 0)
+			return false;
+		float lo = min(d0, min(d1, d2)), hi = max(d0, max(d1, d2));
+		return !(hi <= lo * cull_ratio);
+	}
+
+	// triangle a, b, c, or a degenerate one in its place across a depth edge
+	static void emitTriangle(unsigned int *&indices, unsigned int a, unsigned int b, unsigned int c,
+		bool culled, size_t &n_culled)
+	{
+		if (culled) {
+			b = c = a;
+			++n_culled;
+		}
+		*indices++ = a;
+		*indices++ = b;
+		*indices++ = c;
+	}
+
+	///////////////////////////////////// grid /////////////////////////////////////
+	static size_t buildGridRows(const DepthStrip &strip, int n_cols, int n_rows, int row_begin, int row_end,
+		float *vertices, unsigned int *indices, float cull_ratio)
+	{
+		float width = strip.depth.cols, height = strip.full_rows;
+		float w = width / (n_cols - 1), h = height / (n_rows - 1);
+
+		vector<Vec3f> quad_3d;
+		vector<Vec2f> quad_2d;
+		float d[4];
+		size_t n_culled = 0;
+		unsigned int k = row_begin * (n_cols - 1) * 4;
+		for (int i = row_begin; i < row_end; ++i) {
+			for (int j = 0; j < n_cols - 1; ++j) {
+				float y = i * h, x = j * w;
+				makeQuadrangleEqui(strip, x, y, w, h, quad_3d, quad_2d);
+
+				for (int i = 0; i < 4; ++i) {
+					*vertices++ = quad_3d[i][0];
+					*vertices++ = quad_3d[i][1];
+					*vertices++ = quad_3d[i][2];
+					*vertices++ = quad_2d[i][0];
+					*vertices++ = quad_2d[i][1];
+					d[i] = norm(quad_3d[i]);
+				}
+
+				// index to draw triangles
+				emitTriangle(indices, k + 0, k + 1, k + 3, stretched(d[0], d[1], d[3], cull_ratio), n_culled);
+				emitTriangle(indices, k + 1, k + 2, k + 3, stretched(d[1], d[2], d[3], cull_ratio), n_culled);
+				k += 4;
+			}
+		}
+		return n_culled;
+	}
+
+	///////////////////////////////////// latitude /////////////////////////////////////
+	int latitudeColumns(int n_cols, int n_rows, int i)
+	{
+		if (i == 0 || i == n_rows - 1)
+			return 1;
+		float v = float(i) / (n_rows - 1) * CV_PI;
+		return max(3, (int)ceil((n_cols - 1) * sinf(v)));
+	}
+
+	// vertices of ring i: poles carry one copy per segment of the neighbouring ring,
+	// other rings repeat the seam vertex
+	static int ringVertices(int n_cols, int n_rows, int i)
+	{
+		if (i == 0)
+			return latitudeColumns(n_cols, n_rows, 1);
+		if (i == n_rows - 1)
+			return latitudeColumns(n_cols, n_rows, n_rows - 2);
+		return latitudeColumns(n_cols, n_rows, i) + 1;
+	}
+
+	// indices of the triangles between ring i - 1 and ring i, one per segment on either side
+	static int ringIndices(int n_cols, int n_rows, int i)
+	{
+		if (i == 0)
+			return 0;
+		if (i == 1 || i == n_rows - 1)
+			return 3 * ringVertices(n_cols, n_rows, i == 1 ? 0 : i);
+		return 3 * (latitudeColumns(n_cols, n_rows, i - 1) + latitudeColumns(n_cols, n_rows, i));
+	}
+
+	// depth of every vertex of ring i, false when its depth row is not in the strip
+	static bool ringDepths(const DepthStrip &strip, int n_cols, int n_rows, int i, vector<float> &depths)
+	{
+		float width = strip.depth.cols, height = strip.full_rows;
+		float y = i * (height / (n_rows - 1));
+		int row = sampleRow(y, strip.full_rows) - strip.y0;
+		if (row < 0 || row >= strip.depth.rows)
+			return false;
+
+		if (i == 0 || i == n_rows - 1) {
+			// every copy shares the mean depth of the pole row
+			depths.assign(ringVertices(n_cols, n_rows, i), (float)cv::mean(strip.depth.row(row))[0]);
+			return true;
+		}
+
+		int c = latitudeColumns(n_cols, n_rows, i);
+		depths.resize(c + 1);
+		for (int j = 0; j <= c; ++j)
+			depths[j] = sampleDepth(strip, j * width / c, y);
+		return true;
+	}
+
+	// rings of shared vertices, each column count follows sin(v) so the solid angle per triangle
+	// stays roughly constant; consecutive rings are zipped by walking both in u order
+	static size_t buildLatitudeRows(const DepthStrip &strip, int n_cols, int n_rows, int row_begin, int row_end,
+		float *vertices, unsigned int *indices, float cull_ratio)
+	{
+		float width = strip.depth.cols, height = strip.full_rows;
+		float h = height / (n_rows - 1);
+
+		size_t first_vertex, first_index;
+		rowOffsets(n_cols, n_rows, TESS_LATITUDE, row_begin, first_vertex, first_index);
+		unsigned int k = first_vertex;
+		int prev_c = row_begin > 0 ? latitudeColumns(n_cols, n_rows, row_begin - 1) : 0;
+		int prev_start = k - (row_begin > 0 ? ringVertices(n_cols, n_rows, row_begin - 1) : 0);
+
+		// depths of the ring above decide culling; without them the first zip is kept whole
+		vector<float> prev_d, cur_d;
+		bool have_prev = cull_ratio > 0 && row_begin > 0 && ringDepths(strip, n_cols, n_rows, row_begin - 1, prev_d);
+		if (!have_prev && row_begin > 0)
+			prev_d.assign(ringVertices(n_cols, n_rows, row_begin - 1), 0.f);
+		size_t n_culled = 0;
+		auto culled = [&](float d0, float d1, float d2) { return have_prev && stretched(d0, d1, d2, cull_ratio); };
+
+		for (int i = row_begin; i < row_end; ++i) {
+			float y = i * h;
+			bool pole = (i == 0 || i == n_rows - 1);
+			int c = pole ? ringVertices(n_cols, n_rows, i) : latitudeColumns(n_cols, n_rows, i);
+			int start = k;
+			CV_Assert(ringDepths(strip, n_cols, n_rows, i, cur_d));
+
+			if (pole) {
+				// only u differs between the copies, so the fan triangles are proper triangles
+				// with the texture column centered on each segment
+				for (int j = 0; j < c; ++j) {
+					unprojectEqui(strip, (j + 0.5f) * width / c, y, cur_d[j], vertices);
+					vertices += VERTEX_STRIDE;
+					++k;
+				}
+			}
+			else {
+				for (int j = 0; j <= c; ++j) {
+					unprojectEqui(strip, j * width / c, y, cur_d[j], vertices);
+					vertices += VERTEX_STRIDE;
+					++k;
+				}
+			}
+
+			if (i > 0) {
+				if (i == 1) {
+					// north fan: pole copy j over segment j of ring 1
+					for (int j = 0; j < c; ++j) {
+						emitTriangle(indices, prev_start + j, start + j + 1, start + j,
+							culled(prev_d[j], cur_d[j + 1], cur_d[j]), n_culled);
+					}
+				}
+				else if (pole) {
+					// south fan: segment j of the last ring over pole copy j
+					for (int j = 0; j < c; ++j) {
+						emitTriangle(indices, prev_start + j, prev_start + j + 1, start + j,
+							culled(prev_d[j], prev_d[j + 1], cur_d[j]), n_culled);
+					}
+				}
+				else {
+					// zip rings a (above) and b (below), advancing the side whose next vertex comes first in u
+					int a = 0, b = 0;
+					while (a < prev_c || b < c) {
+						bool advance_a = b >= c || (a < prev_c && float(a + 1) / prev_c <= float(b + 1) / c);
+						if (advance_a) {
+							emitTriangle(indices, prev_start + a, prev_start + a + 1, start + b,
+								culled(prev_d[a], prev_d[a + 1], cur_d[b]), n_culled);
+							++a;
+						}
+						else {
+							emitTriangle(indices, prev_start + a, start + b + 1, start + b,
+								culled(prev_d[a], cur_d[b + 1], cur_d[b]), n_culled);
+							++b;
+						}
+					}
+				}
+			}
+
+			prev_start = start;
+			prev_c = c;
+			prev_d.swap(cur_d);
+			have_prev = cull_ratio > 0;
+		}
+		return n_culled;
+	}
+
+	///////////////////////////////////// rows /////////////////////////////////////
+	int numMeshRows(int n_rows, Tessellation tess)
+	{
+		return tess == TESS_LATITUDE ? n_rows : n_rows - 1;
+	}
+
+	void depthRowsOf(int n_rows, int full_rows, Tessellation tess, int row, int &y_first, int &y_last)
+	{
+		float h = float(full_rows) / (n_rows - 1);
+		y_first = sampleRow(row * h, full_rows);
+		y_last = tess == TESS_LATITUDE ? y_first : sampleRow((row + 1) * h, full_rows);
+	}
+
+	void rowOffsets(int n_cols, int n_rows, Tessellation tess, int row, size_t &first_vertex, size_t &first_index)
+	{
+		if (tess != TESS_LATITUDE) {
+			size_t n_quads = size_t(n_cols - 1) * row;
+			first_vertex = n_quads * 4;
+			first_index = n_quads * 6;
+			return;
+		}
+
+		first_vertex = first_index = 0;
+		for (int i = 0; i < row; ++i) {
+			first_vertex += ringVertices(n_cols, n_rows, i);
+			first_index += ringIndices(n_cols, n_rows, i);
+		}
+	}
+
+	size_t buildEquirectangularRows(const DepthStrip &strip, int n_cols, int n_rows, int row_begin, int row_end,
+		float *vertices, unsigned int *indices, Tessellation tess, float cull_ratio)
+	{
+		if (tess == TESS_LATITUDE)
+			return buildLatitudeRows(strip, n_cols, n_rows, row_begin, row_end, vertices, indices, cull_ratio);
+		return buildGridRows(strip, n_cols, n_rows, row_begin, row_end, vertices, indices, cull_ratio);
+	}
+
+	///////////////////////////////////// whole mesh /////////////////////////////////////
+	void countEquirectangular(int n_cols, int n_rows, size_t &n_vertices, size_t &n_indices, Tessellation tess)
+	{
+		rowOffsets(n_cols, n_rows, tess, numMeshRows(n_rows, tess), n_vertices, n_indices);
+	}
+
+	void buildEquirectangular(const cv::Mat &depth, MeshData &mesh, int n_cols, int n_rows, Tessellation tess,
+		float cull_ratio)
+	{
+		size_t n_vertices, n_indices;
+		countEquirectangular(n_cols, n_rows, n_vertices, n_indices, tess);
+		mesh.vertices.resize(n_vertices * VERTEX_STRIDE);
+		mesh.indices.resize(n_indices);
+		mesh.n_cols = n_cols;
+		mesh.n_rows = n_rows;
+		mesh.n_culled = buildEquirectangular(depth, n_cols, n_rows, mesh.vertices.data(), mesh.indices.data(), tess,
+			cull_ratio);
+	}
+
+	size_t buildEquirectangular(const cv::Mat &depth, int n_cols, int n_rows, float *vertices, unsigned int *indices,
+		Tessellation tess, float cull_ratio)
+	{
+		DepthStrip strip;
+		strip.depth = depth;
+		strip.full_rows = depth.rows;
+		return buildEquirectangularRows(strip, n_cols, n_rows, 0, numMeshRows(n_rows, tess), vertices, indices, tess,
+			cull_ratio);
+	}
+} }
@@ -0,0 +1,69 @@
+/* Mesh generation for panorama with depth, CPU side only.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include "opencv2/opencv.hpp"
+
+namespace kandao { namespace mesh
+{
+	// interleaved vertex layout: X, Y, Z, u, v
+	const int VERTEX_STRIDE = 5;
+
+	struct MeshData
+	{
+		std::vector<float> vertices;
+		std::vector<unsigned int> indices;
+		int n_cols = 0, n_rows = 0;
+		size_t n_culled = 0;	// triangles left degenerate across depth discontinuities
+
+		size_t numVertices() const { return vertices.size() / VERTEX_STRIDE; }
+		size_t bytes() const { return vertices.size() * sizeof(float) + indices.size() * sizeof(unsigned int); }
+	};
+
+	///////////////////////////////////// equirectangular /////////////////////////////////////
+	enum Tessellation
+	{
+		TESS_GRID,		// n_cols quads on every row, 4 vertices per quad
+		TESS_LATITUDE,	// shared vertex rings whose column count scales with sin(v), one fan per pole
+	};
+
+	// Triangles whose corner depths differ by more than a factor of cull_ratio span a depth edge:
+	// drawn, they stretch foreground texels over the background once the camera leaves the
+	// center. They are kept as degenerate triangles (all three indices equal), so vertex and
+	// index counts and the row offsets below stay the same; cull_ratio <= 0 keeps everything.
+	// Builders return how many they culled.
+
+	// build upon grids of n_cols * n_rows, depth as CV_32F in equirectangular layout
+	void buildEquirectangular(const cv::Mat &depth, MeshData &mesh, int n_cols = 200, int n_rows = 100,
+		Tessellation tess = TESS_GRID, float cull_ratio = 0);
+
+	// vertex and index count of a n_cols * n_rows grid
+	void countEquirectangular(int n_cols, int n_rows, size_t &n_vertices, size_t &n_indices,
+		Tessellation tess = TESS_GRID);
+	// write straight into caller memory (e.g. a mapped GPU buffer) sized by countEquirectangular
+	size_t buildEquirectangular(const cv::Mat &depth, int n_cols, int n_rows, float *vertices, unsigned int *indices,
+		Tessellation tess = TESS_GRID, float cull_ratio = 0);
+
+	// segments of ring i in the latitude layout, equal to n_cols - 1 at the equator
+	int latitudeColumns(int n_cols, int n_rows, int i);
+
+	///////////////////////////////////// streaming /////////////////////////////////////
+	// rows [y0, y0 + depth.rows) of a depth panorama full_rows high
+	struct DepthStrip
+	{
+		cv::Mat depth;
+		int y0 = 0, full_rows = 0;
+	};
+
+	// mesh rows are quad rows for TESS_GRID and vertex rings for TESS_LATITUDE
+	int numMeshRows(int n_rows, Tessellation tess);
+	// depth rows [y_first, y_last] mesh row reads
+	void depthRowsOf(int n_rows, int full_rows, Tessellation tess, int row, int &y_first, int &y_last);
+	// where mesh row starts in the vertex and index arrays of the full mesh
+	void rowOffsets(int n_cols, int n_rows, Tessellation tess, int row, size_t &first_vertex, size_t &first_index);
+	// emit mesh rows [row_begin, row_end) into vertices / indices, which point at rowOffsets(row_begin);
+	// indices stay absolute, so slices can be uploaded separately. Culling a TESS_LATITUDE row_begin
+	// needs the depth row of the ring above it in the strip too, otherwise that zip is kept whole
+	size_t buildEquirectangularRows(const DepthStrip &strip, int n_cols, int n_rows, int row_begin, int row_end,
+		float *vertices, unsigned int *indices, Tessellation tess = TESS_GRID, float cull_ratio = 0);
+} }
@@ -0,0 +1,537 @@
+/* Native panorama container: GPU-ready color and lossless depth in compressed row tiles.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "utils/panofile.h"
+#include "utils/utils.opencv.h"
+#include "utils/timer.h"
+#include "utils/lz.h"
+#include "utils/memory.h"
+#include "utils/depth_upsample.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	static const char pano_magic[4] = { 'K', 'P', 'A', 'N' };
+	static const unsigned int pano_version = 1;
+	// depth of invalid disparity, as in viewableDisp2Original
+	static const float invalid_depth = 10000.f;
+
+	///////////////////////////////////// helpers /////////////////////////////////////
+	// read-only memory mapping of a whole file
+	class MappedFile
+	{
+	public:
+		~MappedFile() { close(); }
+
+		bool open(const std::string &fn)
+		{
+			close();
+#ifdef _WIN32
+			file = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER file_size;
+			GetFileSizeEx(file, &file_size);
+			length = (size_t)file_size.QuadPart;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping)
+				ptr = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+			fd = ::open(fn.c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+			struct stat st;
+			fstat(fd, &st);
+			length = st.st_size;
+			void *p = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+			ptr = p == MAP_FAILED ? NULL : (const unsigned char*)p;
+#endif
+			if (!ptr)
+				close();
+			return ptr != NULL;
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (ptr)
+				UnmapViewOfFile(ptr);
+			if (mapping)
+				CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (ptr)
+				munmap((void*)ptr, length);
+			if (fd >= 0)
+				::close(fd);
+			fd = -1;
+#endif
+			ptr = NULL;
+			length = 0;
+		}
+
+		const unsigned char* data() const { return ptr; }
+		size_t size() const { return length; }
+
+	private:
+		const unsigned char *ptr = NULL;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+#else
+		int fd = -1;
+#endif
+	};
+
+	static unsigned short floatToHalf(float f)
+	{
+		unsigned int x;
+		memcpy(&x, &f, 4);
+		unsigned int sign = (x >> 16) & 0x8000, exp = (x >> 23) & 0xFF, mant = x & 0x7FFFFF;
+		if (exp == 0xFF)
+			return sign | 0x7C00 | (mant ? 0x200 : 0);
+		int e = (int)exp - 127 + 15;
+		if (e >= 31)
+			return sign | 0x7C00;
+		if (e <= 0) {
+			if (e < -10)
+				return sign;
+			mant |= 0x800000;
+			unsigned int shift = 14 - e;
+			unsigned int half = mant >> shift, rest = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+			if (rest > mid || (rest == mid && (half & 1)))
+				++half;
+			return sign | half;
+		}
+		unsigned int half = sign | (e << 10) | (mant >> 13), rest = mant & 0x1FFF;
+		// round to nearest even, a carry into the exponent is still correct
+		if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+			++half;
+		return half;
+	}
+
+	static float halfToFloat(unsigned short h)
+	{
+		unsigned int sign = (h & 0x8000) << 16, exp = (h >> 10) & 0x1F, mant = h & 0x3FF, x;
+		if (exp == 0) {
+			if (mant == 0) {
+				x = sign;
+			}
+			else {
+				// subnormal: normalize
+				exp = 127 - 15 + 1;
+				while (!(mant & 0x400)) {
+					mant <<= 1;
+					--exp;
+				}
+				x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+			}
+		}
+		else if (exp == 31) {
+			x = sign | 0x7F800000 | (mant << 13);
+		}
+		else {
+			x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+		}
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	// neighbouring pixels are alike, so each pixel is stored minus its left neighbour: per channel for
+	// BGRA8, done on four bytes at once without carries, and as plain 16-bit words for depth
+	static inline unsigned int addBytes(unsigned int a, unsigned int b)
+	{
+		return ((a & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((a ^ b) & 0x80808080);
+	}
+
+	static inline unsigned int subBytes(unsigned int a, unsigned int b)
+	{
+		return ((a | 0x80808080) - (b & 0x7F7F7F7F)) ^ ((a ^ ~b) & 0x80808080);
+	}
+
+	static void deltaEncodeRow(unsigned char *row, int n, PanoPlane plane)
+	{
+		if (plane == PANO_COLOR) {
+			unsigned int *px = (unsigned int*)row;
+			for (int j = n - 1; j > 0; --j)
+				px[j] = subBytes(px[j], px[j - 1]);
+		}
+		else {
+			unsigned short *px = (unsigned short*)row;
+			for (int j = n - 1; j > 0; --j)
+				px[j] = px[j] - px[j - 1];
+		}
+	}
+
+	static void deltaDecodeRow(unsigned char *row, int n, PanoPlane plane)
+	{
+		if (plane == PANO_COLOR) {
+			unsigned int *px = (unsigned int*)row;
+			for (int j = 1; j < n; ++j)
+				px[j] = addBytes(px[j], px[j - 1]);
+		}
+		else {
+			unsigned short *px = (unsigned short*)row;
+			for (int j = 1; j < n; ++j)
+				px[j] = px[j] + px[j - 1];
+		}
+	}
+
+	static int bytesPerPixel(const PanoTile &tile)
+	{
+		return tile.plane == PANO_COLOR ? 4 : 2;
+	}
+
+	///////////////////////////////////// writer /////////////////////////////////////
+	class CompressTilesBody : public ParallelLoopBody
+	{
+	public:
+		CompressTilesBody(const vector<const Mat*> &sources, const vector<PanoTile> &tiles, vector<vector<uchar>> &packed)
+			: sources(sources), tiles(tiles), packed(packed) {}
+
+		void operator()(const Range &range) const
+		{
+			vector<uchar> raw;
+			for (int i = range.start; i < range.end; ++i) {
+				const PanoTile &tile = tiles[i];
+				const Mat &src = *sources[i];
+				size_t row_bytes = src.cols * src.elemSize();
+				raw.resize(tile.raw_size);
+				for (unsigned int y = 0; y < tile.rows; ++y) {
+					uchar *row = raw.data() + y * row_bytes;
+					memcpy(row, src.ptr(tile.y0 + y), row_bytes);
+					deltaEncodeRow(row, src.cols, (PanoPlane)tile.plane);
+				}
+
+				packed[i].resize(lz::compressBound(raw.size()));
+				packed[i].resize(lz::compress(raw.data(), raw.size(), packed[i].data(), packed[i].size()));
+			}
+		}
+
+	private:
+		const vector<const Mat*> &sources;
+		const vector<PanoTile> &tiles;
+		vector<vector<uchar>> &packed;
+	};
+
+	static void addTiles(const Mat &src, PanoPlane plane, int level, int tile_rows, vector<const Mat*> &sources,
+		vector<PanoTile> &tiles)
+	{
+		for (int y0 = 0; y0 < src.rows; y0 += tile_rows) {
+			PanoTile tile;
+			tile.plane = plane;
+			tile.level = level;
+			tile.y0 = y0;
+			tile.rows = min(tile_rows, src.rows - y0);
+			tile.offset = 0;
+			tile.packed_size = 0;
+			tile.raw_size = tile.rows * src.cols * src.elemSize();
+			tiles.push_back(tile);
+			sources.push_back(&src);
+		}
+	}
+
+	bool writePanoFile(const std::string &fn, const cv::Mat &frame, const cv::Mat &disp, float disp_scale,
+		const PanoWriteOptions &options)
+	{
+		if (frame.empty() || disp.size() != frame.size()) {
+			printf("[pano] color and disparity must be the same size\n");
+			return false;
+		}
+
+		// color levels, GL mip sizes
+		vector<Mat> color(1);
+		cvtColor(frame, color[0], frame.channels() == 1 ? COLOR_GRAY2BGRA : COLOR_BGR2BGRA);
+		while (options.mips && (color.back().cols > 1 || color.back().rows > 1)) {
+			Mat next;
+			resize(color.back(), next, Size(max(color.back().cols / 2, 1), max(color.back().rows / 2, 1)), 0, 0, INTER_AREA);
+			color.push_back(next);
+		}
+
+		Mat depth;
+		float depth_scale = 0.f;
+		if (options.depth_format == PANO_DISPARITY_U16) {
+			// fixed point disparity, 8 fractional bits keeps 8-bit input exact
+			Mat gray = disp;
+			if (gray.channels() == 3) {
+				vector<Mat> channels;
+				split(gray, channels);
+				gray = channels.front();
+			}
+			gray.convertTo(depth, CV_16U, 256.);
+			depth_scale = 25500.f * disp_scale * 256.f;
+		}
+		else {
+			Mat depth_f = opencv::viewableDisp2Original(disp, disp_scale);
+			depth.create(depth_f.size(), CV_16U);
+			for (int i = 0; i < depth.rows; ++i) {
+				const float *src = depth_f.ptr<float>(i);
+				unsigned short *dst = depth.ptr<unsigned short>(i);
+				for (int j = 0; j < depth.cols; ++j)
+					dst[j] = floatToHalf(src[j]);
+			}
+		}
+
+		vector<const Mat*> sources;
+		vector<PanoTile> tiles;
+		for (int i = 0; i < (int)color.size(); ++i)
+			addTiles(color[i], PANO_COLOR, i, options.tile_rows, sources, tiles);
+		addTiles(depth, PANO_DEPTH, 0, options.tile_rows, sources, tiles);
+
+		vector<vector<uchar>> packed(tiles.size());
+		parallel_for_(Range(0, (int)tiles.size()), CompressTilesBody(sources, tiles, packed));
+
+		PanoHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, pano_magic, 4);
+		header.version = pano_version;
+		header.width = frame.cols;
+		header.height = frame.rows;
+		header.tile_rows = options.tile_rows;
+		header.n_color_levels = color.size();
+		header.depth_format = options.depth_format;
+		header.depth_scale = depth_scale;
+		header.n_tiles = tiles.size();
+
+		unsigned long long offset = sizeof(PanoHeader) + tiles.size() * sizeof(PanoTile);
+		for (size_t i = 0; i < tiles.size(); ++i) {
+			tiles[i].offset = offset;
+			tiles[i].packed_size = packed[i].size();
+			offset += packed[i].size();
+		}
+
+		FILE *fp = fopen(fn.c_str(), "wb");
+		if (!fp) {
+			printf("[pano] cannot write %s\n", fn.c_str());
+			return false;
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+			fwrite(tiles.data(), sizeof(PanoTile), tiles.size(), fp) == tiles.size();
+		for (size_t i = 0; ok && i < packed.size(); ++i)
+			ok = packed[i].empty() || fwrite(packed[i].data(), packed[i].size(), 1, fp) == 1;
+		fclose(fp);
+
+		if (!ok) {
+			printf("[pano] writing %s failed\n", fn.c_str());
+			remove(fn.c_str());
+		}
+		return ok;
+	}
+
+	bool convertTopBottom(const std::string &in_fn, const std::string &out_fn, float disp_scale,
+		const PanoWriteOptions &options)
+	{
+		Mat in_dat = imread(in_fn);
+		if (in_dat.empty()) {
+			printf("[pano] read %s failed\n", in_fn.c_str());
+			return false;
+		}
+		// reduced disparity layouts come back upsampled to the frame
+		Mat frame, disp;
+		if (!splitTopBottom(in_dat, frame, disp)) {
+			printf("[pano] %s is not a top-bottom panorama\n", in_fn.c_str());
+			return false;
+		}
+		return writePanoFile(out_fn, frame, disp, disp_scale, options);
+	}
+
+	///////////////////////////////////// loader /////////////////////////////////////
+	bool isPanoFile(const std::string &fn)
+	{
+		char magic[4] = { 0 };
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (!fp)
+			return false;
+		size_t n = fread(magic, 1, 4, fp);
+		fclose(fp);
+		return n == 4 && memcmp(magic, pano_magic, 4) == 0;
+	}
+
+	class DecompressTilesBody : public ParallelLoopBody
+	{
+	public:
+		DecompressTilesBody(const MappedFile &file, const PanoHeader &header, const PanoTile *tiles,
+			PanoImage &image, atomic<int> &n_failed)
+			: file(file), header(header), tiles(tiles), image(image), n_failed(n_failed) {}
+
+		void operator()(const Range &range) const
+		{
+			vector<uchar> raw;
+			for (int i = range.start; i < range.end; ++i) {
+				const PanoTile &tile = tiles[i];
+				// a damaged table must not pick a plane or level that does not exist
+				bool known = tile.plane == PANO_COLOR ? tile.level < header.n_color_levels :
+					tile.plane == PANO_DEPTH && tile.level == 0;
+				if (!known) {
+					++n_failed;
+					continue;
+				}
+				Mat &dst = tile.plane == PANO_COLOR ? image.color[tile.level] : image.depth;
+				int bpp = bytesPerPixel(tile);
+				size_t row_bytes = (size_t)dst.cols * bpp;
+				// compared without sums that could wrap around
+				if (tile.y0 > (unsigned int)dst.rows || tile.rows > (unsigned int)dst.rows - tile.y0 ||
+					tile.raw_size != tile.rows * row_bytes || tile.offset > file.size() ||
+					tile.packed_size > file.size() - tile.offset) {
+					++n_failed;
+					continue;
+				}
+
+				// color decompresses straight into its rows, depth is widened to float afterwards
+				bool in_place = tile.plane == PANO_COLOR && dst.isContinuous();
+				uchar *out = in_place ? dst.ptr(tile.y0) : NULL;
+				if (!in_place) {
+					raw.resize(tile.raw_size);
+					out = raw.data();
+				}
+				if (!lz::decompress(file.data() + tile.offset, tile.packed_size, out, tile.raw_size)) {
+					++n_failed;
+					continue;
+				}
+
+				for (unsigned int y = 0; y < tile.rows; ++y) {
+					uchar *row = out + y * row_bytes;
+					deltaDecodeRow(row, dst.cols, (PanoPlane)tile.plane);
+					if (tile.plane == PANO_COLOR) {
+						if (!in_place)
+							memcpy(dst.ptr(tile.y0 + y), row, row_bytes);
+						continue;
+					}
+
+					const unsigned short *src = (const unsigned short*)row;
+					float *depth = dst.ptr<float>(tile.y0 + y);
+					if (header.depth_format == PANO_DISPARITY_U16) {
+						for (int j = 0; j < dst.cols; ++j)
+							depth[j] = src[j] ? header.depth_scale / src[j] : invalid_depth;
+					}
+					else {
+						for (int j = 0; j < dst.cols; ++j)
+							depth[j] = halfToFloat(src[j]);
+					}
+				}
+			}
+		}
+
+	private:
+		const MappedFile &file;
+		const PanoHeader &header;
+		const PanoTile *tiles;
+		PanoImage &image;
+		atomic<int> &n_failed;
+	};
+
+	bool loadPanoFile(const std::string &fn, PanoImage &image)
+	{
+		MemoryStage stage("native load");
+		MappedFile file;
+		if (!file.open(fn)) {
+			printf("[pano] cannot map %s\n", fn.c_str());
+			return false;
+		}
+
+		PanoHeader header;
+		if (file.size() < sizeof(header)) {
+			printf("[pano] %s is truncated\n", fn.c_str());
+			return false;
+		}
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(header.magic, pano_magic, 4) != 0 || header.version != pano_version) {
+			printf("[pano] %s is not a version %u panorama file\n", fn.c_str(), pano_version);
+			return false;
+		}
+		if (header.n_color_levels == 0 || header.n_color_levels > 32 ||
+			sizeof(header) + (size_t)header.n_tiles * sizeof(PanoTile) > file.size()) {
+			printf("[pano] %s has a damaged header\n", fn.c_str());
+			return false;
+		}
+		const PanoTile *tiles = (const PanoTile*)(file.data() + sizeof(header));
+
+		// reuse what the caller prepared when it fits
+		image.color.resize(header.n_color_levels);
+		int w = header.width, h = header.height;
+		for (unsigned int i = 0; i < header.n_color_levels; ++i) {
+			if (image.color[i].rows != h || image.color[i].cols != w || image.color[i].type() != CV_8UC4)
+				image.color[i].create(h, w, CV_8UC4);
+			w = max(w / 2, 1);
+			h = max(h / 2, 1);
+		}
+		if (image.depth.rows != (int)header.height || image.depth.cols != (int)header.width ||
+			image.depth.type() != CV_32F)
+			image.depth.create(header.height, header.width, CV_32F);
+
+		atomic<int> n_failed(0);
+		parallel_for_(Range(0, (int)header.n_tiles), DecompressTilesBody(file, header, tiles, image, n_failed));
+		if (n_failed > 0) {
+			printf("[pano] %d of %u tiles of %s are damaged\n", (int)n_failed, header.n_tiles, fn.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	static size_t fileSize(const std::string &fn)
+	{
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (!fp)
+			return 0;
+		fseek(fp, 0, SEEK_END);
+		size_t size = ftell(fp);
+		fclose(fp);
+		return size;
+	}
+
+	void benchmarkPanoLoad(const std::string &jpg_fn, const std::string &pano_fn, float disp_scale, int n_runs)
+	{
+		double jpg_ms = 0, pano_ms = 0;
+		Mat jpg_depth;
+		PanoImage image;
+		for (int i = 0; i < n_runs; ++i) {
+			double t = wallTimeMs();
+			Mat in_dat = imread(jpg_fn), frame, disp;
+			if (in_dat.empty() || !splitTopBottom(in_dat, frame, disp))
+				return;
+			jpg_depth = opencv::viewableDisp2Original(disp, disp_scale);
+			jpg_ms += wallTimeMs() - t;
+
+			// fresh Mats every run, in-place reuse would flatter the container
+			image = PanoImage();
+			t = wallTimeMs();
+			if (!loadPanoFile(pano_fn, image))
+				return;
+			pano_ms += wallTimeMs() - t;
+		}
+
+		// relative depth difference between both paths
+		double max_rel = 0;
+		for (int i = 0; i < jpg_depth.rows; ++i) {
+			const float *a = jpg_depth.ptr<float>(i), *b = image.depth.ptr<float>(i);
+			for (int j = 0; j < jpg_depth.cols; ++j)
+				max_rel = max(max_rel, (double)fabs(a[j] - b[j]) / max(fabs(a[j]), 1e-6f));
+		}
+
+		printf("[pano] jpeg %s: %.1f MB, imread + depth %.2f ms\n", jpg_fn.c_str(), fileSize(jpg_fn) / 1048576.,
+			jpg_ms / n_runs);
+		printf("[pano] native %s: %.1f MB, %d color levels, load %.2f ms (%.1fx), depth max rel. difference %.2e\n",
+			pano_fn.c_str(), fileSize(pano_fn) / 1048576., (int)image.color.size(), pano_ms / n_runs,
+			jpg_ms / max(pano_ms, 1e-3), max_rel);
+	}
+}
@@ -0,0 +1,77 @@
+/* Native panorama container: GPU-ready color and lossless depth in compressed row tiles.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <string>
+#include <vector>
+#include "opencv2/opencv.hpp"
+
+namespace kandao
+{
+	// File layout, little endian:
+	//   PanoHeader
+	//   PanoTile[n_tiles]
+	//   tile payloads, each LZ4 block compressed after a per-row delta to the left pixel
+	// Color is BGRA8 at every stored mip level, depth is one level of either 16-bit disparity
+	// (exact for the 8-bit disparity of the top-bottom JPEGs) or half-float depth.
+	enum PanoPlane
+	{
+		PANO_COLOR = 0,
+		PANO_DEPTH = 1,
+	};
+
+	enum PanoDepthFormat
+	{
+		PANO_DISPARITY_U16 = 0,	// depth = depth_scale / value, 0 = invalid
+		PANO_DEPTH_F16 = 1,		// IEEE half depth
+	};
+
+	struct PanoHeader
+	{
+		char magic[4];
+		unsigned int version;
+		unsigned int width, height;		// of color level 0 and of the depth
+		unsigned int tile_rows;
+		unsigned int n_color_levels;
+		unsigned int depth_format;
+		float depth_scale;
+		unsigned int n_tiles;
+		unsigned int reserved[3];
+	};
+
+	struct PanoTile
+	{
+		unsigned int plane, level, y0, rows;
+		unsigned long long offset;		// from the start of the file
+		unsigned int packed_size, raw_size;
+	};
+
+	struct PanoImage
+	{
+		std::vector<cv::Mat> color;		// CV_8UC4 BGRA, level 0 first
+		cv::Mat depth;					// CV_32F, same as viewableDisp2Original
+	};
+
+	struct PanoWriteOptions
+	{
+		int tile_rows = 64;
+		bool mips = true;				// store the full color mip chain
+		PanoDepthFormat depth_format = PANO_DISPARITY_U16;
+	};
+
+	// quick magic check, e.g. to pick a loader by content
+	bool isPanoFile(const std::string &fn);
+
+	// top-bottom input: color on top, viewable disparity below; disp_scale as for viewableDisp2Original
+	bool writePanoFile(const std::string &fn, const cv::Mat &frame, const cv::Mat &disp, float disp_scale,
+		const PanoWriteOptions &options = PanoWriteOptions());
+	bool convertTopBottom(const std::string &in_fn, const std::string &out_fn, float disp_scale,
+		const PanoWriteOptions &options = PanoWriteOptions());
+
+	// memory maps the file and decompresses tiles in parallel. Mats in image that already have the
+	// right size and type are written in place, e.g. when they wrap mapped upload buffers.
+	bool loadPanoFile(const std::string &fn, PanoImage &image);
+
+	// time imread + viewableDisp2Original against loadPanoFile for the same panorama
+	void benchmarkPanoLoad(const std::string &jpg_fn, const std::string &pano_fn, float disp_scale, int n_runs = 3);
+}
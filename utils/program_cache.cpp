@@ -0,0 +1,192 @@
+/* On-disk cache of linked shader program binaries.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cstdio>
+#include <cstring>
+#include "utils/program_cache.h"
+#include "utils/utils.opengl.h"
+#include "utils/timer.h"
+
+using namespace std;
+
+namespace kandao { namespace OpenGL
+{
+	static const char cache_magic[4] = { 'K', 'P', 'B', 'C' };
+	static const unsigned int cache_version = 1;
+
+	// FNV-1a, stable across runs and platforms
+	static unsigned long long hashBytes(const void *data, size_t size, unsigned long long h = 14695981039346656037ull)
+	{
+		const unsigned char *p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; ++i) {
+			h ^= p[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	static unsigned long long hashString(const char *s, unsigned long long h)
+	{
+		// include the terminator so ("ab", "c") and ("a", "bc") differ
+		return s ? hashBytes(s, strlen(s) + 1, h) : hashBytes("", 1, h);
+	}
+
+	ProgramCache::ProgramCache(const std::string &path)
+		: path(path)
+	{
+		GLint n_formats = 0;
+		if (GLEW_ARB_get_program_binary)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+		enabled = n_formats > 0;
+		if (!enabled) {
+			printf("[shader cache] program binaries not supported, compiling from source\n");
+			return;
+		}
+
+		driver_key = hashString((const char*)glGetString(GL_VENDOR), 14695981039346656037ull);
+		driver_key = hashString((const char*)glGetString(GL_RENDERER), driver_key);
+		driver_key = hashString((const char*)glGetString(GL_VERSION), driver_key);
+
+		FILE *fp = fopen(path.c_str(), "rb");
+		if (!fp)
+			return;
+		fseek(fp, 0, SEEK_END);
+		long file_size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+
+		char magic[4];
+		unsigned int version = 0, n_entries = 0;
+		unsigned long long file_driver = 0;
+		bool ok = fread(magic, 4, 1, fp) == 1 && memcmp(magic, cache_magic, 4) == 0 &&
+			fread(&version, sizeof(version), 1, fp) == 1 && version == cache_version &&
+			fread(&file_driver, sizeof(file_driver), 1, fp) == 1 &&
+			fread(&n_entries, sizeof(n_entries), 1, fp) == 1;
+
+		if (ok && file_driver != driver_key) {
+			printf("[shader cache] %s was written by another driver, starting over\n", path.c_str());
+			dirty = true;
+			ok = false;
+		}
+
+		for (unsigned int i = 0; ok && i < n_entries; ++i) {
+			unsigned long long key;
+			unsigned int format, size;
+			ok = fread(&key, sizeof(key), 1, fp) == 1 && fread(&format, sizeof(format), 1, fp) == 1 &&
+				fread(&size, sizeof(size), 1, fp) == 1;
+			// a damaged size must not turn into a huge allocation
+			if (!ok || size > (unsigned long)(file_size - ftell(fp))) {
+				ok = false;
+				break;
+			}
+			Entry &entry = entries[key];
+			entry.format = format;
+			entry.binary.resize(size);
+			ok = size == 0 || fread(entry.binary.data(), size, 1, fp) == 1;
+		}
+		fclose(fp);
+
+		if (!ok && !dirty) {
+			printf("[shader cache] %s is damaged, starting over\n", path.c_str());
+			dirty = true;
+		}
+		if (!ok)
+			entries.clear();
+	}
+
+	GLuint ProgramCache::load(const char *vertex_shader, const char *fragment_shader, const char *name)
+	{
+		if (!enabled) {
+			double t = wallTimeMs();
+			GLuint program = LoadShadersFromString(vertex_shader, fragment_shader);
+			compile_ms += wallTimeMs() - t;
+			++n_misses;
+			return program;
+		}
+
+		unsigned long long key = hashString(fragment_shader, hashString(vertex_shader, driver_key));
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			double t = wallTimeMs();
+			GLuint program = glCreateProgram();
+			glProgramBinary(program, it->second.format, it->second.binary.data(), (GLsizei)it->second.binary.size());
+
+			GLint linked = GL_FALSE;
+			glGetProgramiv(program, GL_LINK_STATUS, &linked);
+			double ms = wallTimeMs() - t;
+			if (linked) {
+				load_ms += ms;
+				++n_hits;
+				printf("[shader cache] %s: binary loaded in %.2f ms\n", name, ms);
+				glUseProgram(program);
+				return program;
+			}
+
+			// the driver may refuse a binary any time, e.g. after a silent update
+			printf("[shader cache] %s: binary rejected, recompiling\n", name);
+			glDeleteProgram(program);
+			entries.erase(it);
+			dirty = true;
+			++n_rejected;
+		}
+
+		double t = wallTimeMs();
+		GLuint program = LoadShadersFromString(vertex_shader, fragment_shader, true);
+		double ms = wallTimeMs() - t;
+		compile_ms += ms;
+		++n_misses;
+		printf("[shader cache] %s: compiled in %.2f ms\n", name, ms);
+		if (!program)
+			return 0;
+
+		GLint size = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+		if (size > 0) {
+			Entry &entry = entries[key];
+			entry.binary.resize(size);
+			GLsizei written = 0;
+			glGetProgramBinary(program, size, &written, &entry.format, entry.binary.data());
+			entry.binary.resize(written);
+			if (written > 0)
+				dirty = true;
+			else
+				entries.erase(key);
+		}
+		return program;
+	}
+
+	bool ProgramCache::save()
+	{
+		if (!enabled || !dirty)
+			return true;
+
+		FILE *fp = fopen(path.c_str(), "wb");
+		if (!fp) {
+			printf("[shader cache] cannot write %s\n", path.c_str());
+			return false;
+		}
+
+		unsigned int n_entries = entries.size();
+		bool ok = fwrite(cache_magic, 4, 1, fp) == 1 && fwrite(&cache_version, sizeof(cache_version), 1, fp) == 1 &&
+			fwrite(&driver_key, sizeof(driver_key), 1, fp) == 1 && fwrite(&n_entries, sizeof(n_entries), 1, fp) == 1;
+		for (auto it = entries.begin(); ok && it != entries.end(); ++it) {
+			unsigned int format = it->second.format, size = it->second.binary.size();
+			ok = fwrite(&it->first, sizeof(it->first), 1, fp) == 1 && fwrite(&format, sizeof(format), 1, fp) == 1 &&
+				fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(it->second.binary.data(), size, 1, fp) == 1;
+		}
+		fclose(fp);
+
+		if (!ok) {
+			printf("[shader cache] writing %s failed\n", path.c_str());
+			remove(path.c_str());
+			return false;
+		}
+		dirty = false;
+		return true;
+	}
+
+	void ProgramCache::printStats() const
+	{
+		printf("[shader cache] %d hits (%.2f ms), %d compiled (%.2f ms), %d rejected, %zu entries\n",
+			n_hits, load_ms, n_misses, compile_ms, n_rejected, entries.size());
+	}
+} }
@@ -0,0 +1,44 @@
+/* On-disk cache of linked shader program binaries.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+namespace kandao { namespace OpenGL
+{
+	// One file holds the glGetProgramBinary output of every program, keyed by a hash of both
+	// sources. The whole file is tagged with the GL vendor/renderer/version, so a driver update
+	// drops it; a binary the driver still rejects is recompiled from source transparently.
+	// Construct after glewInit.
+	class ProgramCache
+	{
+	public:
+		explicit ProgramCache(const std::string &path);
+
+		// linked program, from the cache when possible; 0 if the sources do not compile
+		GLuint load(const char *vertex_shader, const char *fragment_shader, const char *name = "program");
+		// write back when something was added or dropped
+		bool save();
+
+		bool supported() const { return enabled; }
+		void printStats() const;
+
+		int n_hits = 0, n_misses = 0, n_rejected = 0;
+		double load_ms = 0, compile_ms = 0;
+
+	private:
+		struct Entry
+		{
+			GLenum format = 0;
+			std::vector<char> binary;
+		};
+
+		std::string path;
+		bool enabled = false, dirty = false;
+		unsigned long long driver_key = 0;
+		std::map<unsigned long long, Entry> entries;
+	};
+} }
@@ -0,0 +1,220 @@
+/* Progressive loading: coarse preview first, finer meshes built in the background.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/progressive.h"
+#include "utils/utils.opencv.h"
+#include "utils/timer.h"
+#include "utils/memory.h"
+#include "utils/depth_upsample.h"
+#include "utils/jpeg_decode.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	ProgressiveLoader::~ProgressiveLoader()
+	{
+		join();
+	}
+
+	void ProgressiveLoader::buildPreview(const cv::Mat &frame, const cv::Mat &disp, float disp_scale, cv::Size grid,
+		cv::Mat &preview_frame, cv::Mat &preview_depth, mesh::MeshData &preview_mesh, mesh::Tessellation tess,
+		float cull_ratio)
+	{
+		// texture at most 512 wide, depth only needs to resolve the grid
+		MemoryStage stage("preview");
+		float ratio = min(1.f, 512.f / frame.cols);
+		resize(frame, preview_frame, Size(), ratio, ratio, INTER_AREA);
+
+		Mat small_disp;
+		resize(disp, small_disp, Size(grid.width * 2, grid.height * 2), 0, 0, INTER_NEAREST);
+		preview_depth = opencv::viewableDisp2Original(small_disp, disp_scale);
+
+		mesh::buildEquirectangular(preview_depth, preview_mesh, grid.width, grid.height, tess, cull_ratio);
+	}
+
+	bool ProgressiveLoader::decodePreview(const std::string &fn, cv::Mat &frame, cv::Mat &disp)
+	{
+		MemoryStage stage("preview decode");
+		Mat small = imread(fn, IMREAD_REDUCED_COLOR_8);
+		if (small.empty())
+			return false;
+
+		// the 1/8 size is rounded up, so the reduced depth layouts are told apart by their aspect
+		// and resized to the nearest exact one before the split
+		int factor = 1;
+		float aspect = (float)small.rows / small.cols;
+		for (int f = 2; f <= 4; f *= 2) {
+			if (fabs(aspect - (0.5f + 0.5f / (f * f))) < 0.01f)
+				factor = f;
+		}
+		if (factor > 1) {
+			int width = max(1, small.cols / (2 * factor * factor)) * 2 * factor * factor;
+			resize(small, small, Size(width, width / 2 + width / (2 * factor * factor)), 0, 0, INTER_AREA);
+		}
+		return splitDepthLayout(small, frame, disp, factor);
+	}
+
+	void ProgressiveLoader::start(const cv::Mat &disp, float disp_scale, const std::vector<cv::Size> &grids,
+		const std::vector<Target> &targets)
+	{
+		launch(string(), 0, disp, disp_scale, grids, targets);
+	}
+
+	void ProgressiveLoader::start(const std::string &fn, int n_threads, float disp_scale, const std::vector<cv::Size> &grids,
+		const std::vector<Target> &targets)
+	{
+		launch(fn, n_threads, Mat(), disp_scale, grids, targets);
+	}
+
+	void ProgressiveLoader::launch(const std::string &fn, int n_threads, const cv::Mat &disp, float disp_scale,
+		const std::vector<cv::Size> &grids, const std::vector<Target> &targets)
+	{
+		join();
+		depth_ready = false;
+		frame_ready = false;
+		has_pending = false;
+		pending_index = taken_index = -1;
+		n_levels = grids.size();
+		n_finished = 0;
+		vector<Target> level_targets = targets;
+		level_targets.resize(grids.size());
+		coordinator = std::thread(&ProgressiveLoader::run, this, fn, n_threads, disp, disp_scale, grids, level_targets);
+	}
+
+	void ProgressiveLoader::run(std::string fn, int n_threads, cv::Mat disp, float disp_scale, std::vector<cv::Size> grids,
+		std::vector<Target> targets)
+	{
+		double t = wallTimeMs();
+		if (!fn.empty()) {
+			Mat in_dat, full_frame;
+			int factor = 1;
+			{
+				MemoryStage stage("decode");
+				decodeJpeg(fn, in_dat, n_threads);
+			}
+			bool ok = splitDepthLayout(in_dat, full_frame, disp, factor);
+			if (ok) {
+				printf("[progressive] %dx%d decoded in %.2f ms\n", in_dat.cols, in_dat.rows, wallTimeMs() - t);
+				if (factor > 1)
+					guide = full_frame;
+			}
+			else {
+				// nothing finer than the preview will come
+				printf("[progressive] decoding %s failed, the preview stays\n", fn.c_str());
+				n_finished = n_levels;
+			}
+			{
+				lock_guard<mutex> lock(mtx);
+				frame = full_frame;
+				frame_ready = true;
+			}
+			if (notify)
+				notify();
+			if (!ok)
+				return;
+			t = wallTimeMs();
+		}
+
+		if (!guide.empty() && disp.size() != guide.size()) {
+			MemoryStage stage("depth upsample");
+			Mat low = disp;
+			jointBilateralUpsample(low, guide, disp);
+			printf("[progressive] disparity %dx%d upsampled in %.2f ms\n", low.cols, low.rows, wallTimeMs() - t);
+		}
+		Mat full_depth = opencv::viewableDisp2Original(disp, disp_scale);
+		printf("[progressive] depth %dx%d converted in %.2f ms\n", full_depth.cols, full_depth.rows, wallTimeMs() - t);
+		{
+			lock_guard<mutex> lock(mtx);
+			depth = full_depth;
+			depth_ready = true;
+		}
+		if (notify)
+			notify();
+
+		// one worker per level, coarse levels finish first and get replaced by finer ones
+		vector<thread> workers;
+		for (int i = 0; i < (int)grids.size(); ++i) {
+			workers.push_back(thread([this, i, &grids, &targets, &full_depth]() {
+				Level level;
+				level.index = i;
+				double t0 = wallTimeMs();
+				if (targets[i].vertices) {
+					mesh::buildEquirectangular(full_depth, grids[i].width, grids[i].height, targets[i].vertices, targets[i].indices, tess,
+						cull_ratio);
+					level.mesh.n_cols = grids[i].width;
+					level.mesh.n_rows = grids[i].height;
+				}
+				else {
+					mesh::buildEquirectangular(full_depth, level.mesh, grids[i].width, grids[i].height, tess, cull_ratio);
+				}
+				level.ready_ms = wallTimeMs();
+				level.build_ms = level.ready_ms - t0;
+
+				{
+					lock_guard<mutex> lock(mtx);
+					if (i > pending_index && i > taken_index) {
+						pending = std::move(level);
+						pending_index = i;
+						has_pending = true;
+					}
+					++n_finished;
+				}
+				if (notify)
+					notify();
+			}));
+		}
+		for (auto &w : workers)
+			w.join();
+	}
+
+	bool ProgressiveLoader::takeLevel(Level &level)
+	{
+		lock_guard<mutex> lock(mtx);
+		if (!has_pending)
+			return false;
+
+		level = std::move(pending);
+		pending = Level();
+		taken_index = pending_index;
+		has_pending = false;
+		return true;
+	}
+
+	bool ProgressiveLoader::takeDepth(cv::Mat &out)
+	{
+		lock_guard<mutex> lock(mtx);
+		if (!depth_ready)
+			return false;
+
+		out = depth;
+		depth = Mat();
+		depth_ready = false;
+		return true;
+	}
+
+	bool ProgressiveLoader::takeFrame(cv::Mat &out)
+	{
+		lock_guard<mutex> lock(mtx);
+		if (!frame_ready)
+			return false;
+
+		out = frame;
+		frame = Mat();
+		frame_ready = false;
+		return true;
+	}
+
+	bool ProgressiveLoader::done()
+	{
+		lock_guard<mutex> lock(mtx);
+		return n_finished == n_levels && !has_pending;
+	}
+
+	void ProgressiveLoader::join()
+	{
+		if (coordinator.joinable())
+			coordinator.join();
+	}
+}
@@ -0,0 +1,89 @@
+/* Progressive loading: coarse preview first, finer meshes built in the background.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "opencv2/opencv.hpp"
+#include "utils/mesh.h"
+
+namespace kandao
+{
+	class ProgressiveLoader
+	{
+	public:
+		struct Level
+		{
+			int index = -1;			// position in the grids passed to start()
+			mesh::MeshData mesh;	// empty except n_cols / n_rows when built into a Target
+			double build_ms = 0;	// worker time spent on this level
+			double ready_ms = 0;	// wall clock when the level was published
+		};
+
+		ProgressiveLoader() {}
+		~ProgressiveLoader();
+
+		// coarse mesh and texture from a downscaled copy, cheap enough for the render thread
+		static void buildPreview(const cv::Mat &frame, const cv::Mat &disp, float disp_scale, cv::Size grid,
+			cv::Mat &preview_frame, cv::Mat &preview_depth, mesh::MeshData &preview_mesh,
+			mesh::Tessellation tess = mesh::TESS_GRID, float cull_ratio = 0);
+		// fn decoded at 1/8 scale (IMREAD_REDUCED_COLOR_8) and split like the full image, for buildPreview;
+		// disp is as stored, reduced disparity is not upsampled
+		static bool decodePreview(const std::string &fn, cv::Mat &frame, cv::Mat &disp);
+
+		// caller memory sized by mesh::countEquirectangular, e.g. a mapped arena range
+		struct Target
+		{
+			float *vertices = NULL;
+			unsigned int *indices = NULL;
+		};
+
+		// convert full resolution disparity and build each grid (coarse to fine) on worker threads,
+		// into targets[i] when given or into Level::mesh otherwise
+		void start(const cv::Mat &disp, float disp_scale, const std::vector<cv::Size> &grids,
+			const std::vector<Target> &targets = std::vector<Target>());
+		// the same, after decoding fn on the coordinator thread (decodeJpeg on n_threads); its color
+		// rows are handed over by takeFrame
+		void start(const std::string &fn, int n_threads, float disp_scale, const std::vector<cv::Size> &grids,
+			const std::vector<Target> &targets = std::vector<Target>());
+
+		// non-blocking, hand over the finest level finished since the last call
+		bool takeLevel(Level &level);
+		// non-blocking, hand over the full resolution depth once converted
+		bool takeDepth(cv::Mat &depth);
+		// non-blocking, hand over the decoded color once start(fn, ...) has it; empty when the decode failed
+		bool takeFrame(cv::Mat &frame);
+
+		// every level has been handed over
+		bool done();
+		void join();
+
+		// called from the worker threads whenever something new can be taken
+		std::function<void()> notify;
+		// mesh layout of every level, set before start
+		mesh::Tessellation tess = mesh::TESS_GRID;
+		// depth edge culling of every level, see mesh::buildEquirectangular
+		float cull_ratio = 0;
+		// color of the panorama when disp is stored at reduced resolution, it is then joint
+		// bilateral upsampled to this size before the conversion
+		cv::Mat guide;
+
+	private:
+		void launch(const std::string &fn, int n_threads, const cv::Mat &disp, float disp_scale,
+			const std::vector<cv::Size> &grids, const std::vector<Target> &targets);
+		void run(std::string fn, int n_threads, cv::Mat disp, float disp_scale, std::vector<cv::Size> grids,
+			std::vector<Target> targets);
+
+		std::thread coordinator;
+		std::mutex mtx;
+		cv::Mat depth, frame;
+		bool depth_ready = false, frame_ready = false;
+		Level pending;
+		bool has_pending = false;
+		int pending_index = -1, taken_index = -1, n_levels = 0;
+		std::atomic<int> n_finished{ 0 };
+	};
+}
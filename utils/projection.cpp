@@ -0,0 +1,99 @@
+/* Projection models of depth panoramas and a mesh builder specialized for each of them.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/projection.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao { namespace mesh
+{
+	static const char *projection_names[N_PROJECTIONS] = { "equirect", "cubemap", "fisheye", "cylindrical" };
+
+	const char* projectionName(Projection projection)
+	{
+		return projection >= 0 && projection < N_PROJECTIONS ? projection_names[projection] : "unknown";
+	}
+
+	bool parseProjection(const std::string &name, Projection &projection)
+	{
+		for (int i = 0; i < N_PROJECTIONS; ++i) {
+			if (name == projection_names[i]) {
+				projection = (Projection)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void countProjected(Projection projection, int n_cols, int n_rows, size_t &n_vertices, size_t &n_indices)
+	{
+		switch (projection) {
+		case PROJ_CUBEMAP: countProjectedGrid<CubemapProjection>(n_cols, n_rows, n_vertices, n_indices); break;
+		case PROJ_FISHEYE: countProjectedGrid<FisheyeProjection>(n_cols, n_rows, n_vertices, n_indices); break;
+		case PROJ_CYLINDRICAL: countProjectedGrid<CylindricalProjection>(n_cols, n_rows, n_vertices, n_indices); break;
+		default: countProjectedGrid<EquirectProjection>(n_cols, n_rows, n_vertices, n_indices); break;
+		}
+	}
+
+	void buildProjected(Projection projection, const cv::Mat &depth, int n_cols, int n_rows, float *vertices,
+		unsigned int *indices)
+	{
+		CV_Assert(depth.type() == CV_32F);
+		switch (projection) {
+		case PROJ_CUBEMAP: buildProjectedGrid<CubemapProjection>(depth, n_cols, n_rows, vertices, indices); break;
+		case PROJ_FISHEYE: buildProjectedGrid<FisheyeProjection>(depth, n_cols, n_rows, vertices, indices); break;
+		case PROJ_CYLINDRICAL: buildProjectedGrid<CylindricalProjection>(depth, n_cols, n_rows, vertices, indices); break;
+		default: buildProjectedGrid<EquirectProjection>(depth, n_cols, n_rows, vertices, indices); break;
+		}
+	}
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	void benchmarkProjections(int n_cols, int n_rows, int n_runs)
+	{
+		// a constant depth puts every vertex of a correct unprojection on the same sphere
+		const float radius = 2.f;
+		const int height = 1024;
+		vector<float> vertices;
+		vector<unsigned int> indices;
+
+		double equirect_ms = 0;
+		for (int p = 0; p < N_PROJECTIONS; ++p) {
+			Projection projection = (Projection)p;
+			int width = projection == PROJ_CUBEMAP ? height * 3 / 2 : height * 2;
+			Mat depth(height, width, CV_32F, Scalar(radius));
+
+			size_t n_vertices, n_indices;
+			countProjected(projection, n_cols, n_rows, n_vertices, n_indices);
+			vertices.resize(n_vertices * VERTEX_STRIDE);
+			indices.resize(n_indices);
+
+			double t = wallTimeMs();
+			for (int i = 0; i < n_runs; ++i)
+				buildProjected(projection, depth, n_cols, n_rows, vertices.data(), indices.data());
+			double ms = (wallTimeMs() - t) / n_runs;
+			if (projection == PROJ_EQUIRECT)
+				equirect_ms = ms;
+
+			float max_err = 0;
+			for (size_t i = 0; i < n_vertices; ++i) {
+				const float *v = &vertices[i * VERTEX_STRIDE];
+				max_err = max(max_err, fabs(sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]) - radius));
+			}
+			printf("[projection] %-11s %dx%d: %d vertices, %d triangles, %.2f ms (%.1f Mvert/s), ray length error %.2e\n",
+				projectionName(projection), width, height, (int)n_vertices, (int)n_indices / 3, ms,
+				n_vertices / max(ms, 1e-3) / 1000, max_err);
+		}
+
+		// the general equirectangular path, 4 vertices per quad, for reference
+		Mat depth(height, height * 2, CV_32F, Scalar(radius));
+		MeshData mesh;
+		double t = wallTimeMs();
+		for (int i = 0; i < n_runs; ++i)
+			buildEquirectangular(depth, mesh, n_cols, n_rows);
+		double ms = (wallTimeMs() - t) / n_runs;
+		printf("[projection] buildEquirectangular grid: %d vertices, %.2f ms, %.1fx the specialized equirect\n",
+			(int)mesh.numVertices(), ms, ms / max(equirect_ms, 1e-3));
+	}
+} }
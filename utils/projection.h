@@ -0,0 +1,217 @@
+/* Projection models of depth panoramas and a mesh builder specialized for each of them.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include "opencv2/opencv.hpp"
+#include "utils/mesh.h"
+
+namespace kandao { namespace mesh
+{
+	// A projection policy is stateless and describes, at compile time, how its faces are laid
+	// out in the image and how a face point becomes a ray:
+	//   FACE_COLS, FACE_ROWS, N_FACES   faces in a FACE_COLS x FACE_ROWS layout, row major
+	//   WRAP_U                          the image wraps around horizontally (no face clamping)
+	//   face(f)                         per-face frame, looked up once outside the vertex loop
+	//   direction(face, s, t, dir)      unit ray in OpenGL coordinates through face point (s, t)
+	//                                   in [0, 1]^2, t going down the image
+	// Depth is the distance along that ray, as for the equirectangular panoramas.
+	struct ProjectionFace
+	{
+		float forward[3], right[3], up[3];
+	};
+
+	///////////////////////////////////// policies /////////////////////////////////////
+	struct EquirectProjection
+	{
+		static const int FACE_COLS = 1, FACE_ROWS = 1, N_FACES = 1;
+		static const bool WRAP_U = true;
+
+		static ProjectionFace face(int) { return ProjectionFace(); }
+
+		static inline void direction(const ProjectionFace &, float s, float t, float *dir)
+		{
+			float u = s * CV_PI * 2.f - CV_PI;
+			float v = t * CV_PI;
+			float sinv = sinf(v);
+			dir[0] = sinv * sinf(u);
+			dir[1] = cosf(v);
+			dir[2] = -(sinv * cosf(u));
+		}
+	};
+
+	// full turn around the vertical axis, flat projection vertically over +-HALF_HEIGHT,
+	// i.e. +-45 degrees
+	struct CylindricalProjection
+	{
+		static const int FACE_COLS = 1, FACE_ROWS = 1, N_FACES = 1;
+		static const bool WRAP_U = true;
+		static constexpr float HALF_HEIGHT = 1.f;
+
+		static ProjectionFace face(int) { return ProjectionFace(); }
+
+		static inline void direction(const ProjectionFace &, float s, float t, float *dir)
+		{
+			float u = s * CV_PI * 2.f - CV_PI;
+			float h = (1.f - 2.f * t) * HALF_HEIGHT;
+			float inv = 1.f / sqrtf(1.f + h * h);
+			dir[0] = sinf(u) * inv;
+			dir[1] = h * inv;
+			dir[2] = -cosf(u) * inv;
+		}
+	};
+
+	// 3x2 faces seen from the center: +X -X +Y on top, -Y +Z -Z below. Side faces have +Y up,
+	// the top and bottom faces have the forward view (-Z) towards the bottom and top edge.
+	struct CubemapProjection
+	{
+		static const int FACE_COLS = 3, FACE_ROWS = 2, N_FACES = 6;
+		static const bool WRAP_U = false;
+
+		static ProjectionFace face(int f)
+		{
+			static const ProjectionFace faces[N_FACES] = {
+				{ { 1, 0, 0 }, { 0, 0, 1 }, { 0, 1, 0 } },		// +X
+				{ { -1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } },	// -X
+				{ { 0, 1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },		// +Y
+				{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, -1 } },	// -Y
+				{ { 0, 0, 1 }, { -1, 0, 0 }, { 0, 1, 0 } },		// +Z
+				{ { 0, 0, -1 }, { 1, 0, 0 }, { 0, 1, 0 } },		// -Z
+			};
+			return faces[f];
+		}
+
+		static inline void direction(const ProjectionFace &face, float s, float t, float *dir)
+		{
+			float a = 2.f * s - 1.f, b = 1.f - 2.f * t;
+			float x = face.forward[0] + a * face.right[0] + b * face.up[0];
+			float y = face.forward[1] + a * face.right[1] + b * face.up[1];
+			float z = face.forward[2] + a * face.right[2] + b * face.up[2];
+			float inv = 1.f / sqrtf(x * x + y * y + z * z);
+			dir[0] = x * inv;
+			dir[1] = y * inv;
+			dir[2] = z * inv;
+		}
+	};
+
+	// dual equidistant fisheye, front lens (-Z) on the left, back lens on the right, FOV each;
+	// points outside the image circle are pulled onto its rim
+	struct FisheyeProjection
+	{
+		static const int FACE_COLS = 2, FACE_ROWS = 1, N_FACES = 2;
+		static const bool WRAP_U = false;
+		static constexpr float FOV = 180.f;
+
+		static ProjectionFace face(int f)
+		{
+			static const ProjectionFace faces[N_FACES] = {
+				{ { 0, 0, -1 }, { 1, 0, 0 }, { 0, 1, 0 } },
+				{ { 0, 0, 1 }, { -1, 0, 0 }, { 0, 1, 0 } },
+			};
+			return faces[f];
+		}
+
+		static inline void direction(const ProjectionFace &face, float s, float t, float *dir)
+		{
+			float a = 2.f * s - 1.f, b = 1.f - 2.f * t;
+			float r = sqrtf(a * a + b * b);
+			float theta = std::min(r, 1.f) * (float)(FOV / 360.f * CV_PI);
+			// the tiny bias keeps the center, r = 0, away from 0 / 0 without a branch
+			float k = sinf(theta) / (r + 1e-20f), c = cosf(theta);
+			for (int i = 0; i < 3; ++i)
+				dir[i] = c * face.forward[i] + k * (a * face.right[i] + b * face.up[i]);
+		}
+	};
+
+	///////////////////////////////////// builder /////////////////////////////////////
+	// vertices per face side for a whole-image grid of n_cols x n_rows
+	template <class Projection>
+	void faceGrid(int n_cols, int n_rows, int &face_cols, int &face_rows)
+	{
+		face_cols = std::max(2, n_cols / Projection::FACE_COLS);
+		face_rows = std::max(2, n_rows / Projection::FACE_ROWS);
+	}
+
+	template <class Projection>
+	void countProjectedGrid(int n_cols, int n_rows, size_t &n_vertices, size_t &n_indices)
+	{
+		int fc, fr;
+		faceGrid<Projection>(n_cols, n_rows, fc, fr);
+		n_vertices = size_t(fc) * fr * Projection::N_FACES;
+		n_indices = size_t(fc - 1) * (fr - 1) * 6 * Projection::N_FACES;
+	}
+
+	// shared-vertex grid on every face, depth sampled at the nearest pixel of the same face and
+	// texture coordinates into the same image, so the color half needs no resampling either
+	template <class Projection>
+	void buildProjectedGrid(const cv::Mat &depth, int n_cols, int n_rows, float *vertices, unsigned int *indices)
+	{
+		int fc, fr;
+		faceGrid<Projection>(n_cols, n_rows, fc, fr);
+		const int width = depth.cols, height = depth.rows;
+		const float face_w = float(width) / Projection::FACE_COLS, face_h = float(height) / Projection::FACE_ROWS;
+
+		unsigned int base = 0;
+		for (int f = 0; f < Projection::N_FACES; ++f) {
+			const ProjectionFace face = Projection::face(f);
+			const int col = f % Projection::FACE_COLS, row = f / Projection::FACE_COLS;
+			const float fx0 = col * face_w, fy0 = row * face_h;
+			const int x_end = (col + 1) * width / Projection::FACE_COLS, y_end = (row + 1) * height / Projection::FACE_ROWS;
+
+			for (int i = 0; i < fr; ++i) {
+				float t = float(i) / (fr - 1), y = fy0 + t * face_h;
+				const float *src = depth.ptr<float>(std::min((int)y, y_end - 1));
+				for (int j = 0; j < fc; ++j) {
+					float s = float(j) / (fc - 1), x = fx0 + s * face_w;
+					int xi = Projection::WRAP_U ? (int)x % width : std::min((int)x, x_end - 1);
+					float d = src[xi], dir[3];
+					Projection::direction(face, s, t, dir);
+					vertices[0] = dir[0] * d;
+					vertices[1] = dir[1] * d;
+					vertices[2] = dir[2] * d;
+					vertices[3] = x / width;
+					vertices[4] = y / height;
+					vertices += VERTEX_STRIDE;
+				}
+			}
+
+			// same winding as the equirectangular grid
+			for (int i = 0; i < fr - 1; ++i) {
+				for (int j = 0; j < fc - 1; ++j) {
+					unsigned int k0 = base + i * fc + j, k1 = k0 + 1, k2 = k1 + fc, k3 = k0 + fc;
+					indices[0] = k0;
+					indices[1] = k1;
+					indices[2] = k3;
+					indices[3] = k1;
+					indices[4] = k2;
+					indices[5] = k3;
+					indices += 6;
+				}
+			}
+			base += fc * fr;
+		}
+	}
+
+	///////////////////////////////////// runtime selection /////////////////////////////////////
+	enum Projection
+	{
+		PROJ_EQUIRECT,
+		PROJ_CUBEMAP,
+		PROJ_FISHEYE,
+		PROJ_CYLINDRICAL,
+		N_PROJECTIONS,
+	};
+
+	const char* projectionName(Projection projection);
+	bool parseProjection(const std::string &name, Projection &projection);
+
+	// one switch per mesh, the vertex loops are the specialized templates
+	void countProjected(Projection projection, int n_cols, int n_rows, size_t &n_vertices, size_t &n_indices);
+	void buildProjected(Projection projection, const cv::Mat &depth, int n_cols, int n_rows, float *vertices,
+		unsigned int *indices);
+
+	// build time per projection on synthetic depth with the layout's aspect, plus the ray length
+	// error against the known depth as a check of every unprojection
+	void benchmarkProjections(int n_cols, int n_rows, int n_runs = 5);
+} }
@@ -0,0 +1,68 @@
+/* Min/max depth mip pyramid over an equirectangular depth panorama.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cfloat>
+#include "utils/pyramid.h"
+#include "utils/memory.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	static void reduceMinMax(const Mat &fine, Mat &coarse)
+	{
+		int fw = fine.cols, fh = fine.rows;
+		int cw = max(fw / 2, 1), ch = max(fh / 2, 1);
+		coarse.create(ch, cw, CV_32FC2);
+
+		for (int i = 0; i < ch; ++i) {
+			// finer rows overlapping [i / ch, (i + 1) / ch)
+			int y0 = i * fh / ch, y1 = ((i + 1) * fh + ch - 1) / ch;
+			Vec2f *dst = coarse.ptr<Vec2f>(i);
+			for (int j = 0; j < cw; ++j) {
+				int x0 = j * fw / cw, x1 = ((j + 1) * fw + cw - 1) / cw;
+				float lo = FLT_MAX, hi = -FLT_MAX;
+				for (int y = y0; y < y1; ++y) {
+					const Vec2f *src = fine.ptr<Vec2f>(y);
+					for (int x = x0; x < x1; ++x) {
+						lo = min(lo, src[x][0]);
+						hi = max(hi, src[x][1]);
+					}
+				}
+				dst[j] = Vec2f(lo, hi);
+			}
+		}
+	}
+
+	void DepthPyramid::build(const cv::Mat &depth, int min_size)
+	{
+		levels.clear();
+		if (depth.empty())
+			return;
+		MemoryStage stage("depth pyramid");
+
+		Mat base(depth.size(), CV_32FC2);
+		for (int i = 0; i < depth.rows; ++i) {
+			const float *src = depth.ptr<float>(i);
+			Vec2f *dst = base.ptr<Vec2f>(i);
+			for (int j = 0; j < depth.cols; ++j)
+				dst[j] = Vec2f(src[j], src[j]);
+		}
+		levels.push_back(base);
+
+		while (levels.back().cols > min_size || levels.back().rows > min_size) {
+			Mat coarse;
+			reduceMinMax(levels.back(), coarse);
+			levels.push_back(coarse);
+		}
+	}
+
+	size_t DepthPyramid::bytes() const
+	{
+		size_t total = 0;
+		for (const Mat &level : levels)
+			total += level.total() * level.elemSize();
+		return total;
+	}
+}
@@ -0,0 +1,28 @@
+/* Min/max depth mip pyramid over an equirectangular depth panorama.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include "opencv2/opencv.hpp"
+
+namespace kandao
+{
+	// levels[0] holds (depth, depth), every coarser level halves the size like GL mipmaps
+	// (rounding down) and keeps the (min, max) of all finer texels its uv footprint overlaps,
+	// so a coarse texel is always a conservative bound of the region it covers.
+	class DepthPyramid
+	{
+	public:
+		void build(const cv::Mat &depth, int min_size = 1);
+
+		int numLevels() const { return levels.size(); }
+		const cv::Mat& level(int i) const { return levels[i]; }
+		bool empty() const { return levels.empty(); }
+		size_t bytes() const;
+
+		// bounds of the whole panorama
+		float minDepth() const { return levels.back().at<cv::Vec2f>(0, 0)[0]; }
+		float maxDepth() const { return levels.back().at<cv::Vec2f>(0, 0)[1]; }
+
+		std::vector<cv::Mat> levels;	// CV_32FC2
+	};
+}
@@ -0,0 +1,263 @@
+/* Ray and pick queries against the depth panorama, CPU side of the ray-marched renderer.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/raycast.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	///////////////////////////////////// pyramid traversal /////////////////////////////////////
+	// inverse of the mesh unprojection, u = 0.5 looks down -z
+	static Vec2f dirToUV(const Vec3f &d)
+	{
+		float u = atan2f(d[0], -d[2]);
+		float v = acosf(min(max(d[1], -1.f), 1.f));
+		return Vec2f(u / (2.f * CV_PI) + 0.5f, v / CV_PI);
+	}
+
+	void DepthRaycaster::build(const cv::Mat &depth)
+	{
+		pyramid.build(depth);
+	}
+
+	Vec2f DepthRaycaster::fetch(const Vec2f &uv, int level) const
+	{
+		const Mat &m = pyramid.level(level);
+		int x = min(max((int)(uv[0] * m.cols), 0), m.cols - 1);
+		int y = min(max((int)(uv[1] * m.rows), 0), m.rows - 1);
+		return m.ptr<Vec2f>(y)[x];
+	}
+
+	bool DepthRaycaster::intersect(const cv::Vec3f &origin, const cv::Vec3f &direction, RayHit &hit, float t_max) const
+	{
+		hit = RayHit();
+		if (empty())
+			return false;
+
+		Vec3f dir = normalize(direction);
+		int n_levels = pyramid.numLevels();
+		float bound_min = pyramid.minDepth(), bound_max = pyramid.maxDepth();
+		float t_far = min(t_max, (float)norm(origin) + bound_max);
+		float texel_angle = CV_PI / pyramid.level(0).rows;
+		int level = max(n_levels - 4, 0);
+		float t = 0.f, t_prev = 0.f;
+
+		// an origin on or beyond the surface looks for where the ray enters the shell instead of
+		// where it leaves: the same traversal with the roles of min and max swapped
+		float rho0 = norm(origin);
+		bool outside = rho0 >= fetch(dirToUV(origin / max(rho0, 1e-6f)), 0)[0];
+		auto crossed = [&](float rho, float depth) { return outside ? rho < depth : rho >= depth; };
+
+		for (int i = 0; i < max_steps && t <= t_far; ++i) {
+			Vec3f p = origin + t * dir;
+			float rho = norm(p);
+			Vec2f uv = dirToUV(p / max(rho, 1e-6f));
+			Vec2f mm = fetch(uv, level);
+			++hit.steps;
+
+			// may cross somewhere in this cell: refine, straight to the finest level when every
+			// depth of the cell is already crossed
+			if (crossed(rho, outside ? mm[1] : mm[0])) {
+				if (level == 0) {
+					hit.hit = true;
+					break;
+				}
+				level = crossed(rho, outside ? mm[0] : mm[1]) ? 0 : level - 1;
+				continue;
+			}
+
+			// lower bound of the distance to the surface, see raymarch_equi_fs
+			const Mat &m = pyramid.level(level);
+			float fx = uv[0] * m.cols, fy = uv[1] * m.rows;
+			fx -= floorf(fx);
+			fy -= floorf(fy);
+			float border_x = min(fx, 1.f - fx) / m.cols, border_y = min(fy, 1.f - fy) / m.rows;
+			float sin_theta = sinf(uv[1] * CV_PI);
+			float beta = min(border_y * (float)CV_PI,
+				asinf(min(1.f, sinf(min(border_x * 2.f * (float)CV_PI, 0.5f * (float)CV_PI)) * sin_theta)));
+			float gap = outside ? rho - mm[1] : mm[0] - rho;
+			float bound_gap = outside ? rho - bound_max : bound_min - rho;
+			float safe = max(bound_gap, min(gap, rho * sinf(beta)));
+
+			t_prev = t;
+			t += max(safe, 0.5f * texel_angle * max(rho, bound_min));
+			if (safe > 0.05f * (1.f + t) && level < n_levels - 1)
+				level += 1;
+		}
+
+		if (!hit.hit || t > t_far)
+			return hit.hit = false;
+
+		// refine the crossing between the last safe point and the hit
+		for (int i = 0; i < 8; ++i) {
+			float t_mid = 0.5f * (t_prev + t);
+			Vec3f p = origin + t_mid * dir;
+			float rho = norm(p);
+			if (crossed(rho, fetch(dirToUV(p / max(rho, 1e-6f)), 0)[0]))
+				t = t_mid;
+			else
+				t_prev = t_mid;
+		}
+
+		hit.t = t;
+		hit.point = origin + t * dir;
+		hit.uv = dirToUV(normalize(hit.point));
+		return true;
+	}
+
+	class RaycastBody : public ParallelLoopBody
+	{
+	public:
+		RaycastBody(const DepthRaycaster &caster, const vector<Vec3f> &origins, const vector<Vec3f> &dirs,
+			vector<RayHit> &hits, float t_max)
+			: caster(caster), origins(origins), dirs(dirs), hits(hits), t_max(t_max) {}
+
+		void operator()(const Range &range) const
+		{
+			for (int i = range.start; i < range.end; ++i)
+				caster.intersect(origins[i], dirs[i], hits[i], t_max);
+		}
+
+	private:
+		const DepthRaycaster &caster;
+		const vector<Vec3f> &origins, &dirs;
+		vector<RayHit> &hits;
+		float t_max;
+	};
+
+	void DepthRaycaster::intersect(const std::vector<cv::Vec3f> &origins, const std::vector<cv::Vec3f> &dirs,
+		std::vector<RayHit> &hits, float t_max) const
+	{
+		CV_Assert(origins.size() == dirs.size());
+		hits.resize(origins.size());
+		// a few hundred rays per stripe keeps scheduling overhead negligible
+		parallel_for_(Range(0, (int)origins.size()), RaycastBody(*this, origins, dirs, hits, t_max),
+			max(1., origins.size() / 256.));
+	}
+
+	bool DepthRaycaster::blocked(const cv::Vec3f &from, const cv::Vec3f &to, float margin) const
+	{
+		Vec3f d = to - from;
+		float len = norm(d);
+		if (len <= 0.f)
+			return false;
+		RayHit hit;
+		return intersect(from, d, hit, len + margin);
+	}
+
+	///////////////////////////////////// brute force /////////////////////////////////////
+	// Moller-Trumbore, both sides count
+	static bool intersectTriangle(const Vec3f &o, const Vec3f &d, const float *a, const float *b, const float *c,
+		float &t)
+	{
+		Vec3f v0(a[0], a[1], a[2]);
+		Vec3f e1 = Vec3f(b[0], b[1], b[2]) - v0, e2 = Vec3f(c[0], c[1], c[2]) - v0;
+		Vec3f p = d.cross(e2);
+		float det = e1.dot(p);
+		if (fabsf(det) < 1e-12f)
+			return false;
+		float inv = 1.f / det;
+		Vec3f s = o - v0;
+		float u = s.dot(p) * inv;
+		if (u < 0.f || u > 1.f)
+			return false;
+		Vec3f q = s.cross(e1);
+		float v = d.dot(q) * inv;
+		if (v < 0.f || u + v > 1.f)
+			return false;
+		t = e2.dot(q) * inv;
+		return t > 0.f;
+	}
+
+	bool intersectMesh(const mesh::MeshData &mesh, const cv::Vec3f &origin, const cv::Vec3f &direction, RayHit &hit)
+	{
+		hit = RayHit();
+		Vec3f dir = normalize(direction);
+		const float *v = mesh.vertices.data();
+		const unsigned int *idx = mesh.indices.data();
+		float best = FLT_MAX;
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			float t;
+			if (intersectTriangle(origin, dir, v + idx[i] * mesh::VERTEX_STRIDE, v + idx[i + 1] * mesh::VERTEX_STRIDE,
+				v + idx[i + 2] * mesh::VERTEX_STRIDE, t) && t < best)
+				best = t;
+			++hit.steps;
+		}
+
+		if (best == FLT_MAX)
+			return false;
+		hit.hit = true;
+		hit.t = best;
+		hit.point = origin + best * dir;
+		hit.uv = dirToUV(normalize(hit.point));
+		return true;
+	}
+
+	///////////////////////////////////// benchmark /////////////////////////////////////
+	void benchmarkRaycast(const cv::Mat &depth, const mesh::MeshData &mesh, int n_rays, float offset)
+	{
+		RNG rng(0x2018);
+		vector<Vec3f> origins(n_rays), dirs(n_rays);
+		for (int i = 0; i < n_rays; ++i) {
+			Vec3f o;
+			do {
+				o = Vec3f(rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f));
+			} while (norm(o) > 1.f);
+			Vec3f d;
+			do {
+				d = Vec3f(rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f), rng.uniform(-1.f, 1.f));
+			} while (norm(d) > 1.f || norm(d) < 1e-3f);
+			origins[i] = o * offset;
+			dirs[i] = d;
+		}
+
+		DepthRaycaster caster;
+		double t = wallTimeMs();
+		caster.build(depth);
+		double build_ms = wallTimeMs() - t;
+
+		vector<RayHit> hits;
+		t = wallTimeMs();
+		caster.intersect(origins, dirs, hits);
+		double batch_ms = wallTimeMs() - t;
+
+		t = wallTimeMs();
+		for (int i = 0; i < n_rays; ++i)
+			caster.intersect(origins[i], dirs[i], hits[i]);
+		double single_ms = wallTimeMs() - t;
+
+		// brute force is slow enough to only run a subset
+		int n_brute = min(n_rays, 32);
+		int n_agree = 0, n_both = 0;
+		double sum_err = 0, steps = 0;
+		t = wallTimeMs();
+		for (int i = 0; i < n_brute; ++i) {
+			RayHit ref;
+			intersectMesh(mesh, origins[i], dirs[i], ref);
+			if (ref.hit && hits[i].hit) {
+				float err = fabsf(ref.t - hits[i].t) / ref.t;
+				sum_err += err;
+				++n_both;
+				n_agree += err < 0.02f;
+			}
+			else if (ref.hit == hits[i].hit) {
+				++n_agree;
+			}
+		}
+		double brute_ms = wallTimeMs() - t;
+		for (const RayHit &hit : hits)
+			steps += hit.steps;
+
+		printf("[raycast] pyramid %dx%d, %d levels, built in %.2f ms\n", depth.cols, depth.rows,
+			caster.depthPyramid().numLevels(), build_ms);
+		printf("[raycast] %d rays: batch %.3f ms (%.2f us/ray), serial %.2f us/ray, %.1f fetches/ray\n", n_rays,
+			batch_ms, batch_ms * 1000. / n_rays, single_ms * 1000. / n_rays, steps / n_rays);
+		printf("[raycast] brute force over %zu triangles: %.2f ms/ray, %.0fx slower than the pyramid\n",
+			mesh.indices.size() / 3, brute_ms / n_brute, (brute_ms / n_brute) / (single_ms / n_rays));
+		printf("[raycast] %d/%d rays agree, mean depth difference %.3f%%\n", n_agree, n_brute,
+			n_both ? 100. * sum_err / n_both : 0.);
+	}
+}
@@ -0,0 +1,57 @@
+/* Ray and pick queries against the depth panorama, CPU side of the ray-marched renderer.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <cfloat>
+#include "opencv2/opencv.hpp"
+#include "utils/mesh.h"
+#include "utils/pyramid.h"
+
+namespace kandao
+{
+	struct RayHit
+	{
+		bool hit = false;
+		float t = 0;			// distance along the normalized direction
+		cv::Vec3f point;		// OpenGL coordinates, same space as the mesh
+		cv::Vec2f uv;			// texture coordinates of the hit
+		int steps = 0;			// pyramid fetches, for statistics
+	};
+
+	// Same traversal as raymarch_equi_fs: sphere tracing through the min/max pyramid, coarse
+	// levels skip empty space, so one query costs O(log size) fetches instead of one test per
+	// triangle. The surface is the radial depth around the center: from an origin inside it the
+	// hit is where the ray leaves, from one on or beyond it where the ray first enters.
+	class DepthRaycaster
+	{
+	public:
+		void build(const cv::Mat &depth);
+		// share a pyramid built for the renderer, levels are reference counted
+		void setPyramid(const DepthPyramid &pyramid) { this->pyramid = pyramid; }
+		bool empty() const { return pyramid.empty(); }
+		const DepthPyramid& depthPyramid() const { return pyramid; }
+
+		// dir need not be normalized, t is measured in world units
+		bool intersect(const cv::Vec3f &origin, const cv::Vec3f &dir, RayHit &hit, float t_max = FLT_MAX) const;
+		// thousands of rays per frame, spread over cv::parallel_for_
+		void intersect(const std::vector<cv::Vec3f> &origins, const std::vector<cv::Vec3f> &dirs,
+			std::vector<RayHit> &hits, float t_max = FLT_MAX) const;
+
+		// collision check for moving from one point to the other: is the surface hit before to, or
+		// less than margin past it along the same line; there is no sideways clearance test
+		bool blocked(const cv::Vec3f &from, const cv::Vec3f &to, float margin = 0.f) const;
+
+		int max_steps = 256;
+
+	private:
+		cv::Vec2f fetch(const cv::Vec2f &uv, int level) const;
+
+		DepthPyramid pyramid;
+	};
+
+	// reference by brute force over every triangle of the mesh
+	bool intersectMesh(const mesh::MeshData &mesh, const cv::Vec3f &origin, const cv::Vec3f &dir, RayHit &hit);
+
+	// n_rays random rays from points up to offset away from the center, pyramid against brute force
+	void benchmarkRaycast(const cv::Mat &depth, const mesh::MeshData &mesh, int n_rays = 256, float offset = 0.5f);
+}
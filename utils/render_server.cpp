@@ -0,0 +1,290 @@
+/* Rendering server: many viewer sessions over one set of panorama GL objects.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include "utils/render_server.h"
+#include "utils/timer.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao { namespace OpenGL
+{
+	///////////////////////////////////// RenderSession /////////////////////////////////////
+	RenderSession::RenderSession(int id, int width, int height)
+		: id(id), width(width), height(height), rng(0x9e3779b9u * (id + 1))
+	{
+		// every user starts at the capture point looking somewhere else
+		view.camera.setPosition(0.f, 0.f, 0.f);
+		view.camera.setOrientation(rng.uniform(-180.f, 180.f), 0.f);
+	}
+
+	void RenderSession::simulateInput(float dt)
+	{
+		view.deltaTime = dt;
+		next_change -= dt;
+		if (next_change <= 0) {
+			// a new drag every 0.5 to 2 s, mostly sideways; sometimes a short walk or a zoom
+			look_x = rng.uniform(-400.f, 400.f);
+			look_y = rng.uniform(-100.f, 100.f);
+			float r = rng.uniform(0.f, 1.f);
+			if (r < 0.2f) {
+				walk = (Camera_Movement)rng.uniform(0, 4);
+				walk_s = 0.3f;
+			}
+			else if (r < 0.3f) {
+				zoom_s = 0.5f;
+			}
+			next_change = rng.uniform(0.5f, 2.f);
+		}
+
+		float xoffset, yoffset;
+		cursor_x += look_x * dt;
+		cursor_y += look_y * dt;
+		view.cursorOffset(cursor_x, cursor_y, xoffset, yoffset);
+		view.applyMouse(xoffset, yoffset);
+		if (walk_s > 0) {
+			view.move(walk);
+			walk_s -= dt;
+		}
+		if (zoom_s > 0) {
+			// in while the look goes right, out while it goes left
+			view.camera.ProcessMouseScroll(look_x > 0 ? 20 * dt : -20 * dt);
+			zoom_s -= dt;
+		}
+
+		// the mesh only looks right from near the capture point
+		if (glm::length(view.camera.Position) > 1.f)
+			view.camera.setPosition(0.f, 0.f, 0.f);
+	}
+
+	///////////////////////////////////// RenderServer /////////////////////////////////////
+	RenderServer::RenderServer(GLFWwindow *share, const SharedScene &scene, int n_workers, double max_fps,
+		bool readback)
+		: scene(scene), max_fps(max_fps), readback(readback), stopping(false), last_report(wallTimeMs())
+	{
+		// other contexts only see uploads that completed
+		glFinish();
+
+		glfwWindowHint(GLFW_SAMPLES, 0);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		for (int i = 0; i < n_workers; ++i) {
+			GLFWwindow *window = glfwCreateWindow(16, 16, "", NULL, share);
+			if (!window) {
+				printf("[server] cannot create a context sharing with the viewer, %d workers\n", i);
+				break;
+			}
+			workers.push_back(unique_ptr<Worker>(new Worker()));
+			workers.back()->window = window;
+		}
+		for (auto &worker : workers)
+			worker->thread = thread(&RenderServer::run, this, ref(*worker));
+	}
+
+	RenderServer::~RenderServer()
+	{
+		stop();
+	}
+
+	int RenderServer::addSession(int width, int height)
+	{
+		lock_guard<mutex> lock(mtx);
+		if (workers.empty())
+			return -1;
+		Worker *least = NULL;
+		for (auto &worker : workers) {
+			if (!least || worker->sessions.size() + worker->pending.size() < least->sessions.size() + least->pending.size())
+				least = worker.get();
+		}
+		least->pending.push_back(unique_ptr<RenderSession>(new RenderSession(n_sessions, width, height)));
+		return n_sessions++;
+	}
+
+	int RenderServer::numSessions() const
+	{
+		lock_guard<mutex> lock(mtx);
+		return n_sessions;
+	}
+
+	void RenderServer::draw(RenderSession &session, GLuint vao, Shader &shader)
+	{
+		session.target.resize(session.width, session.height, 0);
+		session.target.bind();
+		glEnable(GL_DEPTH_TEST);
+		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		shader.use();
+		Camera &camera = session.view.camera;
+		float aspect = (float)session.width / (float)session.height;
+		shader.setMat4("projection", glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f));
+		shader.setMat4("view", camera.GetViewMatrix());
+		shader.setMat4("model", glm::mat4(1.f));
+
+		glBindTexture(GL_TEXTURE_2D, scene.tex_frame);
+		glBindVertexArray(vao);
+		glDrawElements(GL_TRIANGLES, scene.n_indices, GL_UNSIGNED_INT, (void*)scene.index_offset);
+		glBindVertexArray(0);
+		camera.ConsumeDirty();
+	}
+
+	void RenderServer::run(Worker &worker)
+	{
+		glfwMakeContextCurrent(worker.window);
+
+		// VAOs are not shared, this one reads the shared buffers
+		GLuint vao;
+		const size_t stride = 5 * sizeof(float);
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, scene.VBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene.EBO);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)(scene.vertex_offset));
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(scene.vertex_offset + 3 * sizeof(float)));
+		glEnableVertexAttribArray(1);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		// the matrices of this worker's sessions must not land in another worker's program
+		Shader shader;
+		if (!shader.loadShadersFromString(scene.vertex_shader, scene.fragment_shader))
+			printf("[server] worker program failed to link, its sessions stay blank\n");
+
+		double last = wallTimeMs();
+		while (!stopping) {
+			double t0 = wallTimeMs();
+			{
+				lock_guard<mutex> lock(mtx);
+				for (auto &session : worker.pending) {
+					worker.sessions.push_back(move(session));
+					worker.frames.push_back(0);
+				}
+				worker.pending.clear();
+			}
+			if (worker.sessions.empty()) {
+				this_thread::sleep_for(chrono::milliseconds(5));
+				last = wallTimeMs();
+				continue;
+			}
+
+			float dt = (float)(t0 - last) / 1000.f;
+			last = t0;
+			for (auto &session : worker.sessions) {
+				session->simulateInput(dt);
+				draw(*session, vao, shader);
+			}
+			// the first readback waits for the whole round, the others find their pixels ready
+			if (readback) {
+				for (auto &session : worker.sessions) {
+					glBindFramebuffer(GL_READ_FRAMEBUFFER, session->target.resolve());
+					session->pixels.create(session->height, session->width, CV_8UC4);
+					glReadPixels(0, 0, session->width, session->height, GL_BGRA, GL_UNSIGNED_BYTE, session->pixels.data);
+				}
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			}
+			else {
+				glFinish();
+			}
+
+			double round_ms = wallTimeMs() - t0;
+			{
+				lock_guard<mutex> lock(mtx);
+				for (int &n : worker.frames)
+					++n;
+				worker.round_ms += round_ms;
+				++worker.n_rounds;
+			}
+			if (max_fps > 0) {
+				double wait_ms = 1000. / max_fps - (wallTimeMs() - t0);
+				if (wait_ms > 0)
+					this_thread::sleep_for(chrono::microseconds((long long)(wait_ms * 1000)));
+			}
+		}
+
+		// pending sessions never got a target
+		for (auto &session : worker.sessions)
+			session->target.release();
+		glDeleteVertexArrays(1, &vao);
+		glDeleteProgram(shader.ID);
+		glfwMakeContextCurrent(NULL);
+	}
+
+	RenderServer::Stats RenderServer::report()
+	{
+		Stats stats;
+		double now = wallTimeMs();
+		double secs = max(now - last_report, 1.) / 1000;
+		last_report = now;
+
+		string line;
+		lock_guard<mutex> lock(mtx);
+		for (int w = 0; w < (int)workers.size(); ++w) {
+			Worker &worker = *workers[w];
+			for (int i = 0; i < (int)worker.frames.size(); ++i) {
+				const RenderSession &session = *worker.sessions[i];
+				double fps = worker.frames[i] / secs;
+				stats.slowest_fps = stats.n_sessions ? min(stats.slowest_fps, fps) : fps;
+				stats.fastest_fps = max(stats.fastest_fps, fps);
+				stats.total_fps += fps;
+				stats.mpixels += fps * session.width * session.height / 1e6;
+				++stats.n_sessions;
+				line += format(" %d:%.1f", session.id, fps);
+				worker.frames[i] = 0;
+			}
+			if (worker.n_rounds)
+				printf("[server] worker %d: %d sessions, %.2f ms per round\n", w, (int)worker.sessions.size(),
+					worker.round_ms / worker.n_rounds);
+			worker.round_ms = 0;
+			worker.n_rounds = 0;
+		}
+		printf("[server] fps per session%s\n", line.c_str());
+		printf("[server] %d sessions: %.1f frames/s total, %.1f Mpixel/s, slowest %.1f fps, fastest %.1f fps\n",
+			stats.n_sessions, stats.total_fps, stats.mpixels, stats.slowest_fps, stats.fastest_fps);
+		return stats;
+	}
+
+	void RenderServer::stop()
+	{
+		if (stopping.exchange(true))
+			return;
+		for (auto &worker : workers) {
+			if (worker->thread.joinable())
+				worker->thread.join();
+			glfwDestroyWindow(worker->window);
+		}
+		workers.clear();
+	}
+
+	///////////////////////////////////// load test /////////////////////////////////////
+	void benchmarkSessions(GLFWwindow *share, const SharedScene &scene, int n_sessions, int n_workers, int width,
+		int height, double step_s, double max_fps)
+	{
+		RenderServer server(share, scene, n_workers, max_fps);
+		vector<RenderServer::Stats> steps;
+		for (int i = 0; i < n_sessions; ++i) {
+			if (server.addSession(width, height) < 0)
+				return;
+			// let the newcomer settle in, then measure a full step
+			this_thread::sleep_for(chrono::milliseconds((int)(step_s * 250)));
+			server.report();
+			this_thread::sleep_for(chrono::milliseconds((int)(step_s * 1000)));
+			steps.push_back(server.report());
+		}
+		server.stop();
+
+		printf("[server] %dx%d sessions on %d workers%s:\n", width, height, n_workers,
+			max_fps > 0 ? format(", at most %.0f fps each", max_fps).c_str() : "");
+		for (const RenderServer::Stats &s : steps)
+			printf("[server]   %2d sessions: %7.1f frames/s, %6.1f Mpixel/s, %5.1f fps per session (slowest %.1f), "
+				"%.2fx one session\n", s.n_sessions, s.total_fps, s.mpixels, s.total_fps / s.n_sessions, s.slowest_fps,
+				s.total_fps / max(steps.front().total_fps, 1e-3));
+	}
+} }
@@ -0,0 +1,111 @@
+/* Rendering server: many viewer sessions over one set of panorama GL objects.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "opencv2/opencv.hpp"
+#include "utils/utils.opengl.h"
+#include "utils/resolution.h"
+
+namespace kandao { namespace OpenGL
+{
+	// Read-only GL objects of one panorama, created in the primary context. Buffers and textures
+	// live in the namespace every worker context shares with it; VAOs and framebuffers do not, so
+	// each worker binds its own VAO over these buffers. Programs are shared too, but so are their
+	// uniform values, so every worker links its own from the sources.
+	struct SharedScene
+	{
+		GLuint VBO = 0, EBO = 0;
+		size_t vertex_offset = 0;	// byte offset of the first [X, Y, Z, u, v] vertex in VBO
+		size_t index_offset = 0;	// byte offset of the first index in EBO
+		GLsizei n_indices = 0;
+		GLuint tex_frame = 0;
+		const char *vertex_shader = NULL, *fragment_shader = NULL;	// e.g. show_equi_vs + show_texture_fs
+	};
+
+	// One remote viewer: its own camera and input state and an offscreen target in the context
+	// of the worker that renders it. A scripted user stands in for the input a client would send:
+	// it looks around in slow drags, now and then walks a little or zooms.
+	class RenderSession
+	{
+	public:
+		RenderSession(int id, int width, int height);
+
+		// advance the scripted input by dt seconds
+		void simulateInput(float dt);
+
+		int id;
+		int width, height;
+		ViewState view;
+		RenderTarget target;
+		cv::Mat pixels;		// BGRA, bottom row first, the last frame read back
+
+	private:
+		cv::RNG rng;
+		float cursor_x = 0, cursor_y = 0;
+		float look_x = 0, look_y = 0;	// cursor speed in pixels per second
+		Camera_Movement walk = FORWARD;
+		float walk_s = 0, zoom_s = 0, next_change = 0;
+	};
+
+	// Sessions are spread over n_workers threads, each with a hidden window whose context shares
+	// objects with the primary one. A worker renders its sessions round-robin: every session
+	// draws into its own target, then all of them are read back, so the readbacks of a round wait
+	// for the GPU once. Sessions added while running join their worker's next round.
+	class RenderServer
+	{
+	public:
+		struct Stats
+		{
+			int n_sessions = 0;
+			double total_fps = 0, slowest_fps = 0, fastest_fps = 0;	// frames per second, over all and per session
+			double mpixels = 0;		// per second over every session
+		};
+
+		// on the main thread with the primary context current (GLFW creates windows there only);
+		// max_fps caps each worker's rounds, 0 renders as fast as the GPU allows
+		RenderServer(GLFWwindow *share, const SharedScene &scene, int n_workers = 1, double max_fps = 0,
+			bool readback = true);
+		~RenderServer();
+
+		// goes to the worker with the fewest sessions; returns the session id, -1 without workers
+		int addSession(int width, int height);
+		int numSessions() const;
+		// per-session frame rate and total throughput since the last report
+		Stats report();
+		// join the workers, their per-context objects are released in their contexts
+		void stop();
+
+	private:
+		struct Worker
+		{
+			GLFWwindow *window = NULL;
+			std::thread thread;
+			std::vector<std::unique_ptr<RenderSession>> sessions, pending;
+			std::vector<int> frames;	// per session since the last report
+			double round_ms = 0;
+			int n_rounds = 0;
+		};
+
+		void run(Worker &worker);
+		void draw(RenderSession &session, GLuint vao, Shader &shader);
+
+		SharedScene scene;
+		double max_fps;
+		bool readback;
+		std::vector<std::unique_ptr<Worker>> workers;
+		mutable std::mutex mtx;
+		std::atomic<bool> stopping;
+		int n_sessions = 0;
+		double last_report;
+	};
+
+	// Local load test: a simulated user joins every step_s seconds until there are n_sessions,
+	// the frame rate of every session and the total throughput are printed after each step.
+	void benchmarkSessions(GLFWwindow *share, const SharedScene &scene, int n_sessions, int n_workers = 1,
+		int width = 640, int height = 360, double step_s = 2, double max_fps = 0);
+} }
@@ -0,0 +1,144 @@
+/* Dynamic resolution: offscreen render target and a frame-time driven quality controller.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <algorithm>
+#include "utils/resolution.h"
+
+using namespace std;
+
+namespace kandao { namespace OpenGL
+{
+	///////////////////////////////////// RenderTarget /////////////////////////////////////
+	void RenderTarget::resize(int w, int h, int n_samples)
+	{
+		w = max(w, 1);
+		h = max(h, 1);
+		if (fbo && w == width && h == height && n_samples == samples)
+			return;
+		release();
+		width = w;
+		height = h;
+		samples = n_samples;
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glGenRenderbuffers(1, &color_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+		trackRenderbuffer(color_rb, "render target color", width, height, GL_RGBA8, samples);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rb);
+		glGenRenderbuffers(1, &depth_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+		trackRenderbuffer(depth_rb, "render target depth", width, height, GL_DEPTH_COMPONENT24, samples);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			printf("[dynres] %dx%d target with %d samples is incomplete\n", width, height, samples);
+
+		// multisampled pixels cannot be stretched, they are resolved at the same size first
+		if (samples) {
+			glGenFramebuffers(1, &resolve_fbo);
+			glBindFramebuffer(GL_FRAMEBUFFER, resolve_fbo);
+			glGenRenderbuffers(1, &resolve_rb);
+			glBindRenderbuffer(GL_RENDERBUFFER, resolve_rb);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+			trackRenderbuffer(resolve_rb, "render target resolve", width, height, GL_RGBA8, 0);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolve_rb);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void RenderTarget::bind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+	}
+
+	GLuint RenderTarget::resolve()
+	{
+		if (!samples)
+			return fbo;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_fbo);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		return resolve_fbo;
+	}
+
+	void RenderTarget::present(int window_width, int window_height)
+	{
+		GLuint src = resolve();
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, src);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT,
+			width == window_width && height == window_height ? GL_NEAREST : GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, window_width, window_height);
+	}
+
+	void RenderTarget::release()
+	{
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteFramebuffers(1, &resolve_fbo);
+		deleteRenderbuffer(color_rb);
+		deleteRenderbuffer(depth_rb);
+		deleteRenderbuffer(resolve_rb);
+		fbo = color_rb = depth_rb = resolve_fbo = resolve_rb = 0;
+		width = height = samples = 0;
+	}
+
+	///////////////////////////////////// ResolutionController /////////////////////////////////////
+	ResolutionController::ResolutionController(double target_ms, float min_scale, int max_samples)
+		: target_ms(target_ms)
+	{
+		for (int s = max_samples; s >= 2; s /= 2) {
+			Level level = { 1.f, s };
+			levels.push_back(level);
+		}
+		// tenths, counted in integers so 0.5 is not missed to rounding
+		for (int tenths = 10; tenths >= (int)(min_scale * 10 + 0.5f); --tenths) {
+			Level level = { tenths / 10.f, 0 };
+			levels.push_back(level);
+		}
+	}
+
+	bool ResolutionController::update(double gpu_ms)
+	{
+		// queries issued before the last change still measure the old level
+		if (n_settle > 0) {
+			--n_settle;
+			if (n_settle == 0)
+				avg_ms = 0;
+			return false;
+		}
+		avg_ms = avg_ms > 0 ? avg_ms + smoothing * (gpu_ms - avg_ms) : gpu_ms;
+
+		n_over = avg_ms > target_ms * high ? n_over + 1 : 0;
+		n_under = avg_ms < target_ms * low ? n_under + 1 : 0;
+		if (n_over >= down_after && cur + 1 < (int)levels.size()) {
+			select(cur + 1);
+			return true;
+		}
+		if (n_under >= up_after && cur > 0) {
+			select(cur - 1);
+			return true;
+		}
+		return false;
+	}
+
+	void ResolutionController::select(int level)
+	{
+		cur = level;
+		n_over = n_under = 0;
+		n_settle = settle;
+		++n_changes;
+	}
+
+	void ResolutionController::printState(const char *event) const
+	{
+		const Level &l = current();
+		printf("[dynres] %s: level %d/%d, scale %.2f, %dx MSAA, gpu %.2f ms avg / %.2f target, over %d under %d, "
+			"%d changes\n", event, cur + 1, (int)levels.size(), l.scale, max(l.samples, 1), avg_ms, target_ms, n_over,
+			n_under, n_changes);
+	}
+} }
@@ -0,0 +1,72 @@
+/* Dynamic resolution: offscreen render target and a frame-time driven quality controller.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <vector>
+#include "utils/utils.opengl.h"
+
+namespace kandao { namespace OpenGL
+{
+	// offscreen color + depth at any size and sample count, presented by stretching it into the
+	// window with glBlitFramebuffer. The window itself must be single-sampled for that.
+	class RenderTarget
+	{
+	public:
+		// reallocates only when the size or the sample count changed
+		void resize(int width, int height, int samples);
+		// draw framebuffer and viewport
+		void bind();
+		// resolve MSAA if any; returns the framebuffer holding single-sampled pixels, e.g. to read back
+		GLuint resolve();
+		// resolve, then upscale linearly into the window; leaves the window bound
+		void present(int window_width, int window_height);
+		// must run while the context is alive
+		void release();
+
+		int width = 0, height = 0, samples = 0;
+
+	private:
+		GLuint fbo = 0, color_rb = 0, depth_rb = 0;
+		GLuint resolve_fbo = 0, resolve_rb = 0;	// only with MSAA
+	};
+
+	// Walks a ladder of quality levels, MSAA first and then render scale in 10% steps, to keep
+	// the measured GPU frame time under target_ms. Quality drops after a few frames over the
+	// high mark but only rises after many frames under the low mark, and samples right after a
+	// change are ignored while the timer queries of the old level drain, so it does not flicker.
+	class ResolutionController
+	{
+	public:
+		struct Level
+		{
+			float scale;
+			int samples;
+		};
+
+		ResolutionController(double target_ms, float min_scale = 0.5f, int max_samples = 4);
+
+		// one GPU frame time; true when the level changed
+		bool update(double gpu_ms);
+
+		const Level& current() const { return levels[cur]; }
+		int level() const { return cur; }
+		int numLevels() const { return levels.size(); }
+		void printState(const char *event) const;
+
+		// tuning, as fractions of target_ms and counts of samples
+		double target_ms;
+		double high = 0.95, low = 0.7;
+		int down_after = 3, up_after = 60, settle = 6;
+		double smoothing = 0.2;		// weight of a new sample in avg_ms
+
+		// controller state
+		double avg_ms = 0;
+		int n_over = 0, n_under = 0, n_settle = 0, n_changes = 0;
+
+	private:
+		void select(int level);
+
+		std::vector<Level> levels;	// best quality first
+		int cur = 0;
+	};
+} }
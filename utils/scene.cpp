@@ -0,0 +1,257 @@
+/* Multi-panorama tour: scenes prepared in the background, GPU resources kept in an LRU cache.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include "utils/scene.h"
+#include "utils/utils.opencv.h"
+#include "utils/timer.h"
+#include "utils/memory.h"
+#include "utils/depth_upsample.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	bool prepareScene(const std::string &fn, float disp_scale, int n_cols, int n_rows, SceneAssets &assets,
+		bool with_pyramid, mesh::Tessellation tess, float cull_ratio)
+	{
+		double t = wallTimeMs();
+		MemoryStage stage("scene prepare");
+		Mat in_dat = imread(fn);
+		if (in_dat.empty()) {
+			printf("[scene] read %s failed\n", fn.c_str());
+			return false;
+		}
+
+		// own the color half so the decoded disparity can be dropped
+		Mat frame, disp;
+		splitTopBottom(in_dat, frame, disp);
+		assets.frame = frame.clone();
+		assets.depth = opencv::viewableDisp2Original(disp, disp_scale);
+		mesh::buildEquirectangular(assets.depth, assets.mesh, n_cols, n_rows, tess, cull_ratio);
+		if (with_pyramid)
+			assets.pyramid.build(assets.depth);
+		assets.prepare_ms = wallTimeMs() - t;
+		return true;
+	}
+
+	// GPU footprint: mesh buffers plus both textures with their mip chains
+	static size_t estimateBytes(const SceneAssets &assets)
+	{
+		size_t tex_frame = assets.frame.total() * 4, tex_depth = assets.depth.total() * 4;
+		return assets.mesh.bytes() + (tex_frame + tex_depth) * 4 / 3 + assets.pyramid.bytes();
+	}
+
+	SceneManager::SceneManager(const std::vector<std::string> &files, OpenGL::MeshArena &arena, size_t gpu_budget,
+		int n_cols, int n_rows, float disp_scale, int n_workers, bool with_pyramid)
+		: files(files), arena(arena), gpu_budget(gpu_budget), n_cols(n_cols), n_rows(n_rows), disp_scale(disp_scale),
+		with_pyramid(with_pyramid)
+	{
+		for (int i = 0; i < n_workers; ++i)
+			workers.push_back(thread(&SceneManager::worker, this));
+	}
+
+	SceneManager::~SceneManager()
+	{
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+			jobs.clear();
+		}
+		cv_jobs.notify_all();
+		for (auto &w : workers)
+			w.join();
+	}
+
+	const SceneGPU* SceneManager::select(int i)
+	{
+		if (files.empty())
+			return NULL;
+		i = (i % size() + size()) % size();
+		double t = wallTimeMs();
+
+		const char *path = "hit";
+		if (cache.count(i)) {
+			++n_hits;
+			lru.remove(i);
+			lru.push_front(i);
+		}
+		else {
+			SceneAssets assets;
+			bool ready = false;
+			{
+				// take it from the workers if they already have it or are on it
+				unique_lock<mutex> lock(mtx);
+				jobs.erase(std::remove(jobs.begin(), jobs.end(), i), jobs.end());
+				cv_done.wait(lock, [&]() { return in_flight.count(i) == 0; });
+				if (prepared.count(i)) {
+					assets = std::move(prepared[i]);
+					prepared.erase(i);
+					ready = true;
+				}
+			}
+
+			if (ready) {
+				++n_ready;
+				path = "prepared";
+			}
+			else {
+				++n_misses;
+				path = "miss";
+				if (!prepareScene(files[i], disp_scale, n_cols, n_rows, assets, with_pyramid, tess, cull_ratio))
+					return NULL;
+			}
+			if (!insert(i, assets))
+				return NULL;
+			lru.remove(i);
+			lru.push_front(i);
+		}
+
+		cur = i;
+		evict();
+		prefetchNeighbors();
+		printf("[scene] %d/%d %s (%s) in %.2f ms, cache %d scenes %.1f/%.1f MB\n", i + 1, size(), files[i].c_str(), path,
+			wallTimeMs() - t, (int)cache.size(), gpu_bytes / 1048576., gpu_budget / 1048576.);
+		return &cache[i];
+	}
+
+	bool SceneManager::update()
+	{
+		SceneAssets assets;
+		int i = -1;
+		{
+			lock_guard<mutex> lock(mtx);
+			if (prepared.empty())
+				return false;
+			i = prepared.begin()->first;
+			assets = std::move(prepared.begin()->second);
+			prepared.erase(prepared.begin());
+		}
+		if (cache.count(i))
+			return false;
+
+		// prefetched scenes rank right behind the current one
+		if (!insert(i, assets))
+			return false;
+		lru.remove(i);
+		lru.insert(lru.empty() ? lru.end() : std::next(lru.begin()), i);
+		evict();
+		return true;
+	}
+
+	bool SceneManager::insert(int i, SceneAssets &assets)
+	{
+		// nothing is created for a scene that cannot be drawn
+		SceneGPU gpu;
+		if (!arena.upload(assets.mesh, gpu.mesh)) {
+			printf("[scene] no arena space for scene %d\n", i + 1);
+			return false;
+		}
+		gpu.tex_frame = OpenGL::makeTextureFromMat(assets.frame, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB,
+			format("scene %d color", i + 1).c_str());
+		gpu.tex_depth = OpenGL::makeTextureFromMat(assets.depth, GL_RED, GL_FLOAT, GL_R32F,
+			format("scene %d depth", i + 1).c_str());
+		if (!assets.pyramid.empty()) {
+			gpu.tex_minmax = OpenGL::makeTextureFromMats(assets.pyramid.levels, GL_RG, GL_FLOAT, GL_RG32F,
+				GL_NEAREST_MIPMAP_NEAREST, GL_NEAREST, format("scene %d minmax", i + 1).c_str());
+			gpu.n_minmax_levels = assets.pyramid.numLevels();
+		}
+		gpu.bytes = estimateBytes(assets);
+		gpu_bytes += gpu.bytes;
+		cache[i] = gpu;
+		return true;
+	}
+
+	void SceneManager::evict()
+	{
+		// never evict the scene on screen, even if it alone exceeds the budget
+		while (gpu_bytes > gpu_budget && lru.size() > 1 && lru.back() != cur) {
+			int i = lru.back();
+			lru.pop_back();
+
+			SceneGPU &gpu = cache[i];
+			arena.release(gpu.mesh);
+			OpenGL::deleteTexture(gpu.tex_frame);
+			OpenGL::deleteTexture(gpu.tex_depth);
+			OpenGL::deleteTexture(gpu.tex_minmax);
+			gpu_bytes -= gpu.bytes;
+			cache.erase(i);
+			++n_evictions;
+		}
+	}
+
+	void SceneManager::clear()
+	{
+		for (auto &kv : cache) {
+			arena.release(kv.second.mesh);
+			OpenGL::deleteTexture(kv.second.tex_frame);
+			OpenGL::deleteTexture(kv.second.tex_depth);
+			OpenGL::deleteTexture(kv.second.tex_minmax);
+		}
+		cache.clear();
+		lru.clear();
+		gpu_bytes = 0;
+	}
+
+	void SceneManager::prefetchNeighbors()
+	{
+		int next = (cur + 1) % size(), prev = (cur - 1 + size()) % size();
+
+		lock_guard<mutex> lock(mtx);
+		// a tour only moves one step at a time, anything else queued is stale
+		jobs.clear();
+		for (auto it = prepared.begin(); it != prepared.end();) {
+			if (it->first != next && it->first != prev)
+				it = prepared.erase(it);
+			else
+				++it;
+		}
+		enqueue(next);
+		enqueue(prev);
+		cv_jobs.notify_all();
+	}
+
+	void SceneManager::enqueue(int i)
+	{
+		if (i == cur || cache.count(i) || in_flight.count(i) || prepared.count(i))
+			return;
+		if (std::find(jobs.begin(), jobs.end(), i) == jobs.end())
+			jobs.push_back(i);
+	}
+
+	void SceneManager::worker()
+	{
+		while (true) {
+			int i;
+			{
+				unique_lock<mutex> lock(mtx);
+				cv_jobs.wait(lock, [this]() { return stopping || !jobs.empty(); });
+				if (stopping)
+					return;
+				i = jobs.front();
+				jobs.pop_front();
+				in_flight.insert(i);
+			}
+
+			SceneAssets assets;
+			bool ok = prepareScene(files[i], disp_scale, n_cols, n_rows, assets, with_pyramid, tess, cull_ratio);
+
+			{
+				lock_guard<mutex> lock(mtx);
+				if (ok) {
+					prepared[i] = std::move(assets);
+					++n_prefetched;
+				}
+				in_flight.erase(i);
+			}
+			cv_done.notify_all();
+			glfwPostEmptyEvent();
+		}
+	}
+
+	void SceneManager::printStats() const
+	{
+		printf("[scene] switches: %d hits, %d prepared, %d misses; %d prefetched, %d evicted\n",
+			n_hits, n_ready, n_misses, n_prefetched, n_evictions);
+	}
+}
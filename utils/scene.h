@@ -0,0 +1,97 @@
+/* Multi-panorama tour: scenes prepared in the background, GPU resources kept in an LRU cache.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "opencv2/opencv.hpp"
+#include "utils/utils.opengl.h"
+#include "utils/arena.h"
+#include "utils/mesh.h"
+#include "utils/pyramid.h"
+
+namespace kandao
+{
+	// CPU side of a scene, safe to build on any thread
+	struct SceneAssets
+	{
+		cv::Mat frame, depth;
+		mesh::MeshData mesh;
+		DepthPyramid pyramid;	// only for the ray-marched renderer
+		double prepare_ms = 0;
+	};
+
+	// read a top-bottom panorama, convert disparity and build its mesh
+	bool prepareScene(const std::string &fn, float disp_scale, int n_cols, int n_rows, SceneAssets &assets,
+		bool with_pyramid = false, mesh::Tessellation tess = mesh::TESS_GRID, float cull_ratio = 0);
+
+	// GL side of a scene, owned by the SceneManager cache
+	struct SceneGPU
+	{
+		OpenGL::ArenaMesh mesh;
+		GLuint tex_frame = 0, tex_depth = 0;
+		GLuint tex_minmax = 0;
+		int n_minmax_levels = 0;
+		size_t bytes = 0;
+	};
+
+	class SceneManager
+	{
+	public:
+		SceneManager(const std::vector<std::string> &files, OpenGL::MeshArena &arena, size_t gpu_budget,
+			int n_cols, int n_rows, float disp_scale = 0.01f, int n_workers = 2, bool with_pyramid = false);
+		~SceneManager();
+
+		int size() const { return files.size(); }
+		int current() const { return cur; }
+
+		// make scene i current, blocking on a cold miss; returns NULL if it cannot be loaded
+		const SceneGPU* select(int i);
+		// on the render thread between frames: upload at most one prefetched scene
+		bool update();
+		// release every GL object, must run while the context is alive
+		void clear();
+
+		void printStats() const;
+
+		// mesh layout of scenes prepared from now on
+		mesh::Tessellation tess = mesh::TESS_GRID;
+		float cull_ratio = 0;
+
+	private:
+		void prefetchNeighbors();
+		void enqueue(int i);
+		void worker();
+		// false, with nothing created, when the mesh does not fit the arena
+		bool insert(int i, SceneAssets &assets);
+		void evict();
+
+		std::vector<std::string> files;
+		OpenGL::MeshArena &arena;
+		size_t gpu_budget, gpu_bytes = 0;
+		int n_cols, n_rows, cur = -1;
+		float disp_scale;
+		bool with_pyramid;
+
+		// GPU cache, most recently used at the front
+		std::map<int, SceneGPU> cache;
+		std::list<int> lru;
+
+		// background preparation
+		std::vector<std::thread> workers;
+		std::mutex mtx;
+		std::condition_variable cv_jobs, cv_done;
+		std::deque<int> jobs;
+		std::set<int> in_flight;
+		std::map<int, SceneAssets> prepared;
+		bool stopping = false;
+
+		// statistics
+		int n_hits = 0, n_ready = 0, n_misses = 0, n_evictions = 0, n_prefetched = 0;
+	};
+}
@@ -46,4 +46,192 @@ static const char *show_texture_fs = STRINGIFY(
 	}
 );
 
+// as show_equi_vs, plus the direction from the panorama center to the vertex for cube map color
+static const char *show_equi_dir_vs = STRINGIFY(
+	\#version 330 core\n
+	layout(location = 0) in vec3 aPos;
+	layout(location = 1) in vec2 aTexCoord;
+
+	out vec2 TexCoord;
+	out vec3 Dir;
+
+	uniform mat4 model;
+	uniform mat4 view;
+	uniform mat4 projection;
+
+	void main()
+	{
+		gl_Position = projection * view * model * vec4(aPos, 1.0);
+		TexCoord = vec2(aTexCoord.x, aTexCoord.y);
+		Dir = aPos;
+	}
+);
+
+// show_texture_fs for color resampled into a cube map (utils/cubemap.h), looked up by direction:
+// no seam, no oversampled poles, and neighbouring fragments fetch neighbouring texels in any view
+static const char *show_cubemap_fs = STRINGIFY(
+	\#version 330 core\n
+	in vec3 Dir;
+	out vec4 color;
+
+	uniform samplerCube texture0;
+
+	void main()
+	{
+		color = texture(texture0, Dir);
+	}
+);
+
+// gallery: one unit sphere instanced per panorama, displaced by that panorama's depth layer.
+// Instance attributes carry the sphere center and size and the layer in both texture arrays.
+static const char *gallery_vs = STRINGIFY(
+	\#version 330 core\n
+	layout(location = 0) in vec3 aPos;
+	layout(location = 1) in vec2 aTexCoord;
+	layout(location = 2) in vec4 aCenterScale;
+	layout(location = 3) in float aLayer;
+
+	out vec3 TexCoord;
+
+	uniform sampler2DArray depth_layers;
+	uniform mat4 view;
+	uniform mat4 projection;
+
+	void main()
+	{
+		vec3 uvw = vec3(aTexCoord, aLayer);
+		float d = textureLod(depth_layers, uvw, 0.0).r;
+		gl_Position = projection * view * vec4(aCenterScale.xyz + aPos * d * aCenterScale.w, 1.0);
+		TexCoord = uvw;
+	}
+);
+
+static const char *gallery_fs = STRINGIFY(
+	\#version 330 core\n
+	in vec3 TexCoord;
+	out vec4 color;
+
+	uniform sampler2DArray color_layers;
+
+	void main()
+	{
+		color = texture(color_layers, TexCoord);
+	}
+);
+
+// full-screen triangle from gl_VertexID, draw 3 vertices with any VAO bound
+static const char *fullscreen_vs = STRINGIFY(
+	\#version 330 core\n
+	out vec2 NDC;
+
+	void main()
+	{
+		vec2 pos = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2)) * 2.0 - 1.0;
+		NDC = pos;
+		gl_Position = vec4(pos, 0.0, 1.0);
+	}
+);
+
+// mesh-free rendering: march each view ray through the equirectangular depth. depth_minmax holds
+// the min/max depth pyramid, one texel per cell; the min bounds how far a ray may safely advance
+// (unbounded sphere tracing), a ray already beyond the max of a cell must have crossed the surface
+// and drops straight to the finest level. Assumes the eye is inside the reconstructed volume,
+// as it is around the panorama center.
+static const char *raymarch_equi_fs = STRINGIFY(
+	\#version 330 core\n
+	in vec2 NDC;
+	out vec4 color;
+
+	uniform sampler2D texture0;
+	uniform sampler2D depth_minmax;
+	uniform int n_levels;
+	uniform int max_steps;
+	uniform mat4 inv_view_proj;
+	uniform vec3 eye;
+
+	const float PI = 3.14159265;
+
+	vec2 dirToUV(vec3 d)
+	{
+		float u = atan(d.x, -d.z);
+		float v = acos(clamp(d.y, -1.0, 1.0));
+		return vec2(u / (2.0 * PI) + 0.5, v / PI);
+	}
+
+	vec2 fetchMinMax(vec2 uv, int level)
+	{
+		ivec2 size = textureSize(depth_minmax, level);
+		ivec2 texel = clamp(ivec2(uv * vec2(size)), ivec2(0), size - 1);
+		return texelFetch(depth_minmax, texel, level).rg;
+	}
+
+	void main()
+	{
+		vec4 near = inv_view_proj * vec4(NDC, -1.0, 1.0);
+		vec4 far = inv_view_proj * vec4(NDC, 1.0, 1.0);
+		vec3 dir = normalize(far.xyz / far.w - near.xyz / near.w);
+
+		vec2 bounds = texelFetch(depth_minmax, ivec2(0), n_levels - 1).rg;
+		float t_far = length(eye) + bounds.y;
+		float texel_angle = PI / float(textureSize(depth_minmax, 0).y);
+		int level = max(n_levels - 4, 0);
+		float t = 0.0;
+		float t_prev = 0.0;
+		bool hit = false;
+
+		for (int i = 0; i < max_steps; ++i) {
+			vec3 p = eye + t * dir;
+			float rho = length(p);
+			if (t > t_far)
+				break;
+
+			vec2 uv = dirToUV(p / max(rho, 1e-6));
+			ivec2 size = textureSize(depth_minmax, level);
+			vec2 cell = uv * vec2(size);
+			vec2 mm = fetchMinMax(uv, level);
+
+			if (rho >= mm.x) {
+				if (level == 0) {
+					hit = true;
+					break;
+				}
+				level = (rho >= mm.y) ? 0 : level - 1;
+				continue;
+			}
+
+			// lower bound of the distance to any surface point: inside this cell it is at least
+			// min - rho, outside it the angular gap to the cell border keeps it past rho * sin(beta)
+			vec2 f = fract(cell);
+			vec2 border = min(f, 1.0 - f) / vec2(size);
+			float sin_theta = sin(uv.y * PI);
+			float beta = min(border.y * PI, asin(min(1.0, sin(min(border.x * 2.0 * PI, 0.5 * PI)) * sin_theta)));
+			float safe = max(bounds.x - rho, min(mm.x - rho, rho * sin(beta)));
+
+			// never step below half a finest texel, the bisection below recovers the overshoot
+			t_prev = t;
+			t += max(safe, 0.5 * texel_angle * max(rho, bounds.x));
+			if (safe > 0.05 * (1.0 + t) && level < n_levels - 1)
+				level += 1;
+		}
+
+		// refine the crossing between the last safe point and the hit
+		if (hit) {
+			for (int i = 0; i < 6; ++i) {
+				float t_mid = 0.5 * (t_prev + t);
+				vec3 p = eye + t_mid * dir;
+				float rho = length(p);
+				if (rho >= fetchMinMax(dirToUV(p / max(rho, 1e-6)), 0).x)
+					t = t_mid;
+				else
+					t_prev = t_mid;
+			}
+			vec3 p = eye + t * dir;
+			color = textureLod(texture0, dirToUV(normalize(p)), 0.0);
+		}
+		else {
+			color = textureLod(texture0, dirToUV(dir), 0.0);
+		}
+	}
+);
+
 #undef STRINGIFY
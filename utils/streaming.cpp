@@ -0,0 +1,286 @@
+/* Strip-streamed loading: decode, depth conversion and meshing a few rows at a time.
+*  All rights reserved. KandaoVR 2018.
+*/
+#include <cstdio>
+#ifdef KANDAO_WITH_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+#include "utils/streaming.h"
+#include "utils/utils.opencv.h"
+#include "utils/timer.h"
+#include "utils/depth_upsample.h"
+
+using namespace std;
+using namespace cv;
+
+namespace kandao
+{
+	///////////////////////////////////// StripReader /////////////////////////////////////
+#ifdef KANDAO_WITH_LIBJPEG
+	// libjpeg reports fatal errors through error_exit, which must not return
+	struct JpegError
+	{
+		jpeg_error_mgr mgr;
+		jmp_buf jump;
+	};
+
+	static void jpegErrorExit(j_common_ptr cinfo)
+	{
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, message);
+		printf("[strip] libjpeg: %s\n", message);
+		longjmp(((JpegError*)cinfo->err)->jump, 1);
+	}
+
+	static bool isJpeg(const std::string &fn)
+	{
+		unsigned char magic[2] = { 0, 0 };
+		FILE *fp = fopen(fn.c_str(), "rb");
+		if (!fp)
+			return false;
+		size_t n = fread(magic, 1, 2, fp);
+		fclose(fp);
+		return n == 2 && magic[0] == 0xFF && magic[1] == 0xD8;
+	}
+
+	struct StripReader::Jpeg
+	{
+		jpeg_decompress_struct cinfo;
+		JpegError err;
+		FILE *fp = NULL;
+	};
+#else
+	struct StripReader::Jpeg {};
+#endif
+
+	StripReader::StripReader() {}
+
+	StripReader::~StripReader()
+	{
+		close();
+	}
+
+	bool StripReader::open(const std::string &fn)
+	{
+		close();
+#ifdef KANDAO_WITH_LIBJPEG
+		if (isJpeg(fn)) {
+			jpeg.reset(new Jpeg);
+			Jpeg &j = *jpeg;
+			j.fp = fopen(fn.c_str(), "rb");
+			j.cinfo.err = jpeg_std_error(&j.err.mgr);
+			j.err.mgr.error_exit = jpegErrorExit;
+			jpeg_create_decompress(&j.cinfo);
+			if (setjmp(j.err.jump)) {
+				close();
+				return false;
+			}
+
+			jpeg_stdio_src(&j.cinfo, j.fp);
+			jpeg_read_header(&j.cinfo, TRUE);
+#ifdef JCS_EXTENSIONS
+			j.cinfo.out_color_space = JCS_EXT_BGR;
+#else
+			j.cinfo.out_color_space = JCS_RGB;
+#endif
+			jpeg_start_decompress(&j.cinfo);
+			n_rows = j.cinfo.output_height;
+			n_cols = j.cinfo.output_width;
+			return true;
+		}
+#endif
+		whole = imread(fn);
+		n_rows = whole.rows;
+		n_cols = whole.cols;
+		return !whole.empty();
+	}
+
+	void StripReader::close()
+	{
+#ifdef KANDAO_WITH_LIBJPEG
+		if (jpeg) {
+			// abandoning a decode half way is fine, destroy releases everything
+			jpeg_destroy_decompress(&jpeg->cinfo);
+			if (jpeg->fp)
+				fclose(jpeg->fp);
+		}
+#endif
+		jpeg.reset();
+		whole.release();
+		n_rows = n_cols = next_row = 0;
+	}
+
+	bool StripReader::streaming() const
+	{
+		return jpeg != NULL;
+	}
+
+	bool StripReader::read(int n, cv::Mat &strip)
+	{
+		n = min(n, n_rows - next_row);
+		if (n <= 0)
+			return false;
+
+#ifdef KANDAO_WITH_LIBJPEG
+		if (jpeg) {
+			Jpeg &j = *jpeg;
+			if (setjmp(j.err.jump)) {
+				close();
+				return false;
+			}
+
+			strip.create(n, n_cols, CV_8UC3);
+			for (int i = 0; i < n; ++i) {
+				JSAMPROW row = strip.ptr(i);
+				jpeg_read_scanlines(&j.cinfo, &row, 1);
+			}
+#ifndef JCS_EXTENSIONS
+			cvtColor(strip, strip, COLOR_RGB2BGR);
+#endif
+			next_row += n;
+			return true;
+		}
+#endif
+		strip = whole.rowRange(next_row, next_row + n);
+		next_row += n;
+		return true;
+	}
+
+	///////////////////////////////////// streamPanorama /////////////////////////////////////
+	bool streamPanorama(const std::string &fn, float disp_scale, int n_cols, int n_rows, mesh::Tessellation tess,
+		float cull_ratio, int strip_rows, OpenGL::MeshArena &arena, OpenGL::ArenaMesh &mesh, GLuint &tex_frame, GLuint &tex_depth,
+		StreamStats &stats)
+	{
+		double t = wallTimeMs();
+		stats = StreamStats();
+		StripReader reader;
+		if (!reader.open(fn)) {
+			printf("[stream] read %s failed\n", fn.c_str());
+			return false;
+		}
+
+		// strips pair color row y with disparity row y + half, packed reduced disparity has no such row
+		if (depthScaleOf(cv::Size(reader.cols(), reader.rows())) > 1) {
+			printf("[stream] %s stores reduced disparity, load it without --stream\n", fn.c_str());
+			return false;
+		}
+		int width = reader.cols(), half = reader.rows() / 2;
+		size_t held = reader.streaming() ? 0 : (size_t)reader.rows() * width * 3;
+		stats.bounded = reader.streaming();
+		if (!reader.streaming()) {
+#ifdef KANDAO_WITH_LIBJPEG
+			printf("[stream] %s is not a JPEG, it is decoded whole and memory is not bounded by the strips\n", fn.c_str());
+#else
+			printf("[stream] built without KANDAO_WITH_LIBJPEG, %s is decoded whole and memory is not bounded by the strips\n",
+				fn.c_str());
+#endif
+		}
+
+		// everything is sized up front, strips only fill it in
+		size_t n_vertices, n_indices;
+		mesh::countEquirectangular(n_cols, n_rows, n_vertices, n_indices, tess);
+		if (!arena.allocate(n_vertices, n_indices, mesh, false)) {
+			printf("[stream] mesh allocation failed\n");
+			return false;
+		}
+		tex_frame = OpenGL::makeTexture(width, half, GL_BGR, GL_UNSIGNED_BYTE, GL_RGB, "frame color");
+		tex_depth = OpenGL::makeTexture(width, half, GL_RED, GL_FLOAT, GL_R32F, "depth");
+		stats.whole_bytes = (size_t)reader.rows() * width * 3 + (size_t)half * width * sizeof(float) +
+			n_vertices * mesh::VERTEX_STRIDE * sizeof(float) + n_indices * sizeof(unsigned int);
+
+		// color half goes straight into the texture
+		MemoryStage stage("stream strips");
+		Mat strip;
+		while (reader.position() < half && reader.read(min(strip_rows, half - reader.position()), strip)) {
+			OpenGL::uploadTextureRows(tex_frame, reader.position() - strip.rows, strip, GL_BGR, GL_UNSIGNED_BYTE);
+			stats.peak_bytes = max(stats.peak_bytes, held + strip.total() * strip.elemSize());
+			++stats.n_strips;
+		}
+
+		// disparity half: convert, upload and mesh every row whose depth rows have all arrived;
+		// the rows a pending mesh row still reads are carried over into the next window
+		mesh::DepthStrip window;
+		window.full_rows = half;
+		int next_row = 0, n_mesh_rows = mesh::numMeshRows(n_rows, tess);
+		vector<float> slice_vertices;
+		vector<unsigned int> slice_indices;
+		while (reader.read(strip_rows, strip)) {
+			int y0 = reader.position() - strip.rows - half, y_end = reader.position() - half;
+			Mat depth = opencv::viewableDisp2Original(strip, disp_scale);
+			OpenGL::uploadTextureRows(tex_depth, y0, depth, GL_RED, GL_FLOAT);
+
+			if (window.depth.empty()) {
+				window.depth = depth;
+				window.y0 = y0;
+			}
+			else {
+				Mat joined;
+				vconcat(window.depth, depth, joined);
+				window.depth = joined;
+			}
+
+			int row_end = next_row;
+			while (row_end < n_mesh_rows) {
+				int y_first, y_last;
+				mesh::depthRowsOf(n_rows, half, tess, row_end, y_first, y_last);
+				if (y_last >= y_end)
+					break;
+				++row_end;
+			}
+
+			if (row_end > next_row) {
+				size_t v0, i0, v1, i1;
+				mesh::rowOffsets(n_cols, n_rows, tess, next_row, v0, i0);
+				mesh::rowOffsets(n_cols, n_rows, tess, row_end, v1, i1);
+
+				// persistent mapping takes the rows in place, otherwise they go through a slice buffer
+				if (mesh.vertices) {
+					stats.n_culled += mesh::buildEquirectangularRows(window, n_cols, n_rows, next_row, row_end,
+						mesh.vertices + v0 * mesh::VERTEX_STRIDE, mesh.indices + i0, tess, cull_ratio);
+				}
+				else {
+					slice_vertices.resize((v1 - v0) * mesh::VERTEX_STRIDE);
+					slice_indices.resize(i1 - i0);
+					stats.n_culled += mesh::buildEquirectangularRows(window, n_cols, n_rows, next_row, row_end,
+						slice_vertices.data(), slice_indices.data(), tess, cull_ratio);
+					arena.write(mesh, v0, slice_vertices.data(), v1 - v0, i0, slice_indices.data(), i1 - i0);
+				}
+				next_row = row_end;
+			}
+
+			size_t working = held + strip.total() * strip.elemSize() + depth.total() * depth.elemSize() +
+				window.depth.total() * window.depth.elemSize() +
+				slice_vertices.capacity() * sizeof(float) + slice_indices.capacity() * sizeof(unsigned int);
+			stats.peak_bytes = max(stats.peak_bytes, working);
+			++stats.n_strips;
+
+			int keep_from = y_end;
+			if (next_row < n_mesh_rows) {
+				int y_first, y_last;
+				// culling a latitude ring also looks at the ring above it
+				int carried = (cull_ratio > 0 && tess == mesh::TESS_LATITUDE && next_row > 0) ? next_row - 1 : next_row;
+				mesh::depthRowsOf(n_rows, half, tess, carried, y_first, y_last);
+				keep_from = min(y_first, y_end);
+			}
+			window.depth = window.depth.rowRange(keep_from - window.y0, window.depth.rows).clone();
+			window.y0 = keep_from;
+		}
+
+		glBindTexture(GL_TEXTURE_2D, tex_frame);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, tex_depth);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		OpenGL::trackTexture(tex_frame, "frame color", width, half, GL_RGB, OpenGL::numMipLevels(width, half));
+		OpenGL::trackTexture(tex_depth, "depth", width, half, GL_R32F, OpenGL::numMipLevels(width, half));
+		arena.commit(mesh);
+
+		stats.total_ms = wallTimeMs() - t;
+		if (next_row < n_mesh_rows) {
+			printf("[stream] %s ended after %d of %d mesh rows\n", fn.c_str(), next_row, n_mesh_rows);
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,57 @@
+/* Strip-streamed loading: decode, depth conversion and meshing a few rows at a time.
+*  All rights reserved. KandaoVR 2018.
+*/
+#pragma once
+#include <memory>
+#include "opencv2/opencv.hpp"
+#include "utils/utils.opengl.h"
+#include "utils/arena.h"
+#include "utils/mesh.h"
+
+namespace kandao
+{
+	// Sequential row reader. Built with KANDAO_WITH_LIBJPEG (and libjpeg or libjpeg-turbo linked),
+	// JPEGs are decoded scanline by scanline so only the rows asked for are ever held; anything
+	// else falls back to imread and hands out views of the whole image.
+	class StripReader
+	{
+	public:
+		StripReader();
+		~StripReader();
+
+		bool open(const std::string &fn);
+		void close();
+
+		int rows() const { return n_rows; }
+		int cols() const { return n_cols; }
+		int position() const { return next_row; }
+		// memory is bounded by the strip rather than the image
+		bool streaming() const;
+
+		// next n rows as CV_8UC3 BGR, fewer at the bottom; false once every row was read
+		bool read(int n, cv::Mat &strip);
+
+	private:
+		struct Jpeg;
+		std::unique_ptr<Jpeg> jpeg;
+		cv::Mat whole;
+		int n_rows = 0, n_cols = 0, next_row = 0;
+	};
+
+	struct StreamStats
+	{
+		int n_strips = 0;
+		bool bounded = false;		// the decoder streamed too
+		size_t peak_bytes = 0;		// largest CPU working set: strip, depth carry and mesh slice
+		size_t whole_bytes = 0;		// what decoding, converting and meshing everything at once holds
+		size_t n_culled = 0;		// triangles dropped across depth edges
+		double total_ms = 0;
+	};
+
+	// Load a top-bottom panorama straight to the GPU in strips of strip_rows: color rows go into
+	// tex_frame, disparity rows are converted to depth, uploaded into tex_depth and meshed into mesh,
+	// which is allocated from the arena up front. Needs a current GL context.
+	bool streamPanorama(const std::string &fn, float disp_scale, int n_cols, int n_rows, mesh::Tessellation tess,
+		float cull_ratio, int strip_rows, OpenGL::MeshArena &arena, OpenGL::ArenaMesh &mesh, GLuint &tex_frame, GLuint &tex_depth,
+		StreamStats &stats);
+}
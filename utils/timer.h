@@ -8,9 +8,124 @@
 #include <map>
 #include <vector>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 
 #define startCpuTimer(name) \
 	clock_t start_##name## = clock();
 
 #define stopCpuTimer(name) \
 	printf("[cpu timer] " #name " %.2f ms\n", double(clock() - start_##name##) / CLOCKS_PER_SEC * 1000);
+
+namespace kandao
+{
+	// wall-clock milliseconds since the first call, safe to compare across threads
+	inline double wallTimeMs()
+	{
+		static const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	// named checkpoints on the wall clock, printed as a breakdown
+	class TimeLine
+	{
+	public:
+		TimeLine() : t0(wallTimeMs()), last(t0) {}
+
+		double mark(const std::string &name)
+		{
+			double now = wallTimeMs();
+			stages.push_back(std::make_pair(name, now - last));
+			last = now;
+			return now - t0;
+		}
+
+		double elapsed() const { return wallTimeMs() - t0; }
+
+		void print(const char *title) const
+		{
+			double total = 0;
+			printf("[timeline] %s\n", title);
+			for (size_t i = 0; i < stages.size(); ++i) {
+				total += stages[i].second;
+				printf("[timeline]   %-24s +%8.2f ms  (%8.2f ms)\n", stages[i].first.c_str(), stages[i].second, total);
+			}
+		}
+
+	private:
+		double t0, last;
+		std::vector<std::pair<std::string, double> > stages;
+	};
+
+	// frames rendered against wall time, busy time excludes blocking waits for events
+	class DutyCycle
+	{
+	public:
+		DutyCycle() { reset(); total_start = window_start; }
+
+		void beginBusy() { busy_start = wallTimeMs(); ++n_wakeups; }
+		void endBusy() { busy_ms += wallTimeMs() - busy_start; }
+		void frame() { ++n_frames; }
+
+		// print and restart the window once period_ms has passed
+		bool report(const char *tag, double period_ms)
+		{
+			double wall_ms = wallTimeMs() - window_start;
+			if (wall_ms < period_ms)
+				return false;
+
+			total_frames += n_frames;
+			total_busy_ms += busy_ms;
+			printf("[%s] %.1f s: %d frames (%.1f fps), %d wakeups, busy %.1f%% of wall time\n", tag,
+				wall_ms / 1000, n_frames, n_frames * 1000 / wall_ms, n_wakeups, busy_ms * 100 / wall_ms);
+			reset();
+			return true;
+		}
+
+		void summary(const char *tag)
+		{
+			report(tag, 0);
+			double wall_ms = wallTimeMs() - total_start;
+			printf("[%s] total %.1f s: %d frames (%.1f fps), busy %.1f%% of wall time\n", tag,
+				wall_ms / 1000, total_frames, total_frames * 1000 / wall_ms, total_busy_ms * 100 / wall_ms);
+		}
+
+	private:
+		void reset() { window_start = wallTimeMs(); busy_ms = 0; n_frames = n_wakeups = 0; }
+
+		double total_start, window_start, busy_start = 0, busy_ms = 0, total_busy_ms = 0;
+		int n_frames = 0, n_wakeups = 0, total_frames = 0;
+	};
+
+	// millisecond samples, percentiles over the last report period and over the whole run
+	class LatencyStats
+	{
+	public:
+		void add(double ms) { recent.push_back(ms); all.push_back(ms); }
+
+		// what names the samples, e.g. a pipeline stage
+		void report(const char *tag, const std::string &what = "")
+		{
+			print(tag, what, recent);
+			recent.clear();
+		}
+
+		void summary(const char *tag, const std::string &what = "") const
+		{
+			print(tag, what.empty() ? "total" : "total " + what, all);
+		}
+
+	private:
+		static void print(const char *tag, const std::string &what, std::vector<double> samples)
+		{
+			if (samples.empty())
+				return;
+			std::sort(samples.begin(), samples.end());
+			auto at = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+			printf("[%s] %s%s%d samples: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", tag, what.c_str(),
+				what.empty() ? "" : " ", (int)samples.size(), at(0.5), at(0.9), at(0.99), samples.back());
+		}
+
+		std::vector<double> recent, all;
+	};
+}
@@ -3,6 +3,7 @@
 *  Contributor(s): Neil Z. Shao
 */
 #include "utils/utils.opencv.h"
+#include "utils/memory.h"
 
 using namespace std;
 using namespace cv;
@@ -106,6 +107,7 @@ namespace kandao { namespace opencv
 	{
 		if (view_disp.empty())
 			return Mat();
+		MemoryStage stage("depth conversion");
 
 		if (view_disp.channels() == 3) {
 			vector<Mat> disps;
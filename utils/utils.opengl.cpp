@@ -1,7 +1,12 @@
+#include <atomic>
+#include <map>
 #include <GL/glew.h>
 #include <glfw/glfw3.h>
 #include <glm/glm.hpp>
 #include "utils/utils.opengl.h"
+#include "utils/program_cache.h"
+#include "utils/input_session.h"
+#include "utils/timer.h"
 
 using namespace std;
 using namespace cv;
@@ -10,68 +15,163 @@ using namespace glm;
 namespace kandao { namespace OpenGL
 {
 	///////////////////////////////////// Interaction /////////////////////////////////////
-	// settings
-	const unsigned int SCR_WIDTH = 800;
-	const unsigned int SCR_HEIGHT = 600;
+	// the window's viewer
+	static ViewState view;
 
-	// camera
-	Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
-	float lastX = SCR_WIDTH / 2.0f;
-	float lastY = SCR_HEIGHT / 2.0f;
-	bool firstMouse = true;
+	void ViewState::cursorOffset(float xpos, float ypos, float &xoffset, float &yoffset)
+	{
+		if (firstMouse)
+		{
+			lastX = xpos;
+			lastY = ypos;
+			firstMouse = false;
+		}
+
+		xoffset = xpos - lastX;
+		yoffset = lastY - ypos; // reversed since y-coordinates go from bottom to top
+
+		lastX = xpos;
+		lastY = ypos;
+	}
 
-	// interaction mode
-	enum INTERACT_MODE
+	void ViewState::applyMouse(float xoffset, float yoffset)
 	{
-		FREE_VIEW,
-		GOD_VIEW,
-	};
-	INTERACT_MODE interact_mode = FREE_VIEW;
+		camera.ProcessMouseMovement(xoffset, yoffset);
+		if (interact_mode == GOD_VIEW)
+			camera.ObserveCenter();
+	}
 
-	// timing
-	float deltaTime = 0.0f;	// time between current frame and last frame
-	float lastFrame = 0.0f;
+	void ViewState::move(Camera_Movement direction)
+	{
+		if (interact_mode == FREE_VIEW) {
+			camera.ProcessKeyboard(direction, deltaTime);
+		}
+		else {
+			camera.ProcessKeyboard_GodView(direction, deltaTime);
+			camera.ObserveCenter();
+		}
+	}
+
+	// redraw needed for reasons the camera does not know about, set by the input thread when
+	// rendering runs on its own
+	std::atomic<bool> redrawRequest(true);
+
+	// first input event not yet taken, for input to present latency
+	static double input_ms = 0;
+
+	static void noteInput()
+	{
+		if (input_ms == 0)
+			input_ms = wallTimeMs();
+	}
+
+	// recording or replaying session, all polled keys, mouse and scroll pass through it
+	InputSession *session = NULL;
+
+	void setInputSession(InputSession *s)
+	{
+		session = s;
+	}
+
+	static bool replaying()
+	{
+		return session && session->replaying();
+	}
+
+	static bool keyDown(GLFWwindow *window, int key)
+	{
+		if (replaying())
+			return session->keyDown(key);
+		bool down = glfwGetKey(window, key) == GLFW_PRESS;
+		if (session && session->recording())
+			session->logKey(glfwGetTime(), key, down);
+		return down;
+	}
 
 	// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 	void processInput(GLFWwindow *window)
 	{
-		// per-frame time logic
+		// per-frame time logic, a replay runs on its own fixed step
 		// --------------------
-		float currentFrame = glfwGetTime();
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame;
+		if (replaying()) {
+			view.deltaTime = session->step();
+			for (const InputSession::Event &e : session->advance()) {
+				if (e.type == 'm')
+					view.applyMouse(e.v[0], e.v[1]);
+				else
+					view.camera.ProcessMouseScroll(e.v[0]);
+			}
+			if (session->finished())
+				glfwSetWindowShouldClose(window, true);
+		}
+		else {
+			float currentFrame = glfwGetTime();
+			view.deltaTime = currentFrame - view.lastFrame;
+			view.lastFrame = currentFrame;
+		}
 
 		// inputs
-		if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+		if (keyDown(window, GLFW_KEY_ESCAPE))
 			glfwSetWindowShouldClose(window, true);
 
-		if (interact_mode == FREE_VIEW) {
-			if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-				camera.ProcessKeyboard(FORWARD, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-				camera.ProcessKeyboard(BACKWARD, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-				camera.ProcessKeyboard(LEFT, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-				camera.ProcessKeyboard(RIGHT, deltaTime);
-		}
-		else {
-			if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-				camera.ProcessKeyboard_GodView(FORWARD, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-				camera.ProcessKeyboard_GodView(BACKWARD, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-				camera.ProcessKeyboard_GodView(LEFT, deltaTime);
-			if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-				camera.ProcessKeyboard_GodView(RIGHT, deltaTime);
+		if (keyDown(window, GLFW_KEY_W))
+			view.move(FORWARD);
+		if (keyDown(window, GLFW_KEY_S))
+			view.move(BACKWARD);
+		if (keyDown(window, GLFW_KEY_A))
+			view.move(LEFT);
+		if (keyDown(window, GLFW_KEY_D))
+			view.move(RIGHT);
+
+		if (session && session->recording())
+			session->logCamera(glfwGetTime(), view.camera);
+	}
 
-			camera.ObserveCenter();
-		}
+	ViewState& getDefaultView()
+	{
+		return view;
 	}
 
 	Camera& getDefaultCamera()
 	{
-		return camera;
+		return view.camera;
+	}
+
+	bool consumeRedrawRequest()
+	{
+		return redrawRequest.exchange(false);
+	}
+
+	void resetFrameTime()
+	{
+		view.lastFrame = glfwGetTime();
+	}
+
+	bool inputAnimating(GLFWwindow *window)
+	{
+		if (replaying())
+			return true;
+		for (int key : { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D }) {
+			if (glfwGetKey(window, key) == GLFW_PRESS)
+				return true;
+		}
+		return false;
+	}
+
+	double takeInputTime()
+	{
+		double t = input_ms;
+		input_ms = 0;
+		return t;
+	}
+
+	bool keyPressedOnce(GLFWwindow *window, int key)
+	{
+		static std::map<int, int> key_states;
+		int state = keyDown(window, key) ? GLFW_PRESS : GLFW_RELEASE;
+		bool pressed = (state == GLFW_PRESS && key_states[key] != GLFW_PRESS);
+		key_states[key] = state;
+		return pressed;
 	}
 
 	// glfw: whenever the window size changed (by OS or user resize) this callback function executes
@@ -80,40 +180,48 @@ namespace kandao { namespace OpenGL
 	{
 		// make sure the viewport matches the new window dimensions; note that width and 
 		// height will be significantly larger than specified on retina displays.
-		glViewport(0, 0, width, height);
+		// With a render thread the context is not current here, that one sets its viewport.
+		if (glfwGetCurrentContext() == window)
+			glViewport(0, 0, width, height);
+		redrawRequest = true;
+	}
+
+	// glfw: whenever the window contents are damaged and need to be redrawn
+	// ---------------------------------------------------------------------
+	static void window_refresh_callback(GLFWwindow* window)
+	{
+		redrawRequest = true;
 	}
 
 	// glfw: whenever the mouse moves, this callback is called
 	// -------------------------------------------------------
 	static void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 	{
-		if (firstMouse)
-		{
-			lastX = xpos;
-			lastY = ypos;
-			firstMouse = false;
-		}
-
-		float xoffset = xpos - lastX;
-		float yoffset = lastY - ypos; // reversed since y-coordinates go from bottom to top
-
-		lastX = xpos;
-		lastY = ypos;
-
-		camera.ProcessMouseMovement(xoffset, yoffset);
-		if (interact_mode == GOD_VIEW)
-			camera.ObserveCenter();
+		if (replaying())
+			return;
+		float xoffset, yoffset;
+		view.cursorOffset(xpos, ypos, xoffset, yoffset);
+
+		if (session && session->recording())
+			session->logMouse(glfwGetTime(), xoffset, yoffset);
+		view.applyMouse(xoffset, yoffset);
+		noteInput();
 	}
 
 	// glfw: whenever the mouse scroll wheel scrolls, this callback is called
 	// ----------------------------------------------------------------------
 	static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 	{
-		camera.ProcessMouseScroll(yoffset);
+		if (replaying())
+			return;
+		if (session && session->recording())
+			session->logScroll(glfwGetTime(), yoffset);
+		view.camera.ProcessMouseScroll(yoffset);
+		noteInput();
 	}
 
 	///////////////////////////////////// global functions /////////////////////////////////////
-	GLFWwindow* initOpenGL(bool hide, int width, int height)
+	GLFWwindow* initOpenGL(bool hide, int width, int height, int samples)
 	{
 		// Initialise GLFW
 		if (!glfwInit())
@@ -122,7 +230,7 @@ namespace kandao { namespace OpenGL
 			return NULL;
 		}
 
-		glfwWindowHint(GLFW_SAMPLES, 4);
+		glfwWindowHint(GLFW_SAMPLES, samples);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
@@ -138,6 +246,7 @@ namespace kandao { namespace OpenGL
 		}
 		glfwMakeContextCurrent(window);
 		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		glfwSetWindowRefreshCallback(window, window_refresh_callback);
 		glfwSetCursorPosCallback(window, mouse_callback);
 		glfwSetScrollCallback(window, scroll_callback);
 
@@ -170,6 +279,317 @@ namespace kandao { namespace OpenGL
 		glfwTerminate();
 	}
 
+	///////////////////////////////////// Mesh & Texture /////////////////////////////////////
+	void uploadMesh(const std::vector<float> &vertices, const std::vector<unsigned int> &indices, MeshBuffers &mesh,
+		const char *label)
+	{
+		glGenVertexArrays(1, &mesh.VAO);
+		glBindVertexArray(mesh.VAO);
+
+		glGenBuffers(1, &mesh.VBO);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.VBO);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+		trackBuffer(mesh.VBO, label, vertices.size() * sizeof(float));
+
+		glGenBuffers(1, &mesh.EBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+		trackBuffer(mesh.EBO, label, indices.size() * sizeof(unsigned int));
+
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(1);
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mesh.n_indices = indices.size();
+	}
+
+	void releaseMesh(MeshBuffers &mesh)
+	{
+		if (mesh.VAO) glDeleteVertexArrays(1, &mesh.VAO);
+		deleteBuffer(mesh.VBO);
+		deleteBuffer(mesh.EBO);
+		mesh = MeshBuffers();
+	}
+
+	GLuint makeTextureFromMat(const cv::Mat &src, GLint src_fmt, GLint src_type, GLint dst_fmt, const char *label)
+	{
+		int width = src.cols, height = src.rows;
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		glTexImage2D(GL_TEXTURE_2D, 0, dst_fmt, width, height, 0, src_fmt, src_type, src.data);
+		glGenerateMipmap(GL_TEXTURE_2D);
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		trackTexture(texture, label, width, height, dst_fmt, numMipLevels(width, height));
+		return texture;
+	}
+
+	GLuint makeTexture(int width, int height, GLint src_fmt, GLint src_type, GLint dst_fmt, const char *label)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		glTexImage2D(GL_TEXTURE_2D, 0, dst_fmt, width, height, 0, src_fmt, src_type, NULL);
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		trackTexture(texture, label, width, height, dst_fmt, 1);
+		return texture;
+	}
+
+	void uploadTextureRows(GLuint texture, int y0, const cv::Mat &rows, GLint src_fmt, GLint src_type)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(rows.step[0] / rows.elemSize()));
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, rows.cols, rows.rows, src_fmt, src_type, rows.data);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	GLuint makeTextureFromMats(const std::vector<cv::Mat> &levels, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		GLint min_filter, GLint mag_filter, const char *label)
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for (int i = 0; i < (int)levels.size(); ++i) {
+			const cv::Mat &level = levels[i];
+			glTexImage2D(GL_TEXTURE_2D, i, dst_fmt, level.cols, level.rows, 0, src_fmt, src_type, level.data);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		if (!levels.empty())
+			trackTexture(texture, label, levels[0].cols, levels[0].rows, dst_fmt, (int)levels.size());
+		return texture;
+	}
+
+	GLuint makeCubemapFromMats(const std::vector<cv::Mat> &faces, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		const char *label)
+	{
+		CV_Assert(faces.size() == 6);
+		int size = faces[0].cols;
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for (int i = 0; i < 6; ++i) {
+			CV_Assert(faces[i].cols == size && faces[i].rows == size && faces[i].isContinuous());
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, dst_fmt, size, size, 0, src_fmt, src_type,
+				faces[i].data);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+		trackTexture(texture, label, size, size, dst_fmt, numMipLevels(size, size), 6);
+		return texture;
+	}
+
+	GLuint makeTextureArrayFromMat(const cv::Mat &layers, int n_layers, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		bool mipmap, const char *label)
+	{
+		CV_Assert(n_layers > 0 && layers.rows % n_layers == 0 && layers.isContinuous());
+		int width = layers.cols, height = layers.rows / n_layers;
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, mipmap ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, mipmap ? GL_LINEAR : GL_NEAREST);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, dst_fmt, width, height, n_layers, 0, src_fmt, src_type, layers.data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if (mipmap)
+			glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		trackTexture(texture, label, width, height, dst_fmt, mipmap ? numMipLevels(width, height) : 1, n_layers);
+		return texture;
+	}
+
+	///////////////////////////////////// Memory /////////////////////////////////////
+	// bytes per texel as allocated; 3-channel formats are counted padded to 4, as drivers store them
+	static int texelBytes(GLint internal_format, std::string &name)
+	{
+		switch (internal_format) {
+		case GL_RED: case GL_R8: name = "R8"; return 1;
+		case GL_RG: case GL_RG8: name = "RG8"; return 2;
+		case GL_RGB: case GL_RGB8: name = "RGB8"; return 4;
+		case GL_RGBA: case GL_RGBA8: name = "RGBA8"; return 4;
+		case GL_R16: name = "R16"; return 2;
+		case GL_R16F: name = "R16F"; return 2;
+		case GL_R32F: name = "R32F"; return 4;
+		case GL_RG16F: name = "RG16F"; return 4;
+		case GL_RG32F: name = "RG32F"; return 8;
+		case GL_RGBA16F: name = "RGBA16F"; return 8;
+		case GL_RGBA32F: name = "RGBA32F"; return 16;
+		case GL_DEPTH_COMPONENT24: name = "DEPTH24"; return 4;
+		case GL_DEPTH24_STENCIL8: name = "DEPTH24_STENCIL8"; return 4;
+		case GL_DEPTH_COMPONENT32F: name = "DEPTH32F"; return 4;
+		}
+		name = format("0x%04X", internal_format);
+		return 4;
+	}
+
+	static void labelObject(GLenum identifier, GLuint name, const char *label)
+	{
+		if (GLEW_KHR_debug && label)
+			glObjectLabel(identifier, name, -1, label);
+	}
+
+	int numMipLevels(int width, int height)
+	{
+		int n = 1;
+		for (int size = max(width, height); size > 1; size /= 2)
+			++n;
+		return n;
+	}
+
+	void trackTexture(GLuint texture, const char *label, int width, int height, GLint internal_format, int n_levels,
+		int n_layers)
+	{
+		string name;
+		size_t texel = texelBytes(internal_format, name), bytes = 0;
+		for (int i = 0; i < n_levels; ++i)
+			bytes += texel * max(width >> i, 1) * max(height >> i, 1) * n_layers;
+		string size = n_layers > 1 ? format("%dx%dx%d", width, height, n_layers) : format("%dx%d", width, height);
+		MemoryTracker::instance().addGpu(GPU_TEXTURE, texture, label,
+			format("%s %s, %d levels", name.c_str(), size.c_str(), n_levels), bytes);
+		labelObject(GL_TEXTURE, texture, label);
+	}
+
+	void trackBuffer(GLuint buffer, const char *label, size_t bytes)
+	{
+		MemoryTracker::instance().addGpu(GPU_BUFFER, buffer, label, "", bytes);
+		labelObject(GL_BUFFER, buffer, label);
+	}
+
+	void trackRenderbuffer(GLuint renderbuffer, const char *label, int width, int height, GLint internal_format,
+		int samples)
+	{
+		string name;
+		size_t bytes = (size_t)texelBytes(internal_format, name) * width * height * max(samples, 1);
+		MemoryTracker::instance().addGpu(GPU_RENDERBUFFER, renderbuffer, label,
+			format("%s %dx%d, %dx MSAA", name.c_str(), width, height, max(samples, 1)), bytes);
+		labelObject(GL_RENDERBUFFER, renderbuffer, label);
+	}
+
+	void deleteTexture(GLuint &texture)
+	{
+		if (!texture)
+			return;
+		MemoryTracker::instance().removeGpu(GPU_TEXTURE, texture);
+		glDeleteTextures(1, &texture);
+		texture = 0;
+	}
+
+	void deleteBuffer(GLuint &buffer)
+	{
+		if (!buffer)
+			return;
+		MemoryTracker::instance().removeGpu(GPU_BUFFER, buffer);
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+
+	void deleteRenderbuffer(GLuint &renderbuffer)
+	{
+		if (!renderbuffer)
+			return;
+		MemoryTracker::instance().removeGpu(GPU_RENDERBUFFER, renderbuffer);
+		glDeleteRenderbuffers(1, &renderbuffer);
+		renderbuffer = 0;
+	}
+
+	///////////////////////////////////// GPU Timer /////////////////////////////////////
+	GpuTimer::~GpuTimer()
+	{
+		// the context may already be gone at static destruction, only delete what was made
+		if (queries[0] && glfwGetCurrentContext())
+			glDeleteQueries(N_QUERIES, queries);
+	}
+
+	void GpuTimer::begin()
+	{
+		if (!queries[0])
+			glGenQueries(N_QUERIES, queries);
+
+		// all queries in flight, drop this sample rather than wait
+		if (head - tail >= N_QUERIES) {
+			running = false;
+			return;
+		}
+		glBeginQuery(GL_TIME_ELAPSED, queries[head % N_QUERIES]);
+		running = true;
+	}
+
+	void GpuTimer::end()
+	{
+		if (!running)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		++head;
+		running = false;
+	}
+
+	bool GpuTimer::poll()
+	{
+		bool updated = false;
+		while (tail < head) {
+			GLuint query = queries[tail % N_QUERIES];
+			GLint available = 0;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				break;
+
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+			last_ms = ns / 1e6;
+			sum_ms += last_ms;
+			++n_samples;
+			++tail;
+			updated = true;
+		}
+		return updated;
+	}
+
 	///////////////////////////////////// Shader Program /////////////////////////////////////
 	GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path)
 	{
@@ -208,69 +628,68 @@ namespace kandao { namespace OpenGL
 		return LoadShadersFromString(VertexShaderCode.c_str(), FragmentShaderCode.c_str());
 	}
 
-	GLuint LoadShadersFromString(const char *vertex_shader, const char *fragment_shader)
+	// info logs are only fetched when something failed, drivers can be slow to produce them
+	static bool compileShader(GLuint shader_id, const char *source, const char *stage)
 	{
-		GLuint programID;
+		glShaderSource(shader_id, 1, &source, NULL);
+		glCompileShader(shader_id);
+
+		GLint result = GL_FALSE;
+		glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
+		if (result)
+			return true;
+
+		int info_length = 0;
+		glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &info_length);
+		std::vector<char> message(info_length + 1);
+		glGetShaderInfoLog(shader_id, info_length, NULL, &message[0]);
+		printf("compiling %s shader failed: %s\n", stage, &message[0]);
+		return false;
+	}
 
-		// Create the shaders
+	static bool checkLinkStatus(GLuint program_id)
+	{
+		GLint result = GL_FALSE;
+		glGetProgramiv(program_id, GL_LINK_STATUS, &result);
+		if (result)
+			return true;
+
+		int info_length = 0;
+		glGetProgramiv(program_id, GL_INFO_LOG_LENGTH, &info_length);
+		std::vector<char> message(info_length + 1);
+		glGetProgramInfoLog(program_id, info_length, NULL, &message[0]);
+		printf("linking program failed: %s\n", &message[0]);
+		return false;
+	}
+
+	GLuint LoadShadersFromString(const char *vertex_shader, const char *fragment_shader, bool retrievable)
+	{
+		// Create and compile the shaders
 		GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
 		GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-		GLint Result = GL_FALSE;
-		int InfoLogLength;
-
-		// Compile Vertex Shader
-		printf("Compiling vertex shader\n");
-		char const * VertexSourcePointer = vertex_shader;
-		glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
-		glCompileShader(VertexShaderID);
-
-		// Check Vertex Shader
-		glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-		glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		if (InfoLogLength > 0) {
-			std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
-			glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-			printf("%s\n", &VertexShaderErrorMessage[0]);
-		}
-
-		// Compile Fragment Shader
-		printf("Compiling fragment shader\n");
-		char const * FragmentSourcePointer = fragment_shader;
-		glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
-		glCompileShader(FragmentShaderID);
-
-		// Check Fragment Shader
-		glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-		glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		if (InfoLogLength > 0) {
-			std::vector<char> FragmentShaderErrorMessage(InfoLogLength + 1);
-			glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-			printf("%s\n", &FragmentShaderErrorMessage[0]);
-		}
+		bool ok = compileShader(VertexShaderID, vertex_shader, "vertex");
+		ok = compileShader(FragmentShaderID, fragment_shader, "fragment") && ok;
 
 		// Link the program
-		printf("Linking program\n");
-		programID = glCreateProgram();
-		glAttachShader(programID, VertexShaderID);
-		glAttachShader(programID, FragmentShaderID);
-		glLinkProgram(programID);
-
-		// Check the program
-		glGetProgramiv(programID, GL_LINK_STATUS, &Result);
-		glGetProgramiv(programID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		if (InfoLogLength > 0) {
-			std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
-			glGetProgramInfoLog(programID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-			printf("%s\n", &ProgramErrorMessage[0]);
+		GLuint programID = glCreateProgram();
+		if (ok) {
+			glAttachShader(programID, VertexShaderID);
+			glAttachShader(programID, FragmentShaderID);
+			if (retrievable)
+				glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glLinkProgram(programID);
+			ok = checkLinkStatus(programID);
+
+			glDetachShader(programID, VertexShaderID);
+			glDetachShader(programID, FragmentShaderID);
 		}
 
-
-		glDetachShader(programID, VertexShaderID);
-		glDetachShader(programID, FragmentShaderID);
-
 		glDeleteShader(VertexShaderID);
 		glDeleteShader(FragmentShaderID);
+		if (!ok) {
+			glDeleteProgram(programID);
+			return 0;
+		}
 
 		// Use our shader
 		glUseProgram(programID);
@@ -284,6 +703,15 @@ namespace kandao { namespace OpenGL
 		return (this->ID != 0);
 	}
 
+	bool Shader::loadShadersFromString(const char * vertex_shader, const char * fragment_shader, ProgramCache *cache,
+		const char *name)
+	{
+		if (!cache)
+			return loadShadersFromString(vertex_shader, fragment_shader);
+		this->ID = cache->load(vertex_shader, fragment_shader, name);
+		return (this->ID != 0);
+	}
+
 	// activate the shader
 	// ------------------------------------------------------------------------
 	void Shader::use()
@@ -7,6 +7,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "utils/camera.h"
+#include "utils/memory.h"
 
 #define GLFW_EXPOSE_NATIVE_WIN32
 
@@ -21,18 +22,133 @@
 namespace kandao { namespace OpenGL
 {
 	///////////////////////////////////// Interaction /////////////////////////////////////
+	enum INTERACT_MODE
+	{
+		FREE_VIEW,
+		GOD_VIEW,
+	};
+
+	// camera and input state of one viewer; the window has its own, driven by processInput,
+	// render server sessions each own one fed by their client
+	struct ViewState
+	{
+		Camera camera = Camera(glm::vec3(0.0f, 0.0f, 3.0f));
+		float lastX = 400.0f, lastY = 300.0f;	// center of the default 800x600 window
+		bool firstMouse = true;
+		INTERACT_MODE interact_mode = FREE_VIEW;
+		float deltaTime = 0.0f;	// time between current frame and last frame
+		float lastFrame = 0.0f;
+
+		// absolute cursor position to movement since the last one, the first one only sets the origin
+		void cursorOffset(float xpos, float ypos, float &xoffset, float &yoffset);
+		void applyMouse(float xoffset, float yoffset);
+		// WASD over deltaTime, orbiting the center in GOD_VIEW
+		void move(Camera_Movement direction);
+	};
+
 	void processInput(GLFWwindow *window);
+	ViewState& getDefaultView();
 	Camera& getDefaultCamera();
+	// window resized or damaged since the last call
+	bool consumeRedrawRequest();
+	// restart the per-frame delta after blocking in glfwWaitEvents*
+	void resetFrameTime();
+	// the camera moves without new events: a movement key is held or a session replays
+	bool inputAnimating(GLFWwindow *window);
+	// wall time of the first mouse or scroll event handled since the last call, 0 without
+	double takeInputTime();
+	// true only on the first poll after the key goes down
+	bool keyPressedOnce(GLFWwindow *window, int key);
+
+	class InputSession;
+	// route all input through a recording or replaying session, NULL for live input only
+	void setInputSession(InputSession *session);
 
 	///////////////////////////////////// global functions /////////////////////////////////////
-	GLFWwindow* initOpenGL(bool hide = true, int width = 800, int height = 600);
+	// samples: MSAA of the window framebuffer, 0 when rendering offscreen and blitting into it
+	GLFWwindow* initOpenGL(bool hide = true, int width = 800, int height = 600, int samples = 4);
 	int glCheckError();
 	void terminateOpenGL();
 
+	///////////////////////////////////// Mesh & Texture /////////////////////////////////////
+	// GL objects of one indexed mesh with the interleaved [X, Y, Z, u, v] layout
+	struct MeshBuffers
+	{
+		GLuint VAO = 0, VBO = 0, EBO = 0;
+		GLsizei n_indices = 0;
+		size_t index_offset = 0;	// byte offset of the first index in EBO
+	};
+
+	void uploadMesh(const std::vector<float> &vertices, const std::vector<unsigned int> &indices, MeshBuffers &mesh,
+		const char *label = "mesh");
+	void releaseMesh(MeshBuffers &mesh);
+	// every texture made here is tracked under its label, delete it with deleteTexture
+	GLuint makeTextureFromMat(const cv::Mat &src, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		const char *label = "texture");
+	// storage only, filled row by row with uploadTextureRows, then mipmapped with glGenerateMipmap
+	GLuint makeTexture(int width, int height, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		const char *label = "texture");
+	void uploadTextureRows(GLuint texture, int y0, const cv::Mat &rows, GLint src_fmt, GLint src_type);
+	// explicit mip chain, levels[i] becomes mip level i; nearest by default for texelFetch style sampling
+	GLuint makeTextureFromMats(const std::vector<cv::Mat> &levels, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		GLint min_filter = GL_NEAREST_MIPMAP_NEAREST, GLint mag_filter = GL_NEAREST, const char *label = "texture");
+	// GL_TEXTURE_CUBE_MAP from square faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X + i order, filtered
+	// like makeTextureFromMat; also turns on seamless filtering across face edges
+	GLuint makeCubemapFromMats(const std::vector<cv::Mat> &faces, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		const char *label = "cubemap");
+	// GL_TEXTURE_2D_ARRAY from n_layers images of equal size stacked vertically in one continuous Mat,
+	// layer i in rows [i * rows / n_layers, (i + 1) * rows / n_layers); wraps S like makeTextureFromMat.
+	// mipmap: trilinear filtering with a full chain, otherwise nearest for exact fetches
+	GLuint makeTextureArrayFromMat(const cv::Mat &layers, int n_layers, GLint src_fmt, GLint src_type, GLint dst_fmt,
+		bool mipmap = true, const char *label = "texture array");
+
+	///////////////////////////////////// Memory /////////////////////////////////////
+	// register with the MemoryTracker and, with KHR_debug, name the object for GL debuggers;
+	// registering again after reallocating the storage replaces the old size
+	void trackTexture(GLuint texture, const char *label, int width, int height, GLint internal_format, int n_levels,
+		int n_layers = 1);
+	void trackBuffer(GLuint buffer, const char *label, size_t bytes);
+	void trackRenderbuffer(GLuint renderbuffer, const char *label, int width, int height, GLint internal_format,
+		int samples);
+	// full chain down to 1x1
+	int numMipLevels(int width, int height);
+	// untrack, delete and zero the name; 0 is ignored
+	void deleteTexture(GLuint &texture);
+	void deleteBuffer(GLuint &buffer);
+	void deleteRenderbuffer(GLuint &renderbuffer);
+
+	///////////////////////////////////// GPU Timer /////////////////////////////////////
+	// GL_TIME_ELAPSED over a small ring of queries, results are read back a few frames late
+	// so measuring never stalls the pipeline
+	class GpuTimer
+	{
+	public:
+		~GpuTimer();
+		void begin();
+		void end();
+		// collect finished queries, returns true when a new sample arrived
+		bool poll();
+
+		double last_ms = 0;
+		double sum_ms = 0;
+		int n_samples = 0;
+		double average() const { return n_samples ? sum_ms / n_samples : 0; }
+		void resetAverage() { sum_ms = 0; n_samples = 0; }
+
+	private:
+		static const int N_QUERIES = 4;
+		GLuint queries[N_QUERIES] = { 0 };
+		int head = 0, tail = 0;
+		bool running = false;
+	};
+
 
 	///////////////////////////////////// Shader Program /////////////////////////////////////
 	GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path);
-	GLuint LoadShadersFromString(const char * vertex_shader, const char * fragment_shader);
+	// returns 0 when compiling or linking fails; retrievable asks the driver to keep the program binary
+	GLuint LoadShadersFromString(const char * vertex_shader, const char * fragment_shader, bool retrievable = false);
+
+	class ProgramCache;
 
 	// https://learnopengl.com/Introduction
 	class Shader
@@ -43,6 +159,9 @@ namespace kandao { namespace OpenGL
 		// ------------------------------------------------------------------------
 		Shader() {}
 		bool loadShadersFromString(const char * vertex_shader, const char * fragment_shader);
+		// through the program binary cache when given
+		bool loadShadersFromString(const char * vertex_shader, const char * fragment_shader, ProgramCache *cache,
+			const char *name = "program");
 
 		// activate the shader
 		// ------------------------------------------------------------------------